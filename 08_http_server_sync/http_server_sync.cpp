@@ -23,8 +23,15 @@
 #include <memory>
 #include <string>
 #include <thread>
+#include <vector>
 
 #include "http_server_sync.hpp"
+#include "../Server/file_range_body.hpp"
+#include "../Server/mime_types.hpp"
+
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
@@ -36,42 +43,18 @@ using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 // Report a failure
 void fail(beast::error_code ec, char const* what)
 {
+#ifdef ADAM_ASYNC_LOG
+	server_log::write(server_log::level::error, what, ec.message());
+#else
 	std::cerr << what << ": " << ec.message() << "\n";
+#endif
 }
 
 // Return a reasonable mime type based on the extension of a file.
 beast::string_view mime_type(beast::string_view path)
 {
-	using beast::iequals;
-	auto const ext = [&path]
-	{
-		auto const pos = path.rfind(".");
-		if (pos == beast::string_view::npos)
-			return beast::string_view{};
-		return path.substr(pos);
-	}();
-	if (iequals(ext, ".htm"))  return "text/html";
-	if (iequals(ext, ".html")) return "text/html";
-	if (iequals(ext, ".php"))  return "text/html";
-	if (iequals(ext, ".css"))  return "text/css";
-	if (iequals(ext, ".txt"))  return "text/plain";
-	if (iequals(ext, ".js"))   return "application/javascript";
-	if (iequals(ext, ".json")) return "application/json";
-	if (iequals(ext, ".xml"))  return "application/xml";
-	if (iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-	if (iequals(ext, ".flv"))  return "video/x-flv";
-	if (iequals(ext, ".png"))  return "image/png";
-	if (iequals(ext, ".jpe"))  return "image/jpeg";
-	if (iequals(ext, ".jpeg")) return "image/jpeg";
-	if (iequals(ext, ".jpg"))  return "image/jpeg";
-	if (iequals(ext, ".gif"))  return "image/gif";
-	if (iequals(ext, ".bmp"))  return "image/bmp";
-	if (iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-	if (iequals(ext, ".tiff")) return "image/tiff";
-	if (iequals(ext, ".tif"))  return "image/tiff";
-	if (iequals(ext, ".svg"))  return "image/svg+xml";
-	if (iequals(ext, ".svgz")) return "image/svg+xml";
-	return "application/text";
+	static server_async::mime_table const types;
+	return types.find(path);
 }
 
 // Append an HTTP rel-path to a local filesystem path.
@@ -179,14 +162,58 @@ void handle_request(
 	// Cache the size since we need it after the move
 	auto const size = body.size();
 
+	// Conditional and range requests are answered from the file's validators
+	auto const validators = server_async::validators_of(path, size);
+	auto const set_fields = [&](auto& res)
+	{
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_type, mime_type(path));
+		res.set(http::field::accept_ranges, "bytes");
+		res.set(http::field::etag, validators.etag);
+		res.set(http::field::last_modified, validators.last_modified);
+		res.keep_alive(req.keep_alive());
+	};
+
+	if (server_async::not_modified(req, validators.etag, validators.mtime))
+	{
+		http::response<http::empty_body> res{ http::status::not_modified, req.version() };
+		set_fields(res);
+		res.erase(http::field::content_type);
+		return send(std::move(res));
+	}
+
+	// Range only applies to GET
+	std::vector<server_async::byte_range> ranges;
+	auto const range = req.method() == http::verb::get && server_async::if_range_matches(req, validators.etag, validators.mtime)
+		? server_async::parse_range(req[http::field::range], size, ranges)
+		: server_async::range_status::full;
+
+	if (range == server_async::range_status::unsatisfiable)
+	{
+		http::response<http::empty_body> res{ http::status::range_not_satisfiable, req.version() };
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_range, "bytes */" + std::to_string(size));
+		res.content_length(0);
+		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+	}
+
 	// Respond to HEAD request
 	if (req.method() == http::verb::head)
 	{
 		http::response<http::empty_body> res{ http::status::ok, req.version() };
-		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-		res.set(http::field::content_type, mime_type(path));
+		set_fields(res);
 		res.content_length(size);
-		res.keep_alive(req.keep_alive());
+		return send(std::move(res));
+	}
+
+	// Respond to a range request, only the slices of the file are read
+	if (range == server_async::range_status::partial)
+	{
+		http::response<server_async::file_range_body> res{ http::status::partial_content, req.version() };
+		set_fields(res);
+		res.body().file = std::move(body.file());
+		server_async::set_ranges(res, ranges, size, mime_type(path));
 		return send(std::move(res));
 	}
 
@@ -196,10 +223,8 @@ void handle_request(
 		std::make_tuple(std::move(body)),
 		std::make_tuple(http::status::ok, req.version()) };
 
-	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-	res.set(http::field::content_type, mime_type(path));
+	set_fields(res);
 	res.content_length(size);
-	res.keep_alive(req.keep_alive());
 	return send(std::move(res));
 }
 
@@ -280,6 +305,11 @@ void do_session(tcp::socket& socket, std::shared_ptr<std::string const> const& d
 
 void http_server_sync()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 		/*if (argc != 4)
 		{
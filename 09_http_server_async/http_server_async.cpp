@@ -23,57 +23,61 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
+#include <variant>
 #include <vector>
 
 #include "http_server_async.hpp"
+#include "../Server/file_range_body.hpp"
+#include "../Server/mime_types.hpp"
+#include "../Server/session_memory.hpp"
+#include "../Server/session_pool.hpp"
+
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
+
+#ifdef ADAM_TIMER_WHEEL
+// One timer for all the connections of a thread instead of one each
+#include "../Server/timer_wheel.hpp"
+#endif
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
 namespace net = boost::asio;            // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
+#ifdef ADAM_TIMER_WHEEL
+// Only used from the thread of its io_context, so it does not lock
+using connection_timers = server_async::timer_wheel<server_async::null_mutex>;
+
+// Each thread runs its own io_context and wheel, a connection
+// stays on the thread it was accepted for
+struct io_thread
+{
+	net::io_context ioc{ 1 };
+	std::shared_ptr<connection_timers> timers = std::make_shared<connection_timers>(ioc.get_executor());
+};
+#endif
+
 
 // Report a failure
 void fail(beast::error_code ec, char const* what)
 {
+#ifdef ADAM_ASYNC_LOG
+	server_log::write(server_log::level::error, what, ec.message());
+#else
 	std::cerr << what << ": " << ec.message() << "\n";
+#endif
 }
 
 // Return a reasonable mime type based on the extension of a file.
 beast::string_view mime_type(beast::string_view path)
 {
-	using beast::iequals;
-	auto const ext = [&path]
-	{
-		auto const pos = path.rfind(".");
-		if (pos == beast::string_view::npos)
-			return beast::string_view{};
-		return path.substr(pos);
-	}();
-	if (iequals(ext, ".htm"))  return "text/html";
-	if (iequals(ext, ".html")) return "text/html";
-	if (iequals(ext, ".php"))  return "text/html";
-	if (iequals(ext, ".css"))  return "text/css";
-	if (iequals(ext, ".txt"))  return "text/plain";
-	if (iequals(ext, ".js"))   return "application/javascript";
-	if (iequals(ext, ".json")) return "application/json";
-	if (iequals(ext, ".xml"))  return "application/xml";
-	if (iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-	if (iequals(ext, ".flv"))  return "video/x-flv";
-	if (iequals(ext, ".png"))  return "image/png";
-	if (iequals(ext, ".jpe"))  return "image/jpeg";
-	if (iequals(ext, ".jpeg")) return "image/jpeg";
-	if (iequals(ext, ".jpg"))  return "image/jpeg";
-	if (iequals(ext, ".gif"))  return "image/gif";
-	if (iequals(ext, ".bmp"))  return "image/bmp";
-	if (iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-	if (iequals(ext, ".tiff")) return "image/tiff";
-	if (iequals(ext, ".tif"))  return "image/tiff";
-	if (iequals(ext, ".svg"))  return "image/svg+xml";
-	if (iequals(ext, ".svgz")) return "image/svg+xml";
-	return "application/text";
+	static server_async::mime_table const types;
+	return types.find(path);
 }
 
 // Append an HTTP rel-path to a local filesystem path.
@@ -108,15 +112,18 @@ std::string path_cat(beast::string_view base, beast::string_view path)
 template<class Body, class Allocator, class Send>
 void handle_request(beast::string_view doc_root, http::request<Body, http::basic_fields<Allocator>>&& req, Send&& send)
 {
+	// The responses are allocated like the request
+	using text_body = http::basic_string_body<char, std::char_traits<char>, Allocator>;
+
 	// Returns a bad request response
 	auto const bad_request =
 		[&req](beast::string_view why)
 	{
-		http::response<http::string_body> res{ http::status::bad_request, req.version() };
+		auto res = server_async::make_response<text_body>(http::status::bad_request, req, req.get_allocator());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, "text/html");
 		res.keep_alive(req.keep_alive());
-		res.body() = std::string(why);
+		res.body().assign(why.data(), why.size());
 		res.prepare_payload();
 		return res;
 	};
@@ -125,11 +132,11 @@ void handle_request(beast::string_view doc_root, http::request<Body, http::basic
 	auto const not_found =
 		[&req](beast::string_view target)
 	{
-		http::response<http::string_body> res{ http::status::not_found, req.version() };
+		auto res = server_async::make_response<text_body>(http::status::not_found, req, req.get_allocator());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, "text/html");
 		res.keep_alive(req.keep_alive());
-		res.body() = "The resource '" + std::string(target) + "' was not found.";
+		res.body().append("The resource '").append(target.data(), target.size()).append("' was not found.");
 		res.prepare_payload();
 		return res;
 	};
@@ -138,11 +145,11 @@ void handle_request(beast::string_view doc_root, http::request<Body, http::basic
 	auto const server_error =
 		[&req](beast::string_view what)
 	{
-		http::response<http::string_body> res{ http::status::internal_server_error, req.version() };
+		auto res = server_async::make_response<text_body>(http::status::internal_server_error, req, req.get_allocator());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, "text/html");
 		res.keep_alive(req.keep_alive());
-		res.body() = "An error occurred: '" + std::string(what) + "'";
+		res.body().append("An error occurred: '").append(what.data(), what.size()).append("'");
 		res.prepare_payload();
 		return res;
 	};
@@ -179,27 +186,66 @@ void handle_request(beast::string_view doc_root, http::request<Body, http::basic
 	// Cache the size since we need it after the move
 	auto const size = body.size();
 
-	// Respond to HEAD request
-	if (req.method() == http::verb::head)
+	// Conditional and range requests are answered from the file's validators
+	auto const validators = server_async::validators_of(path, size);
+	auto const set_fields = [&](auto& res)
 	{
-		http::response<http::empty_body> res{ http::status::ok, req.version() };
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, mime_type(path));
-		res.content_length(size);
+		res.set(http::field::accept_ranges, "bytes");
+		res.set(http::field::etag, validators.etag);
+		res.set(http::field::last_modified, validators.last_modified);
+		res.keep_alive(req.keep_alive());
+	};
+
+	if (server_async::not_modified(req, validators.etag, validators.mtime))
+	{
+		auto res = server_async::make_response<http::empty_body>(http::status::not_modified, req);
+		set_fields(res);
+		res.erase(http::field::content_type);
+		return send(std::move(res));
+	}
+
+	// Range only applies to GET
+	std::vector<server_async::byte_range> ranges;
+	auto const range = req.method() == http::verb::get && server_async::if_range_matches(req, validators.etag, validators.mtime)
+		? server_async::parse_range(req[http::field::range], size, ranges)
+		: server_async::range_status::full;
+
+	if (range == server_async::range_status::unsatisfiable)
+	{
+		auto res = server_async::make_response<http::empty_body>(http::status::range_not_satisfiable, req);
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_range, "bytes */" + std::to_string(size));
+		res.content_length(0);
 		res.keep_alive(req.keep_alive());
 		return send(std::move(res));
 	}
 
+	// Respond to HEAD request
+	if (req.method() == http::verb::head)
+	{
+		auto res = server_async::make_response<http::empty_body>(http::status::ok, req);
+		set_fields(res);
+		res.content_length(size);
+		return send(std::move(res));
+	}
+
+	// Respond to a range request, only the slices of the file are read
+	if (range == server_async::range_status::partial)
+	{
+		auto res = server_async::make_response<server_async::file_range_body>(http::status::partial_content, req);
+		set_fields(res);
+		res.body().file = std::move(body.file());
+		server_async::set_ranges(res, ranges, size, mime_type(path));
+		return send(std::move(res));
+	}
+
 	// Respond to GET request
-	http::response<http::file_body> res{
-		std::piecewise_construct,
-		std::make_tuple(std::move(body)),
-		std::make_tuple(http::status::ok, req.version()) };
+	auto res = server_async::make_response<http::file_body>(http::status::ok, req, std::move(body));
 
-	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-	res.set(http::field::content_type, mime_type(path));
+	set_fields(res);
 	res.content_length(size);
-	res.keep_alive(req.keep_alive());
 	return send(std::move(res));
 }
 
@@ -207,8 +253,17 @@ void handle_request(beast::string_view doc_root, http::request<Body, http::basic
 
 
 
-// Handles an HTTP server connection
-class session : public std::enable_shared_from_this<session>
+// The responses produced by handle_request. The session owns
+// one and reuses it for every request on the connection.
+using response_slot = std::variant<
+	std::monostate,
+	http::response<server_async::session_string_body, server_async::session_fields>,
+	http::response<http::empty_body, server_async::session_fields>,
+	http::response<http::file_body, server_async::session_fields>,
+	http::response<server_async::file_range_body, server_async::session_fields>>;
+
+// Handles an HTTP server connection, then the next one its listener accepts
+class session : public server_async::pooled_session<session>
 {
 	// This is the C++11 equivalent of a generic lambda.
 	// The function object is used to send an HTTP message.
@@ -223,37 +278,65 @@ class session : public std::enable_shared_from_this<session>
 		{
 			// The lifetime of the message has to extend
 			// for the duration of the async operation so
-			// we use a shared_ptr to manage it.
-			auto sp = std::make_shared<
-				http::message<isRequest, Body, Fields>>(std::move(msg));
-
-			// Store a type-erased version of the shared
-			// pointer in the class to keep it alive.
-			self_.res_ = sp;
+			// it is stored in the session's response slot.
+			auto& res = self_.res_.template emplace<http::message<isRequest, Body, Fields>>(std::move(msg));
 
 			// Write the response
-			http::async_write(self_.stream_, *sp,
-				beast::bind_front_handler(&session::on_write, self_.shared_from_this(), sp->need_eof()));
+			http::async_write(self_.stream_, res,
+				beast::bind_front_handler(&session::on_write, self_.self(), res.need_eof()));
 		}
 	};
 
 	beast::tcp_stream stream_;
 	beast::flat_buffer buffer_;
 	std::shared_ptr<std::string const> doc_root_;
-	http::request<http::string_body> req_;
-	std::shared_ptr<void> res_;
+
+	// The request and the response are allocated here, so it is declared first
+	server_async::session_memory memory_;
+	std::optional<http::request_parser<server_async::session_string_body, server_async::session_allocator>> parser_;
+	response_slot res_;
 	send_lambda lambda_;
+#ifdef ADAM_TIMER_WHEEL
+	std::shared_ptr<connection_timers> timers_;
+	connection_timers::entry timeout_;
+#endif
 
 public:
-	// Take ownership of the stream
+	// Made by the listener's pool, the connection is accepted into socket()
+#ifdef ADAM_TIMER_WHEEL
+	session(
+		net::any_io_executor ex,
+		std::shared_ptr<std::string const> const& doc_root,
+		std::shared_ptr<connection_timers> const& timers)
+		: stream_(std::move(ex))
+		, doc_root_(doc_root)
+		, lambda_(*this)
+		, timers_(timers)
+		, timeout_(*timers_)
+	{
+		// The wheel is expiring entries here, so only post to the connection
+		timeout_.on_expire([this]
+		{
+			if (auto self = try_self())
+				net::post(stream_.get_executor(),
+					[self = std::move(self)] { self->on_timeout(); });
+		});
+	}
+#else
 	session(
-		tcp::socket&& socket,
+		net::any_io_executor ex,
 		std::shared_ptr<std::string const> const& doc_root)
-		: stream_(std::move(socket))
+		: stream_(std::move(ex))
 		, doc_root_(doc_root)
 		, lambda_(*this)
 	{
 	}
+#endif
+
+	tcp::socket& socket()
+	{
+		return stream_.socket();
+	}
 
 	// Start the asynchronous operation
 	void run()
@@ -261,18 +344,53 @@ public:
 		do_read();
 	}
 
+	// Called by the pool with the last reference, the buffers are kept
+	bool reset()
+	{
+#ifdef ADAM_TIMER_WHEEL
+		timeout_.cancel();
+#endif
+		stream_.close();
+
+		parser_.reset();
+		res_ = std::monostate{};
+		memory_.reset();
+		buffer_.clear();
+		return true;
+	}
+
+#ifdef ADAM_TIMER_WHEEL
+	void on_timeout()
+	{
+		// Armed again since it expired
+		if (timeout_.armed())
+			return;
+
+		// The pending operation completes with operation_aborted
+		stream_.close();
+	}
+#endif
+
 	void do_read()
 	{
-		// Make the request empty before reading,
-		// otherwise the operation behavior is undefined.
-		req_ = {};
+		// The last request and response are destroyed, so their
+		// memory is reused by a new parser for the next request.
+		parser_.reset();
+		memory_.reset();
+		parser_.emplace(std::piecewise_construct,
+			std::make_tuple(memory_.allocator()),
+			std::make_tuple(memory_.allocator()));
 
 		// Set the timeout.
+#ifdef ADAM_TIMER_WHEEL
+		timeout_.arm(std::chrono::seconds(30));
+#else
 		stream_.expires_after(std::chrono::seconds(30));
+#endif
 
 		// Read a request
-		http::async_read(stream_, buffer_, req_,
-			beast::bind_front_handler(&session::on_read, shared_from_this()));
+		http::async_read(stream_, buffer_, *parser_,
+			beast::bind_front_handler(&session::on_read, self()));
 	}
 
 	void on_read(beast::error_code ec, std::size_t bytes_transferred)
@@ -287,7 +405,7 @@ public:
 			return fail(ec, "read");
 
 		// Send the response
-		handle_request(*doc_root_, std::move(req_), lambda_);
+		handle_request(*doc_root_, parser_->release(), lambda_);
 	}
 
 	void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred)
@@ -304,8 +422,8 @@ public:
 			return do_close();
 		}
 
-		// We're done with the response so delete it
-		res_ = nullptr;
+		// We're done with the response so release it
+		res_ = std::monostate{};
 
 		// Read another request
 		do_read();
@@ -329,8 +447,28 @@ class listener : public std::enable_shared_from_this<listener>
 	net::io_context& ioc_;
 	tcp::acceptor acceptor_;
 	std::shared_ptr<std::string const> doc_root_;
+#ifdef ADAM_TIMER_WHEEL
+	std::vector<std::shared_ptr<io_thread>> threads_;
+	std::size_t next_thread_ = 0;
+#endif
+
+	// Sessions of closed connections, accepted into again
+	std::shared_ptr<server_async::session_pool<session>> sessions_ =
+		std::make_shared<server_async::session_pool<session>>();
+	boost::intrusive_ptr<session> next_;
 
 public:
+#ifdef ADAM_TIMER_WHEEL
+	// Accepts on the first thread for all of them
+	listener(
+		std::vector<std::shared_ptr<io_thread>> threads,
+		tcp::endpoint endpoint,
+		std::shared_ptr<std::string const> const& doc_root)
+		: ioc_(threads.front()->ioc)
+		, acceptor_(net::make_strand(ioc_))
+		, doc_root_(doc_root)
+		, threads_(std::move(threads))
+#else
 	listener(
 		net::io_context& ioc,
 		tcp::endpoint endpoint,
@@ -338,6 +476,7 @@ public:
 		: ioc_(ioc)
 		, acceptor_(net::make_strand(ioc))
 		, doc_root_(doc_root)
+#endif
 	{
 		beast::error_code ec;
 
@@ -377,18 +516,36 @@ public:
 	// Start accepting incoming connections
 	void run()
 	{
+#ifdef ADAM_TIMER_WHEEL
+		for (auto const& t : threads_)
+			t->timers->start();
+#endif
 		do_accept();
 	}
 
 private:
 	void do_accept()
 	{
-		// The new connection gets its own strand
-		acceptor_.async_accept(net::make_strand(ioc_),
+		// An idle session, or a new one on its own strand
+		if (!next_)
+		{
+			next_ = sessions_->acquire([this]
+			{
+#ifdef ADAM_TIMER_WHEEL
+				// The threads take the connections in turn, no strand is needed on one
+				auto const& t = threads_[next_thread_++ % threads_.size()];
+				return new session(t->ioc.get_executor(), doc_root_, t->timers);
+#else
+				return new session(net::make_strand(ioc_), doc_root_);
+#endif
+			});
+		}
+
+		acceptor_.async_accept(next_->socket(),
 			beast::bind_front_handler(&listener::on_accept, shared_from_this()));
 	}
 
-	void on_accept(beast::error_code ec, tcp::socket socket)
+	void on_accept(beast::error_code ec)
 	{
 		if (ec)
 		{
@@ -396,8 +553,10 @@ private:
 		}
 		else
 		{
-			// Create the session and run it
-			std::make_shared<session>(std::move(socket), doc_root_)->run();
+			// Run the session on its own executor, the next accept takes another.
+			// The reference goes along, so the session is released there too
+			auto const ex = next_->socket().get_executor();
+			net::dispatch(ex, [s = std::move(next_)] { s->run(); });
 		}
 
 		// Accept another connection
@@ -409,6 +568,11 @@ private:
 
 void http_server_async()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 	/*if (argc != 5)
 	{
@@ -428,6 +592,30 @@ void http_server_async()
 	auto const doc_root = std::make_shared<std::string>(".");
 	auto const threads = 10;
 
+#ifdef ADAM_TIMER_WHEEL
+	// An io_context and a wheel for each thread
+	std::vector<std::shared_ptr<io_thread>> io_threads;
+	for (auto i = 0; i < threads; ++i)
+		io_threads.push_back(std::make_shared<io_thread>());
+
+	// Create and launch a listening port
+	std::make_shared<listener>(
+		io_threads,
+		tcp::endpoint{ address, port },
+		doc_root)->run();
+
+	// Run each io_context on its thread, the wheels keep them busy
+	std::vector<std::thread> v;
+	v.reserve(threads - 1);
+	for (auto i = threads - 1; i > 0; --i)
+		v.emplace_back(
+			[&ioc = io_threads[i]->ioc]
+			{
+				ioc.run();
+			});
+
+	io_threads.front()->ioc.run();
+#else
 	// The io_context is required for all I/O
 	net::io_context ioc{ threads };
 
@@ -448,4 +636,5 @@ void http_server_async()
 			});
 
 	ioc.run();
+#endif
 }
\ No newline at end of file
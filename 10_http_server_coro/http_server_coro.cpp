@@ -27,45 +27,43 @@
 #include <thread>
 #include <vector>
 
+#include "../Server/file_range_body.hpp"
+#include "../Server/mime_types.hpp"
+#include "../Server/session_memory.hpp"
+
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
+
+#ifdef ADAM_TIMER_WHEEL
+// One timer for all the connections of a thread instead of one each
+#include "../Server/timer_wheel.hpp"
+#endif
+
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
 namespace net = boost::asio;            // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
+#ifdef ADAM_TIMER_WHEEL
+// Only used from the thread of its io_context, so it does not lock
+using connection_timers = server_async::timer_wheel<server_async::null_mutex>;
+
+// Each thread runs its own io_context and wheel, a connection
+// stays on the thread it was accepted for
+struct io_thread
+{
+	net::io_context ioc{ 1 };
+	connection_timers timers{ ioc.get_executor() };
+};
+#endif
+
 // Return a reasonable mime type based on the extension of a file.
 beast::string_view
 mime_type(beast::string_view path)
 {
-	using beast::iequals;
-	auto const ext = [&path]
-	{
-		auto const pos = path.rfind(".");
-		if (pos == beast::string_view::npos)
-			return beast::string_view{};
-		return path.substr(pos);
-	}();
-	if (iequals(ext, ".htm"))  return "text/html";
-	if (iequals(ext, ".html")) return "text/html";
-	if (iequals(ext, ".php"))  return "text/html";
-	if (iequals(ext, ".css"))  return "text/css";
-	if (iequals(ext, ".txt"))  return "text/plain";
-	if (iequals(ext, ".js"))   return "application/javascript";
-	if (iequals(ext, ".json")) return "application/json";
-	if (iequals(ext, ".xml"))  return "application/xml";
-	if (iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-	if (iequals(ext, ".flv"))  return "video/x-flv";
-	if (iequals(ext, ".png"))  return "image/png";
-	if (iequals(ext, ".jpe"))  return "image/jpeg";
-	if (iequals(ext, ".jpeg")) return "image/jpeg";
-	if (iequals(ext, ".jpg"))  return "image/jpeg";
-	if (iequals(ext, ".gif"))  return "image/gif";
-	if (iequals(ext, ".bmp"))  return "image/bmp";
-	if (iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-	if (iequals(ext, ".tiff")) return "image/tiff";
-	if (iequals(ext, ".tif"))  return "image/tiff";
-	if (iequals(ext, ".svg"))  return "image/svg+xml";
-	if (iequals(ext, ".svgz")) return "image/svg+xml";
-	return "application/text";
+	static server_async::mime_table const types;
+	return types.find(path);
 }
 
 // Append an HTTP rel-path to a local filesystem path.
@@ -105,15 +103,18 @@ void handle_request(
 		http::request<Body, http::basic_fields<Allocator>>&& req,
 		Send&& send)
 {
+	// The responses are allocated like the request
+	using text_body = http::basic_string_body<char, std::char_traits<char>, Allocator>;
+
 	// Returns a bad request response
 	auto const bad_request =
 		[&req](beast::string_view why)
 	{
-		http::response<http::string_body> res{ http::status::bad_request, req.version() };
+		auto res = server_async::make_response<text_body>(http::status::bad_request, req, req.get_allocator());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, "text/html");
 		res.keep_alive(req.keep_alive());
-		res.body() = std::string(why);
+		res.body().assign(why.data(), why.size());
 		res.prepare_payload();
 		return res;
 	};
@@ -122,11 +123,11 @@ void handle_request(
 	auto const not_found =
 		[&req](beast::string_view target)
 	{
-		http::response<http::string_body> res{ http::status::not_found, req.version() };
+		auto res = server_async::make_response<text_body>(http::status::not_found, req, req.get_allocator());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, "text/html");
 		res.keep_alive(req.keep_alive());
-		res.body() = "The resource '" + std::string(target) + "' was not found.";
+		res.body().append("The resource '").append(target.data(), target.size()).append("' was not found.");
 		res.prepare_payload();
 		return res;
 	};
@@ -135,11 +136,11 @@ void handle_request(
 	auto const server_error =
 		[&req](beast::string_view what)
 	{
-		http::response<http::string_body> res{ http::status::internal_server_error, req.version() };
+		auto res = server_async::make_response<text_body>(http::status::internal_server_error, req, req.get_allocator());
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, "text/html");
 		res.keep_alive(req.keep_alive());
-		res.body() = "An error occurred: '" + std::string(what) + "'";
+		res.body().append("An error occurred: '").append(what.data(), what.size()).append("'");
 		res.prepare_payload();
 		return res;
 	};
@@ -176,28 +177,66 @@ void handle_request(
 	// Cache the size since we need it after the move
 	auto const size = body.size();
 
-	// Respond to HEAD request
-	if (req.method() == http::verb::head)
+	// Conditional and range requests are answered from the file's validators
+	auto const validators = server_async::validators_of(path, size);
+	auto const set_fields = [&](auto& res)
 	{
-		http::response<http::empty_body> res{ http::status::ok, req.version() };
 		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
 		res.set(http::field::content_type, mime_type(path));
-		res.content_length(size);
+		res.set(http::field::accept_ranges, "bytes");
+		res.set(http::field::etag, validators.etag);
+		res.set(http::field::last_modified, validators.last_modified);
+		res.keep_alive(req.keep_alive());
+	};
+
+	if (server_async::not_modified(req, validators.etag, validators.mtime))
+	{
+		auto res = server_async::make_response<http::empty_body>(http::status::not_modified, req);
+		set_fields(res);
+		res.erase(http::field::content_type);
+		return send(std::move(res));
+	}
+
+	// Range only applies to GET
+	std::vector<server_async::byte_range> ranges;
+	auto const range = req.method() == http::verb::get && server_async::if_range_matches(req, validators.etag, validators.mtime)
+		? server_async::parse_range(req[http::field::range], size, ranges)
+		: server_async::range_status::full;
+
+	if (range == server_async::range_status::unsatisfiable)
+	{
+		auto res = server_async::make_response<http::empty_body>(http::status::range_not_satisfiable, req);
+		res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
+		res.set(http::field::content_range, "bytes */" + std::to_string(size));
+		res.content_length(0);
 		res.keep_alive(req.keep_alive());
 		return send(std::move(res));
 	}
 
+	// Respond to HEAD request
+	if (req.method() == http::verb::head)
+	{
+		auto res = server_async::make_response<http::empty_body>(http::status::ok, req);
+		set_fields(res);
+		res.content_length(size);
+		return send(std::move(res));
+	}
+
+	// Respond to a range request, only the slices of the file are read
+	if (range == server_async::range_status::partial)
+	{
+		auto res = server_async::make_response<server_async::file_range_body>(http::status::partial_content, req);
+		set_fields(res);
+		res.body().file = std::move(body.file());
+		server_async::set_ranges(res, ranges, size, mime_type(path));
+		return send(std::move(res));
+	}
+
 	// Respond to GET request
-	http::response<http::file_body> res{
-		std::piecewise_construct,
-		std::make_tuple(std::move(body)),
-		std::make_tuple(http::status::ok, req.version()) };
+	auto res = server_async::make_response<http::file_body>(http::status::ok, req, std::move(body));
 
-	res.set(http::field::server, BOOST_BEAST_VERSION_STRING);
-	res.set(http::field::content_type, mime_type(path));
+	set_fields(res);
 	res.content_length(size);
-	res.keep_alive(req.keep_alive());
-
 	return send(std::move(res));
 }
 
@@ -206,7 +245,11 @@ void handle_request(
 // Report a failure
 void fail(beast::error_code ec, char const* what)
 {
+#ifdef ADAM_ASYNC_LOG
+	server_log::write(server_log::level::error, what, ec.message());
+#else
 	std::cerr << what << ": " << ec.message() << "\n";
+#endif
 }
 
 // This is the C++11 equivalent of a generic lambda.
@@ -244,36 +287,89 @@ struct send_lambda
 	}
 };
 
+#ifdef ADAM_TIMER_WHEEL
+// The deadline of a session, shared with the expiry handler
+// so the handler can tell when the session has ended
+struct session_timeout
+{
+	beast::tcp_stream& stream;
+	connection_timers::entry entry;
+
+	session_timeout(beast::tcp_stream& s, connection_timers& timers)
+		: stream(s)
+		, entry(timers)
+	{
+	}
+};
+#endif
+
 // Handles an HTTP server connection
+#ifdef ADAM_TIMER_WHEEL
+void do_session(
+	beast::tcp_stream& stream,
+	std::shared_ptr<std::string const> const& doc_root,
+	connection_timers& timers,
+	net::yield_context yield)
+#else
 void do_session(
 	beast::tcp_stream& stream,
 	std::shared_ptr<std::string const> const& doc_root,
 	net::yield_context yield)
+#endif
 {
 	bool close = false;
 	beast::error_code ec;
 
+#ifdef ADAM_TIMER_WHEEL
+	// The wheel is expiring entries when this runs, so post the close
+	// to the stream's thread, which the coroutine runs on and ends on too
+	auto const timeout = std::make_shared<session_timeout>(stream, timers);
+	timeout->entry.on_expire([weak = std::weak_ptr<session_timeout>(timeout), ex = stream.get_executor()]
+	{
+		net::post(ex, [weak]
+		{
+			// The pending operation completes with operation_aborted
+			auto const t = weak.lock();
+			if (t && !t->entry.armed())
+				t->stream.close();
+		});
+	});
+#endif
+
 	// This buffer is required to persist across reads
 	beast::flat_buffer buffer;
 
+	// Each request and its response are allocated here
+	// and released before the next request is read
+	server_async::session_memory memory;
+
 	// This lambda is used to send messages
 	send_lambda lambda{ stream, close, ec, yield };
 
 	for (;;)
 	{
 		// Set the timeout.
+#ifdef ADAM_TIMER_WHEEL
+		timeout->entry.arm(std::chrono::seconds(30));
+#else
 		stream.expires_after(std::chrono::seconds(30));
+#endif
 
-		// Read a request
-		http::request<http::string_body> req;
-		http::async_read(stream, buffer, req, yield[ec]);
+		// Read a request, the last one and its response are destroyed
+		memory.reset();
+		http::request_parser<server_async::session_string_body, server_async::session_allocator> parser{
+			std::piecewise_construct,
+			std::make_tuple(memory.allocator()),
+			std::make_tuple(memory.allocator()) };
+
+		http::async_read(stream, buffer, parser, yield[ec]);
 		if (ec == http::error::end_of_stream)
 			break;
 		if (ec)
 			return fail(ec, "read");
 
 		// Send the response
-		handle_request(*doc_root, std::move(req), lambda);
+		handle_request(*doc_root, parser.release(), lambda);
 		if (ec)
 			return fail(ec, "write");
 		if (close)
@@ -293,11 +389,20 @@ void do_session(
 //------------------------------------------------------------------------------
 
 // Accepts incoming connections and launches the sessions
+#ifdef ADAM_TIMER_WHEEL
 void do_listen(
 	net::io_context& ioc,
+	std::vector<std::shared_ptr<io_thread>> const& threads,
 	tcp::endpoint endpoint,
 	std::shared_ptr<std::string const> const& doc_root,
 	net::yield_context yield)
+#else
+void do_listen(
+	net::io_context& ioc,
+	tcp::endpoint endpoint,
+	std::shared_ptr<std::string const> const& doc_root,
+	net::yield_context yield)
+#endif
 {
 	beast::error_code ec;
 
@@ -322,20 +427,47 @@ void do_listen(
 	if (ec)
 		return fail(ec, "listen");
 
+#ifdef ADAM_TIMER_WHEEL
+	for (auto const& t : threads)
+		t->timers.start();
+
+	std::size_t next_thread = 0;
+#endif
+
 	for (;;)
 	{
+#ifdef ADAM_TIMER_WHEEL
+		// The threads take the connections in turn, the session
+		// is spawned on the socket's thread and uses its wheel
+		auto& t = *threads[next_thread++ % threads.size()];
+		tcp::socket socket(t.ioc);
+#else
 		tcp::socket socket(ioc);
+#endif
 		acceptor.async_accept(socket, yield[ec]);
 		if (ec)
 			fail(ec, "accept");
 		else
+#ifdef ADAM_TIMER_WHEEL
+		{
+			auto const ex = socket.get_executor();
+			net::spawn(ex,
+				std::bind(&do_session, beast::tcp_stream(std::move(socket)), doc_root, std::ref(t.timers), std::placeholders::_1));
+		}
+#else
 			net::spawn(acceptor.get_executor(),
 				std::bind(&do_session, beast::tcp_stream(std::move(socket)), doc_root, std::placeholders::_1));
+#endif
 	}
 }
 
 void http_server_coro()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 	/*if (argc != 5)
 	{
@@ -355,6 +487,35 @@ void http_server_coro()
 	auto const doc_root = std::make_shared<std::string>(".");
 	auto const threads = 10;
 
+#ifdef ADAM_TIMER_WHEEL
+	// An io_context and a wheel for each thread
+	std::vector<std::shared_ptr<io_thread>> io_threads;
+	for (auto i = 0; i < threads; ++i)
+		io_threads.push_back(std::make_shared<io_thread>());
+
+	// Spawn a listening port on the first thread
+	auto& ioc = io_threads.front()->ioc;
+	net::spawn(ioc,
+		std::bind(
+			&do_listen,
+			std::ref(ioc),
+			io_threads,
+			tcp::endpoint{ address, port },
+			doc_root,
+			std::placeholders::_1));
+
+	// Run each io_context on its thread, the wheels keep them busy
+	std::vector<std::thread> v;
+	v.reserve(threads - 1);
+	for (auto i = threads - 1; i > 0; --i)
+		v.emplace_back(
+			[&ioc = io_threads[i]->ioc]
+			{
+				ioc.run();
+			});
+
+	ioc.run();
+#else
 	// The io_context is required for all I/O
 	net::io_context ioc{ threads };
 
@@ -378,4 +539,5 @@ void http_server_coro()
 			});
 
 	ioc.run();
+#endif
 }
\ No newline at end of file
@@ -12,34 +12,170 @@
 #ifndef BOOST_BEAST_EXAMPLE_FIELDS_ALLOC_HPP
 #define BOOST_BEAST_EXAMPLE_FIELDS_ALLOC_HPP
 
-#include <boost/throw_exception.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
 #include <cstdlib>
 #include <memory>
-#include <stdexcept>
+#include <new>
+#include <type_traits>
 
 namespace detail {
 
-	struct static_pool
+	// Memory of a pool beyond its first block, chained when the first overflows
+	struct alignas(std::max_align_t) pool_block
 	{
+		pool_block* next;
+		std::size_t size;
+
+		char* begin()
+		{
+			return reinterpret_cast<char*>(this + 1);
+		}
+
+		char* end()
+		{
+			return begin() + size;
+		}
+	};
+
+	// Blocks given back by the pools reset on this thread, reused by
+	// the next pool that overflows here instead of going to the heap
+	class block_free_list
+	{
+		static constexpr std::size_t max_blocks = 64;
+
+		pool_block* head_ = nullptr;
+		std::size_t count_ = 0;
+
+	public:
+		block_free_list() = default;
+		block_free_list(block_free_list const&) = delete;
+		block_free_list& operator=(block_free_list const&) = delete;
+
+		~block_free_list()
+		{
+			release(head_);
+		}
+
+		static block_free_list& local()
+		{
+			thread_local block_free_list list;
+			return list;
+		}
+
+		static void release(pool_block* b)
+		{
+			while (b)
+			{
+				auto const next = b->next;
+				delete[] reinterpret_cast<char*>(b);
+				b = next;
+			}
+		}
+
+		pool_block* get(std::size_t size)
+		{
+			// Only the head is looked at, the blocks are mostly the same size
+			if (head_ && head_->size >= size)
+			{
+				auto const b = head_;
+				head_ = b->next;
+				--count_;
+				return b;
+			}
+
+			auto const b = ::new(new char[sizeof(pool_block) + size]) pool_block{ nullptr, size };
+			return b;
+		}
+
+		// The chain first ... last of count blocks, linked in one step
+		void put(pool_block* first, pool_block* last, std::size_t count)
+		{
+			if (count_ + count > max_blocks)
+				return release(first);
+
+			last->next = head_;
+			head_ = first;
+			count_ += count;
+		}
+	};
+
+	// A bump allocator over a first block allocated with the pool and
+	// blocks chained from the thread's free list when it overflows.
+	// Deallocation does nothing until every allocation is deallocated,
+	// then the pool starts over at its first block.
+	template<bool ThreadSafe>
+	struct alignas(std::max_align_t) static_pool
+	{
+		using refs_type = typename std::conditional<ThreadSafe, std::atomic<std::size_t>, std::size_t>::type;
+
 		std::size_t size_;
-		std::size_t refs_ = 1;
+		refs_type refs_{ 1 };
 		std::size_t count_ = 0;
 		char* p_;
+		char* end_;
 
-		char* end()
+		// The chained blocks, the newest first
+		pool_block* blocks_ = nullptr;
+		pool_block* oldest_ = nullptr;
+		std::size_t num_blocks_ = 0;
+
+		char* begin()
 		{
-			return reinterpret_cast<char*>(this + 1) + size_;
+			return reinterpret_cast<char*>(this + 1);
 		}
 
 		explicit static_pool(std::size_t size)
 			: size_(size)
-			, p_(reinterpret_cast<char*>(this + 1))
+			, p_(begin())
+			, end_(begin() + size)
+		{
+		}
+
+		~static_pool()
 		{
+			block_free_list::release(blocks_);
+		}
+
+		// Allocations are rounded up so every one is suitably aligned
+		static std::size_t round_up(std::size_t n)
+		{
+			auto const a = alignof(std::max_align_t);
+			return (n + a - 1) & ~(a - 1);
+		}
+
+		void grow(std::size_t n)
+		{
+			auto const b = block_free_list::local().get(std::max(size_, n));
+			b->next = blocks_;
+			blocks_ = b;
+			if (!oldest_)
+				oldest_ = b;
+
+			++num_blocks_;
+			p_ = b->begin();
+			end_ = b->end();
+		}
+
+		// O(1), the chained blocks go back to the free list as one list
+		void reset()
+		{
+			if (blocks_)
+			{
+				block_free_list::local().put(blocks_, oldest_, num_blocks_);
+				blocks_ = oldest_ = nullptr;
+				num_blocks_ = 0;
+			}
+
+			p_ = begin();
+			end_ = begin() + size_;
 		}
 
 	public:
-		static 	static_pool& construct(std::size_t size)
+		static static_pool& construct(std::size_t size)
 		{
+			size = round_up(std::max<std::size_t>(size, 1));
 			auto p = new char[sizeof(static_pool) + size];
 			return *(::new(p) static_pool{ size });
 		}
@@ -52,7 +188,7 @@ namespace detail {
 
 		void destroy()
 		{
-			if (refs_--)
+			if (--refs_ != 0)
 				return;
 			this->~static_pool();
 			delete[] reinterpret_cast<char*>(this);
@@ -60,12 +196,12 @@ namespace detail {
 
 		void* alloc(std::size_t n)
 		{
-			auto last = p_ + n;
-			if (last >= end())
-				BOOST_THROW_EXCEPTION(std::bad_alloc{});
+			n = round_up(n);
+			if (static_cast<std::size_t>(end_ - p_) < n)
+				grow(n);
 			++count_;
 			auto p = p_;
-			p_ = last;
+			p_ += n;
 			return p;
 		}
 
@@ -73,29 +209,35 @@ namespace detail {
 		{
 			if (--count_)
 				return;
-			p_ = reinterpret_cast<char*>(this + 1);
+			reset();
 		}
 	};
 
 } // detail
 
-/** A non-thread-safe allocator optimized for @ref basic_fields.
+/** An allocator optimized for @ref basic_fields.
 	This allocator obtains memory from a pre-allocated memory block
-	of a given size. It does nothing in deallocate until all
-	previously allocated blocks are deallocated, upon which it
-	resets the internal memory block for re-use.
+	of a given size. When a message needs more, further blocks are
+	chained from a free list kept by the calling thread. It does
+	nothing in deallocate until all previously allocated blocks are
+	deallocated, upon which it resets the internal memory block for
+	re-use and gives the chained blocks back to the free list.
 	To use this allocator declare an instance persistent to the
 	connection or session, and construct with the block size.
-	A good rule of thumb is 20% more than the maximum allowed
-	header size. For example if the application only allows up
-	to an 8,000 byte header, the block size could be 9,600.
+	A good rule of thumb is 20% more than the usual header size,
+	larger headers still work at the cost of a chained block.
 	Then, for every instance of `message` construct the header
 	with a copy of the previously declared allocator instance.
+	The copies share the block. Only with ThreadSafe are they counted
+	atomically, so copies can be destroyed on different threads, the
+	messages themselves must still be used by one thread at a time.
 */
-template<class T>
+template<class T, bool ThreadSafe = false>
 struct fields_alloc
 {
-	detail::static_pool* pool_;
+	using pool_type = detail::static_pool<ThreadSafe>;
+
+	pool_type* pool_;
 
 public:
 	using value_type = T;
@@ -110,7 +252,7 @@ public:
 	template<class U>
 	struct rebind
 	{
-		using other = fields_alloc<U>;
+		using other = fields_alloc<U, ThreadSafe>;
 	};
 
 #if defined(_GLIBCXX_USE_CXX11_ABI) && (_GLIBCXX_USE_CXX11_ABI == 0)
@@ -121,7 +263,7 @@ public:
 #endif
 
 	explicit fields_alloc(std::size_t size)
-		: pool_(&detail::static_pool::construct(size))
+		: pool_(&pool_type::construct(size))
 	{
 	}
 
@@ -131,7 +273,7 @@ public:
 	}
 
 	template<class U>
-	fields_alloc(fields_alloc<U> const& other)
+	fields_alloc(fields_alloc<U, ThreadSafe> const& other)
 		: pool_(&other.pool_->share())
 	{
 	}
@@ -169,17 +311,17 @@ public:
 
 	template<class U>
 	friend
-	bool operator==(fields_alloc const& lhs, fields_alloc<U> const& rhs)
+	bool operator==(fields_alloc const& lhs, fields_alloc<U, ThreadSafe> const& rhs)
 	{
-		return &lhs.pool_ == &rhs.pool_;
+		return lhs.pool_ == rhs.pool_;
 	}
 
 	template<class U>
 	friend
-	bool operator!=(fields_alloc const& lhs, fields_alloc<U> const& rhs)
+	bool operator!=(fields_alloc const& lhs, fields_alloc<U, ThreadSafe> const& rhs)
 	{
 		return !(lhs == rhs);
 	}
 };
 
-#endif
\ No newline at end of file
+#endif
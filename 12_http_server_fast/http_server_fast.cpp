@@ -18,6 +18,7 @@
 #include <boost/beast/version.hpp>
 #include <boost/asio.hpp>
 #include <boost/filesystem.hpp>
+#include <algorithm>
 #include <chrono>
 #include <cstdlib>
 #include <cstring>
@@ -25,9 +26,16 @@
 #include <list>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include "fields_alloc.hpp"
 #include "http_server_fast.hpp"
+#include "../Server/mime_types.hpp"
+
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
@@ -38,36 +46,8 @@ using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 beast::string_view
 mime_type(beast::string_view path)
 {
-	using beast::iequals;
-	auto const ext = [&path]
-	{
-		auto const pos = path.rfind(".");
-		if (pos == beast::string_view::npos)
-			return beast::string_view{};
-		return path.substr(pos);
-	}();
-	if (iequals(ext, ".htm"))  return "text/html";
-	if (iequals(ext, ".html")) return "text/html";
-	if (iequals(ext, ".php"))  return "text/html";
-	if (iequals(ext, ".css"))  return "text/css";
-	if (iequals(ext, ".txt"))  return "text/plain";
-	if (iequals(ext, ".js"))   return "application/javascript";
-	if (iequals(ext, ".json")) return "application/json";
-	if (iequals(ext, ".xml"))  return "application/xml";
-	if (iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-	if (iequals(ext, ".flv"))  return "video/x-flv";
-	if (iequals(ext, ".png"))  return "image/png";
-	if (iequals(ext, ".jpe"))  return "image/jpeg";
-	if (iequals(ext, ".jpeg")) return "image/jpeg";
-	if (iequals(ext, ".jpg"))  return "image/jpeg";
-	if (iequals(ext, ".gif"))  return "image/gif";
-	if (iequals(ext, ".bmp"))  return "image/bmp";
-	if (iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-	if (iequals(ext, ".tiff")) return "image/tiff";
-	if (iequals(ext, ".tif"))  return "image/tiff";
-	if (iequals(ext, ".svg"))  return "image/svg+xml";
-	if (iequals(ext, ".svgz")) return "image/svg+xml";
-	return "application/text";
+	static server_async::mime_table const types;
+	return types.find(path);
 }
 
 class http_worker
@@ -93,6 +73,11 @@ public:
 	}
 
 private:
+	// A keep-alive connection is closed after this many requests,
+	// or when the next request does not arrive within idle_timeout
+	static constexpr std::size_t max_requests = 1000;
+	static constexpr auto idle_timeout = std::chrono::seconds(10);
+
 	using alloc_t = fields_alloc<char>;
 	//using request_body_t = http::basic_dynamic_body<beast::flat_static_buffer<1024 * 1024>>;
 	using request_body_t = http::string_body;
@@ -106,6 +91,10 @@ private:
 	// The socket for the currently connected client.
 	tcp::socket socket_{ acceptor_.get_executor() };
 
+	// Requests answered on the connection, and whether it stays open after this one
+	std::size_t requests_ = 0;
+	bool keep_alive_ = false;
+
 	// The buffer for performing reads
 	beast::flat_static_buffer<8192> buffer_;
 
@@ -152,6 +141,7 @@ private:
 					request_deadline_.expires_after(
 						std::chrono::seconds(60));
 
+					requests_ = 0;
 					read_request();
 				}
 			});
@@ -184,13 +174,21 @@ private:
 				if (ec)
 					accept();
 				else
+				{
+					// The response must be sent within 60 seconds.
+					request_deadline_.expires_after(
+						std::chrono::seconds(60));
+
 					process_request(parser_->get());
+				}
 			});
 	}
 
 	// define get api here
 	void process_request(http::request<request_body_t, http::basic_fields<alloc_t>> const& req)
 	{
+		keep_alive_ = req.keep_alive() && ++requests_ < max_requests;
+
 		switch (req.method())
 		{
 		case http::verb::get:
@@ -217,7 +215,7 @@ private:
 			std::make_tuple(alloc_));
 
 		string_response_->result(status);
-		string_response_->keep_alive(false);
+		string_response_->keep_alive(keep_alive_);
 		string_response_->set(http::field::server, "Beast");
 		string_response_->set(http::field::content_type, "text/plain");
 		string_response_->body() = error;
@@ -230,10 +228,9 @@ private:
 			*string_serializer_,
 			[this](beast::error_code ec, std::size_t)
 			{
-				socket_.shutdown(tcp::socket::shutdown_send, ec);
 				string_serializer_.reset();
 				string_response_.reset();
-				accept();
+				on_write(ec);
 			});
 	}
 
@@ -254,7 +251,11 @@ private:
 			target.size());
 
 
+#ifdef ADAM_ASYNC_LOG
+		server_log::write(server_log::level::debug, "full_path", full_path);
+#else
 		std::cout << "full_path = " << full_path << "\n";
+#endif
 
 		http::file_body::value_type file;
 		beast::error_code ec;
@@ -276,9 +277,9 @@ private:
 			std::make_tuple(alloc_));
 
 		file_response_->result(http::status::ok);
-		file_response_->keep_alive(false);
+		file_response_->keep_alive(keep_alive_);
 		file_response_->set(http::field::server, "Beast");
-		file_response_->set(http::field::content_type, mime_type(std::string(target)));
+		file_response_->set(http::field::content_type, mime_type(target));
 		file_response_->body() = std::move(file);
 		file_response_->prepare_payload();
 
@@ -289,13 +290,27 @@ private:
 			*file_serializer_,
 			[this](beast::error_code ec, std::size_t)
 			{
-				socket_.shutdown(tcp::socket::shutdown_send, ec);
 				file_serializer_.reset();
 				file_response_.reset();
-				accept();
+				on_write(ec);
 			});
 	}
 
+	// The response was released, so the next parser starts with an empty fields_alloc pool
+	void on_write(beast::error_code ec)
+	{
+		if (ec || !keep_alive_)
+		{
+			socket_.shutdown(tcp::socket::shutdown_send, ec);
+			accept();
+			return;
+		}
+
+		// Wait for the next request on the same connection
+		request_deadline_.expires_after(idle_timeout);
+		read_request();
+	}
+
 	void check_deadline()
 	{
 		// The deadline may have moved, so check it has really passed.
@@ -318,8 +333,50 @@ private:
 	}
 };
 
+// Each thread runs its own workers on its own io_context and listening socket,
+// so a connection is handled by the thread that accepted it
+struct server_thread
+{
+	net::io_context ioc{ 1 };
+	tcp::acceptor acceptor{ ioc };
+	std::list<http_worker> workers;
+
+	void listen(tcp::endpoint const& endpoint, bool reuse_port)
+	{
+		acceptor.open(endpoint.protocol());
+		acceptor.set_option(net::socket_base::reuse_address(true));
+
+#ifdef SO_REUSEPORT
+		// Several acceptors bound to the port, the kernel spreads the connections over them
+		if (reuse_port)
+		{
+			using reuse_port_option = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+			acceptor.set_option(reuse_port_option(true));
+		}
+#else
+		boost::ignore_unused(reuse_port);
+#endif
+
+		acceptor.bind(endpoint);
+		acceptor.listen(net::socket_base::max_listen_connections);
+	}
+
+	void run(bool spin)
+	{
+		if (spin)
+			for (;;) ioc.poll();
+		else
+			ioc.run();
+	}
+};
+
 void http_server_fast()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 		/*if (argc != 6)
 		{
@@ -340,21 +397,36 @@ void http_server_fast()
 	auto const address = net::ip::make_address("0.0.0.0");
 	auto const port = 5001;
 	auto const doc_root = std::make_shared<std::string>(".");
-	int num_workers = 100;
+	int num_workers = 100; // per thread
 	bool spin = false;
+	int num_threads = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
 
-	net::io_context ioc{ 1 };
-	tcp::acceptor acceptor{ ioc, {address, port} };
+#ifndef SO_REUSEPORT
+	// The threads cannot share the port without SO_REUSEPORT
+	num_threads = 1;
+#endif
 
-	std::list<http_worker> workers;
-	for (int i = 0; i < num_workers; ++i)
+	std::vector<std::unique_ptr<server_thread>> threads;
+	for (int t = 0; t < num_threads; ++t)
 	{
-		workers.emplace_back(acceptor, doc_root);
-		workers.back().start();
+		threads.push_back(std::make_unique<server_thread>());
+		auto& thread = *threads.back();
+		thread.listen({ address, port }, num_threads > 1);
+
+		for (int i = 0; i < num_workers; ++i)
+		{
+			thread.workers.emplace_back(thread.acceptor, doc_root);
+			thread.workers.back().start();
+		}
 	}
 
-	if (spin)
-		for (;;) ioc.poll();
-	else
-		ioc.run();
+	std::vector<std::thread> v;
+	v.reserve(num_threads - 1);
+	for (int t = 1; t < num_threads; ++t)
+		v.emplace_back([&thread = *threads[t], spin] { thread.run(spin); });
+
+	threads.front()->run(spin);
+
+	for (auto& t : v)
+		t.join();
 }
\ No newline at end of file
@@ -24,6 +24,10 @@
 
 #include "websocket_server_sync.hpp"
 
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
+
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
 namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
@@ -54,7 +58,11 @@ void do_session(tcp::socket& socket)
 
 		for (;;)
 		{
+#ifdef ADAM_ASYNC_LOG
+			server_log::write(server_log::level::debug, "Waiting for a message...");
+#else
 			std::cout << "Waiting for a message...\n";
+#endif
 
 			// This buffer will hold the incoming message
 			beast::flat_buffer buffer;
@@ -65,7 +73,11 @@ void do_session(tcp::socket& socket)
 			// The make_printable() function helps print a ConstBufferSequence
 			auto client_message = beast::make_printable(buffer.data());
 			
+#ifdef ADAM_ASYNC_LOG
+			server_log::write(server_log::level::info, "The client sent", beast::buffers_to_string(buffer.data()));
+#else
 			std::cout << "The client sent: " << client_message << "\n";
+#endif
 
 			std::ostringstream oss;
 
@@ -81,11 +93,21 @@ void do_session(tcp::socket& socket)
 	{
 		// This indicates that the session was closed
 		if (se.code() != websocket::error::closed)
+		{
+#ifdef ADAM_ASYNC_LOG
+			server_log::write(server_log::level::error, "Error", se.code().message());
+#else
 			std::cerr << "Error: " << se.code().message() << std::endl;
+#endif
+		}
 	}
 	catch (std::exception const& e)
 	{
+#ifdef ADAM_ASYNC_LOG
+		server_log::write(server_log::level::error, "Error", e.what());
+#else
 		std::cerr << "Error: " << e.what() << std::endl;
+#endif
 	}
 }
 
@@ -93,6 +115,11 @@ void do_session(tcp::socket& socket)
 
 void websocket_server_sync()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 	/*if (argc != 3)
 	{
@@ -21,11 +21,17 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "websocket_server_async.hpp"
+#include "../Server/session_pool.hpp"
+
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
@@ -38,34 +44,56 @@ using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 // Report a failure
 void fail(beast::error_code ec, char const* what)
 {
+#ifdef ADAM_ASYNC_LOG
+	server_log::write(server_log::level::error, what, ec.message());
+#else
 	std::cerr << what << ": " << ec.message() << "\n";
+#endif
 }
 
-// Echoes back all received WebSocket messages
-class session : public std::enable_shared_from_this<session>
+// Echoes back all received WebSocket messages, then those of the next connection
+class session : public server_async::pooled_session<session>
 {
-	websocket::stream<beast::tcp_stream> ws_;
+	// Made again for each connection, see reset()
+	std::optional<websocket::stream<beast::tcp_stream>> ws_;
 	beast::flat_buffer buffer_;
 
 	std::string text_; // holds message to send to client
 
 public:
-	// Take ownership of the socket
-	explicit session(tcp::socket&& socket)
-		: ws_(std::move(socket))
+	// Made by the listener's pool, the connection is accepted into socket()
+	explicit session(net::any_io_executor ex)
+		: ws_(std::in_place, std::move(ex))
+	{
+	}
+
+	tcp::socket& socket()
+	{
+		return beast::get_lowest_layer(*ws_).socket();
+	}
+
+	// Called by the pool with the last reference, the buffers are kept.
+	// The stream is made again on the same strand, a websocket stream
+	// keeps the error of its last connection through the next accept.
+	bool reset()
 	{
+		auto ex = ws_->get_executor();
+		ws_.emplace(std::move(ex));
+		buffer_.clear();
+		text_.clear();
+		return true;
 	}
 
 	// Start the asynchronous operation
 	void run()
 	{
 		// Set suggested timeout settings for the websocket
-		ws_.set_option(
+		ws_->set_option(
 			websocket::stream_base::timeout::suggested(
 				beast::role_type::server));
 
 		// Set a decorator to change the Server of the handshake
-		ws_.set_option(websocket::stream_base::decorator(
+		ws_->set_option(websocket::stream_base::decorator(
 			[](websocket::response_type& res)
 			{
 				res.set(http::field::server,
@@ -74,10 +102,10 @@ public:
 			}));
 
 		// Accept the websocket handshake
-		ws_.async_accept(
+		ws_->async_accept(
 			beast::bind_front_handler(
 				&session::on_accept,
-				shared_from_this()));
+				self()));
 	}
 
 	void on_accept(beast::error_code ec)
@@ -92,11 +120,11 @@ public:
 	void do_read()
 	{
 		// Read a message into our buffer
-		ws_.async_read(
+		ws_->async_read(
 			buffer_,
 			beast::bind_front_handler(
 				&session::on_read,
-				shared_from_this()));
+				self()));
 	}
 
 	void on_read(
@@ -113,7 +141,11 @@ public:
 			fail(ec, "read");
 
 		auto client_message = beast::make_printable(buffer_.data());
+#ifdef ADAM_ASYNC_LOG
+		server_log::write(server_log::level::info, "The client sent", beast::buffers_to_string(buffer_.data()));
+#else
 		std::cout << "The client sent: " << client_message << "\n";
+#endif
 
 		// prepare message for client
 		std::ostringstream oss;
@@ -122,13 +154,13 @@ public:
 		text_ = oss.str();
 
 		// Echo the message
-		ws_.text(ws_.got_text());
-		ws_.async_write(
+		ws_->text(ws_->got_text());
+		ws_->async_write(
 			//buffer_.data(),
 			net::buffer(text_),
 			beast::bind_front_handler(
 				&session::on_write,
-				shared_from_this()));
+				self()));
 	}
 
 	void on_write(
@@ -156,6 +188,11 @@ class listener : public std::enable_shared_from_this<listener>
 	net::io_context& ioc_;
 	tcp::acceptor acceptor_;
 
+	// Sessions of closed connections, accepted into again
+	std::shared_ptr<server_async::session_pool<session>> sessions_ =
+		std::make_shared<server_async::session_pool<session>>();
+	boost::intrusive_ptr<session> next_;
+
 public:
 	listener(
 		net::io_context& ioc,
@@ -208,15 +245,18 @@ public:
 private:
 	void do_accept()
 	{
-		// The new connection gets its own strand
+		// An idle session, or a new one on its own strand
+		if (!next_)
+			next_ = sessions_->acquire([this] { return new session(net::make_strand(ioc_)); });
+
 		acceptor_.async_accept(
-			net::make_strand(ioc_),
+			next_->socket(),
 			beast::bind_front_handler(
 				&listener::on_accept,
 				shared_from_this()));
 	}
 
-	void on_accept(beast::error_code ec, tcp::socket socket)
+	void on_accept(beast::error_code ec)
 	{
 		if (ec)
 		{
@@ -224,8 +264,9 @@ private:
 		}
 		else
 		{
-			// Create the session and run it
-			std::make_shared<session>(std::move(socket))->run();
+			// Run the session, the next accept takes another
+			auto const s = std::move(next_);
+			s->run();
 		}
 
 		// Accept another connection
@@ -237,6 +278,11 @@ private:
 
 void websocket_server_async()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 	/*if (argc != 4)
 	{
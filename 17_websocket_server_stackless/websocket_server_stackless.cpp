@@ -22,11 +22,17 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "websocket_server_stackless.hpp"
+#include "../Server/session_pool.hpp"
+
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
@@ -40,23 +46,49 @@ using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 void
 fail(beast::error_code ec, char const* what)
 {
+#ifdef ADAM_ASYNC_LOG
+	server_log::write(server_log::level::error, what, ec.message());
+#else
 	std::cerr << what << ": " << ec.message() << "\n";
+#endif
 }
 
-// Echoes back all received WebSocket messages
+// Echoes back all received WebSocket messages, then those of the next connection
 class session
 	: public net::coroutine
-	, public std::enable_shared_from_this<session>
+	, public server_async::pooled_session<session>
 {
-	websocket::stream<beast::tcp_stream> ws_;
+	// Made again for each connection, see reset()
+	std::optional<websocket::stream<beast::tcp_stream>> ws_;
 	beast::flat_buffer buffer_;
 
 public:
-	// Take ownership of the socket
+	// Made by the listener's pool, the connection is accepted into socket()
 	explicit
-		session(tcp::socket socket)
-		: ws_(std::move(socket))
+		session(net::any_io_executor ex)
+		: ws_(std::in_place, std::move(ex))
+	{
+	}
+
+	tcp::socket&
+		socket()
+	{
+		return beast::get_lowest_layer(*ws_).socket();
+	}
+
+	// Called by the pool with the last reference, the buffer is kept.
+	// The stream is made again on the same strand, a websocket stream
+	// keeps the error of its last connection through the next accept.
+	bool
+		reset()
 	{
+		auto ex = ws_->get_executor();
+		ws_.emplace(std::move(ex));
+		buffer_.clear();
+
+		// The next connection starts the loop from the top
+		static_cast<net::coroutine&>(*this) = net::coroutine();
+		return true;
 	}
 
 	// Start the asynchronous operation
@@ -76,12 +108,12 @@ public:
 		reenter(*this)
 		{
 			// Set suggested timeout settings for the websocket
-			ws_.set_option(
+			ws_->set_option(
 				websocket::stream_base::timeout::suggested(
 					beast::role_type::server));
 
 			// Set a decorator to change the Server of the handshake
-			ws_.set_option(websocket::stream_base::decorator(
+			ws_->set_option(websocket::stream_base::decorator(
 				[](websocket::response_type& res)
 				{
 					res.set(http::field::server,
@@ -90,10 +122,10 @@ public:
 				}));
 
 			// Accept the websocket handshake
-			yield ws_.async_accept(
+			yield ws_->async_accept(
 				std::bind(
 					&session::loop,
-					shared_from_this(),
+					self(),
 					std::placeholders::_1,
 					0));
 			if (ec)
@@ -102,11 +134,11 @@ public:
 			for (;;)
 			{
 				// Read a message into our buffer
-				yield ws_.async_read(
+				yield ws_->async_read(
 					buffer_,
 					std::bind(
 						&session::loop,
-						shared_from_this(),
+						self(),
 						std::placeholders::_1,
 						std::placeholders::_2));
 				if (ec == websocket::error::closed)
@@ -118,12 +150,12 @@ public:
 					fail(ec, "read");
 
 				// Echo the message
-				ws_.text(ws_.got_text());
-				yield ws_.async_write(
+				ws_->text(ws_->got_text());
+				yield ws_->async_write(
 					buffer_.data(),
 					std::bind(
 						&session::loop,
-						shared_from_this(),
+						self(),
 						std::placeholders::_1,
 						std::placeholders::_2));
 				if (ec)
@@ -147,7 +179,11 @@ class listener
 {
 	net::io_context& ioc_;
 	tcp::acceptor acceptor_;
-	tcp::socket socket_;
+
+	// Sessions of closed connections, accepted into again
+	std::shared_ptr<server_async::session_pool<session>> sessions_ =
+		std::make_shared<server_async::session_pool<session>>();
+	boost::intrusive_ptr<session> next_;
 
 public:
 	listener(
@@ -155,7 +191,6 @@ public:
 		tcp::endpoint endpoint)
 		: ioc_(ioc)
 		, acceptor_(net::make_strand(ioc))
-		, socket_(net::make_strand(ioc))
 	{
 		beast::error_code ec;
 
@@ -210,8 +245,12 @@ private:
 		{
 			for (;;)
 			{
+				// An idle session, or a new one on its own strand
+				if (!next_)
+					next_ = sessions_->acquire([this] { return new session(net::make_strand(ioc_)); });
+
 				yield acceptor_.async_accept(
-					socket_,
+					next_->socket(),
 					std::bind(
 						&listener::loop,
 						shared_from_this(),
@@ -222,12 +261,10 @@ private:
 				}
 				else
 				{
-					// Create the session and run it
-					std::make_shared<session>(std::move(socket_))->run();
+					// Run the session, the next accept takes another
+					auto const s = std::move(next_);
+					s->run();
 				}
-
-				// Make sure each session gets its own strand
-				socket_ = tcp::socket(net::make_strand(ioc_));
 			}
 		}
 	}
@@ -239,6 +276,11 @@ private:
 
 void websocket_server_stackless()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 	/*if (argc != 4)
 	{
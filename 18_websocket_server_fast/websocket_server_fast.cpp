@@ -37,10 +37,17 @@
 #include <functional>
 #include <iostream>
 #include <memory>
+#include <optional>
 #include <string>
 #include <thread>
 #include <vector>
 
+#include "../Server/session_pool.hpp"
+
+#ifdef ADAM_ASYNC_LOG
+#include "../Server/logger.hpp"
+#endif
+
 namespace beast = boost::beast;         // from <boost/beast.hpp>
 namespace http = beast::http;           // from <boost/beast/http.hpp>
 namespace websocket = beast::websocket; // from <boost/beast/websocket.hpp>
@@ -52,7 +59,11 @@ using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 // Report a failure
 void fail(beast::error_code ec, char const* what)
 {
+#ifdef ADAM_ASYNC_LOG
+	server_log::write(server_log::level::error, what, ec.message());
+#else
 	std::cerr << (std::string(what) + ": " + ec.message() + "\n");
+#endif
 }
 
 // Adjust settings on the stream
@@ -133,31 +144,49 @@ void do_sync_listen(
 
 //------------------------------------------------------------------------------
 
-// Echoes back all received WebSocket messages
-class async_session : public std::enable_shared_from_this<async_session>
+// Echoes back all received WebSocket messages, then those of the next connection
+class async_session : public server_async::pooled_session<async_session>
 {
-	websocket::stream<beast::tcp_stream> ws_;
+	// Made again for each connection, see reset()
+	std::optional<websocket::stream<beast::tcp_stream>> ws_;
 	beast::flat_buffer buffer_;
 
 public:
-	// Take ownership of the socket
+	// Made by the listener's pool, the connection is accepted into socket()
 	explicit
-		async_session(tcp::socket&& socket)
-		: ws_(std::move(socket))
+		async_session(net::any_io_executor ex)
+		: ws_(std::in_place, std::move(ex))
+	{
+		setup_stream(*ws_);
+	}
+
+	tcp::socket& socket()
+	{
+		return beast::get_lowest_layer(*ws_).socket();
+	}
+
+	// Called by the pool with the last reference, the buffer is kept.
+	// The stream is made again on the same strand, a websocket stream
+	// keeps the error of its last connection through the next accept.
+	bool reset()
 	{
-		setup_stream(ws_);
+		auto ex = ws_->get_executor();
+		ws_.emplace(std::move(ex));
+		setup_stream(*ws_);
+		buffer_.clear();
+		return true;
 	}
 
 	// Start the asynchronous operation
 	void run()
 	{
 		// Set suggested timeout settings for the websocket
-		ws_.set_option(
+		ws_->set_option(
 			websocket::stream_base::timeout::suggested(
 				beast::role_type::server));
 
 		// Set a decorator to change the Server of the handshake
-		ws_.set_option(websocket::stream_base::decorator(
+		ws_->set_option(websocket::stream_base::decorator(
 			[](websocket::response_type& res)
 			{
 				res.set(http::field::server, std::string(
@@ -165,10 +194,10 @@ public:
 			}));
 
 		// Accept the websocket handshake
-		ws_.async_accept(
+		ws_->async_accept(
 			beast::bind_front_handler(
 				&async_session::on_accept,
-				shared_from_this()));
+				self()));
 	}
 
 	void on_accept(beast::error_code ec)
@@ -183,11 +212,11 @@ public:
 	void do_read()
 	{
 		// Read a message into our buffer
-		ws_.async_read(
+		ws_->async_read(
 			buffer_,
 			beast::bind_front_handler(
 				&async_session::on_read,
-				shared_from_this()));
+				self()));
 	}
 
 	void on_read(
@@ -204,12 +233,12 @@ public:
 			fail(ec, "read");
 
 		// Echo the message
-		ws_.text(ws_.got_text());
-		ws_.async_write(
+		ws_->text(ws_->got_text());
+		ws_->async_write(
 			buffer_.data(),
 			beast::bind_front_handler(
 				&async_session::on_write,
-				shared_from_this()));
+				self()));
 	}
 
 	void on_write(
@@ -235,6 +264,11 @@ class async_listener : public std::enable_shared_from_this<async_listener>
 	net::io_context& ioc_;
 	tcp::acceptor acceptor_;
 
+	// Sessions of closed connections, accepted into again
+	std::shared_ptr<server_async::session_pool<async_session>> sessions_ =
+		std::make_shared<server_async::session_pool<async_session>>();
+	boost::intrusive_ptr<async_session> next_;
+
 public:
 	async_listener(
 		net::io_context& ioc,
@@ -288,16 +322,19 @@ public:
 private:
 	void do_accept()
 	{
-		// The new connection gets its own strand
+		// An idle session, or a new one on its own strand
+		if (!next_)
+			next_ = sessions_->acquire([this] { return new async_session(net::make_strand(ioc_)); });
+
 		acceptor_.async_accept(
-			net::make_strand(ioc_),
+			next_->socket(),
 			beast::bind_front_handler(
 				&async_listener::on_accept,
 				shared_from_this()));
 	}
 
 	void
-		on_accept(beast::error_code ec, tcp::socket socket)
+		on_accept(beast::error_code ec)
 	{
 		if (ec)
 		{
@@ -305,8 +342,9 @@ private:
 		}
 		else
 		{
-			// Create the async_session and run it
-			std::make_shared<async_session>(std::move(socket))->run();
+			// Run the async_session, the next accept takes another
+			auto const s = std::move(next_);
+			s->run();
 		}
 
 		// Accept another connection
@@ -407,6 +445,11 @@ void do_coro_listen(
 
 void websocket_server_fast()
 {
+#ifdef ADAM_ASYNC_LOG
+	// Log from a background thread, link with ../Server/logger.cpp
+	server_log::start();
+#endif
+
 	// Check command line arguments.
 	/*if (argc != 4)
 	{
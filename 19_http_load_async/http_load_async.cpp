@@ -0,0 +1,614 @@
+//------------------------------------------------------------------------------
+//
+// Example: HTTP load generator, asynchronous
+//
+// The session of 02_http_client_async, kept connected and sending requests
+// in a loop. Closed loop, each connection sends its next request when the
+// response arrives. Open loop, requests are due at a fixed rate and the
+// latency of one is measured from when it was due, not from when it could
+// be sent, so a stalled server is not hidden by the requests it held back
+// (coordinated omission).
+//
+//------------------------------------------------------------------------------
+
+#include <boost/beast/core.hpp>
+#include <boost/beast/http.hpp>
+#include <boost/beast/version.hpp>
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "http_load_async.hpp"
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+namespace net = boost::asio;            // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+
+using clock_type = std::chrono::steady_clock;
+
+//------------------------------------------------------------------------------
+
+// Latencies in nanoseconds, HdrHistogram style: each power of two is split
+// into 128 buckets, so a percentile is within 1% of the recorded value.
+class latency_histogram
+{
+public:
+	static constexpr std::size_t sub_bits = 7;
+	static constexpr std::size_t sub_buckets = 1 << sub_bits;
+
+	// up to 2^40 nanoseconds, about 18 minutes
+	static constexpr std::size_t max_bits = 40;
+	static constexpr std::size_t num_buckets = (max_bits - sub_bits + 1) * sub_buckets;
+
+private:
+	std::vector<std::uint64_t> counts_ = std::vector<std::uint64_t>(num_buckets);
+	std::uint64_t total_ = 0;
+	std::uint64_t max_ = 0;
+	double sum_ = 0;
+
+	static std::size_t highest_bit(std::uint64_t v)
+	{
+		std::size_t bit = 0;
+		while (v >>= 1)
+			++bit;
+
+		return bit;
+	}
+
+	static std::size_t bucket(std::uint64_t ns)
+	{
+		if (ns < sub_buckets)
+			return static_cast<std::size_t>(ns);
+
+		if (ns >> max_bits)
+			ns = (std::uint64_t(1) << max_bits) - 1;
+
+		auto const bit = highest_bit(ns);
+		auto const sub = static_cast<std::size_t>(ns >> (bit - sub_bits)) & (sub_buckets - 1);
+		return (bit - sub_bits + 1) * sub_buckets + sub;
+	}
+
+	// largest value counted in bucket i
+	static std::uint64_t upper_bound(std::size_t i)
+	{
+		if (i < sub_buckets)
+			return i;
+
+		auto const shift = i / sub_buckets - 1;
+		auto const lower = static_cast<std::uint64_t>(sub_buckets + i % sub_buckets) << shift;
+		return lower + (std::uint64_t(1) << shift) - 1;
+	}
+
+public:
+	void record(std::uint64_t ns)
+	{
+		++counts_[bucket(ns)];
+		++total_;
+		max_ = std::max(max_, ns);
+		sum_ += static_cast<double>(ns);
+	}
+
+	void merge(latency_histogram const& other)
+	{
+		for (std::size_t i = 0; i < num_buckets; ++i)
+			counts_[i] += other.counts_[i];
+
+		total_ += other.total_;
+		max_ = std::max(max_, other.max_);
+		sum_ += other.sum_;
+	}
+
+	// p in [0, 100]
+	std::uint64_t percentile(double p) const
+	{
+		if (total_ == 0)
+			return 0;
+
+		auto const rank = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(p / 100 * static_cast<double>(total_) + 0.5));
+		std::uint64_t below = 0;
+		for (std::size_t i = 0; i < num_buckets; ++i)
+		{
+			below += counts_[i];
+			if (below >= rank)
+				return std::min(upper_bound(i), max_);
+		}
+
+		return max_;
+	}
+
+	std::uint64_t count() const { return total_; }
+	std::uint64_t max() const { return max_; }
+	double mean() const { return total_ ? sum_ / static_cast<double>(total_) : 0; }
+};
+
+// What the connections of a thread count, summed at the end
+struct load_stats {
+	latency_histogram latency;
+	std::uint64_t requests = 0;
+	std::uint64_t bytes = 0;
+	std::uint64_t non_2xx = 0;
+	std::uint64_t connect_errors = 0;
+	std::uint64_t read_errors = 0;
+	std::uint64_t write_errors = 0;
+	std::uint64_t timeouts = 0;
+
+	void merge(load_stats const& other)
+	{
+		latency.merge(other.latency);
+		requests += other.requests;
+		bytes += other.bytes;
+		non_2xx += other.non_2xx;
+		connect_errors += other.connect_errors;
+		read_errors += other.read_errors;
+		write_errors += other.write_errors;
+		timeouts += other.timeouts;
+	}
+};
+
+// A request of the mix, serialized once
+struct prepared_request {
+	std::string data;
+	bool head;
+	unsigned weight;
+};
+
+// Owned by one thread, so the sessions on it need no strand or locks
+struct load_thread {
+	std::vector<prepared_request> const& requests;
+	tcp::resolver::results_type const& endpoints;
+	bool keep_alive;
+
+	// Responses completed in [measure_start, measure_end) are counted
+	clock_type::time_point measure_start;
+	clock_type::time_point measure_end;
+
+	load_stats stats;
+
+	// Response bodies are read into it and dropped, one for all
+	// the sessions keeps thousands of connections small
+	std::array<char, 64 * 1024> scratch;
+
+	// Destroyed first, with the sessions its handlers hold
+	net::io_context ioc{ 1 };
+
+	load_thread(
+		std::vector<prepared_request> const& requests,
+		tcp::resolver::results_type const& endpoints,
+		bool keep_alive)
+		: requests(requests)
+		, endpoints(endpoints)
+		, keep_alive(keep_alive)
+	{
+	}
+};
+
+//------------------------------------------------------------------------------
+
+// Sends requests on one connection until its io_context is stopped
+class session : public std::enable_shared_from_this<session>
+{
+	static constexpr auto timeout = std::chrono::seconds(30);
+
+	load_thread& thread_;
+	beast::tcp_stream stream_;
+	beast::flat_buffer buffer_; // (Must persist between reads)
+	std::optional<http::response_parser<http::buffer_body>> parser_;
+	net::steady_timer timer_;
+	bool connected_ = false;
+
+	// The request being sent and when its latency starts
+	prepared_request const* req_ = nullptr;
+	clock_type::time_point start_;
+
+	// Open loop only, zero for closed loop
+	clock_type::duration interval_;
+	clock_type::time_point due_;
+
+	std::uint64_t random_;
+
+public:
+	session(
+		load_thread& thread,
+		clock_type::duration interval,
+		clock_type::time_point first_due,
+		std::uint64_t seed)
+		: thread_(thread)
+		, stream_(thread.ioc)
+		, timer_(thread.ioc)
+		, interval_(interval)
+		, due_(first_due)
+		, random_(seed | 1)
+	{
+	}
+
+	// Start the asynchronous operation
+	void run()
+	{
+		next_request();
+	}
+
+private:
+	// xorshift64, enough to pick from the mix
+	std::uint64_t random()
+	{
+		random_ ^= random_ << 13;
+		random_ ^= random_ >> 7;
+		random_ ^= random_ << 17;
+		return random_;
+	}
+
+	prepared_request const& pick()
+	{
+		auto const& requests = thread_.requests;
+		if (requests.size() == 1)
+			return requests.front();
+
+		std::uint64_t total = 0;
+		for (auto const& r : requests)
+			total += r.weight;
+
+		auto n = random() % total;
+		for (auto const& r : requests)
+		{
+			if (n < r.weight)
+				return r;
+
+			n -= r.weight;
+		}
+
+		return requests.back();
+	}
+
+	void next_request()
+	{
+		if (interval_ == clock_type::duration::zero())
+			return send(clock_type::now());
+
+		// Due later, wait for it
+		if (clock_type::now() < due_)
+		{
+			timer_.expires_at(due_);
+			return timer_.async_wait(
+				[self = shared_from_this()](beast::error_code ec)
+				{
+					if (!ec)
+						self->send(self->due_);
+				});
+		}
+
+		// Late, send it now but count the wait
+		send(due_);
+	}
+
+	void send(clock_type::time_point start)
+	{
+		req_ = &pick();
+		start_ = start;
+
+		if (!connected_)
+			return do_connect();
+
+		do_write();
+	}
+
+	void do_connect()
+	{
+		// Set a timeout on the operation
+		stream_.expires_after(timeout);
+
+		// Make the connection on one of the resolved addresses
+		stream_.async_connect(
+			thread_.endpoints,
+			beast::bind_front_handler(&session::on_connect, shared_from_this()));
+	}
+
+	void on_connect(beast::error_code ec, tcp::resolver::results_type::endpoint_type)
+	{
+		if (ec)
+		{
+			count_error(ec, thread_.stats.connect_errors);
+
+			// Try again shortly, the server may be at its connection limit
+			timer_.expires_after(std::chrono::milliseconds(100));
+			return timer_.async_wait(
+				[self = shared_from_this()](beast::error_code ec)
+				{
+					if (!ec)
+						self->do_connect();
+				});
+		}
+
+		connected_ = true;
+		stream_.socket().set_option(tcp::no_delay(true), ec);
+
+		do_write();
+	}
+
+	void do_write()
+	{
+		// Set a timeout on the operation
+		stream_.expires_after(timeout);
+
+		// The request is sent as it was serialized
+		net::async_write(stream_, net::buffer(req_->data),
+			beast::bind_front_handler(&session::on_write, shared_from_this()));
+	}
+
+	void on_write(beast::error_code ec, std::size_t)
+	{
+		if (ec)
+			return reconnect(ec, thread_.stats.write_errors);
+
+		parser_.emplace();
+		parser_->body_limit(boost::none);
+
+		// A response to HEAD has a Content-Length but no body
+		parser_->skip(req_->head);
+
+		do_read();
+	}
+
+	void do_read()
+	{
+		auto& body = parser_->get().body();
+		body.data = thread_.scratch.data();
+		body.size = thread_.scratch.size();
+
+		// Receive the HTTP response
+		http::async_read(stream_, buffer_, *parser_,
+			beast::bind_front_handler(&session::on_read, shared_from_this()));
+	}
+
+	void on_read(beast::error_code ec, std::size_t bytes_transferred)
+	{
+		auto const now = clock_type::now();
+		auto const measured = now >= thread_.measure_start && now < thread_.measure_end;
+
+		if (measured)
+			thread_.stats.bytes += bytes_transferred;
+
+		// body_ is full, read on
+		if (ec == http::error::need_buffer)
+			return do_read();
+
+		if (ec)
+			return reconnect(ec, thread_.stats.read_errors);
+
+		auto const& res = parser_->get();
+		if (measured)
+		{
+			auto& stats = thread_.stats;
+			++stats.requests;
+			stats.latency.record(static_cast<std::uint64_t>(
+				std::chrono::duration_cast<std::chrono::nanoseconds>(now - start_).count()));
+
+			if (res.result_int() < 200 || res.result_int() >= 300)
+				++stats.non_2xx;
+		}
+
+		if (!thread_.keep_alive || !res.keep_alive())
+			close();
+
+		due_ += interval_;
+		next_request();
+	}
+
+	void count_error(beast::error_code ec, std::uint64_t& counter)
+	{
+		auto const now = clock_type::now();
+		if (now < thread_.measure_start || now >= thread_.measure_end)
+			return;
+
+		if (ec == beast::error::timeout)
+			++thread_.stats.timeouts;
+		else
+			++counter;
+	}
+
+	// The request is not counted, the next one gets a new connection
+	void reconnect(beast::error_code ec, std::uint64_t& counter)
+	{
+		count_error(ec, counter);
+		close();
+
+		due_ += interval_;
+		next_request();
+	}
+
+	void close()
+	{
+		beast::error_code ec;
+		stream_.socket().shutdown(tcp::socket::shutdown_both, ec);
+		stream_.socket().close(ec);
+
+		buffer_.clear();
+		connected_ = false;
+	}
+};
+
+//------------------------------------------------------------------------------
+
+namespace {
+
+	std::vector<prepared_request> prepare(load_options const& options)
+	{
+		std::vector<prepared_request> prepared;
+
+		auto requests = options.requests;
+		if (requests.empty())
+			requests.emplace_back();
+
+		for (auto const& r : requests)
+		{
+			auto const method = http::string_to_verb(r.method);
+			if (method == http::verb::unknown)
+				throw std::invalid_argument("unknown method " + r.method);
+
+			http::request<http::string_body> req{ method, r.target, 11 };
+			req.set(http::field::host, options.host);
+			req.set(http::field::user_agent, BOOST_BEAST_VERSION_STRING);
+			req.keep_alive(options.keep_alive);
+
+			if (method == http::verb::post || method == http::verb::put)
+				req.body().assign(options.body_size, 'x');
+
+			req.prepare_payload();
+
+			std::ostringstream out;
+			out << req;
+			prepared.push_back({ out.str(), method == http::verb::head, std::max(1u, r.weight) });
+		}
+
+		return prepared;
+	}
+
+	double to_us(std::uint64_t ns)
+	{
+		return static_cast<double>(ns) / 1000;
+	}
+
+	load_result summarize(load_options const& options, load_stats const& s)
+	{
+		auto const& h = s.latency;
+
+		load_result r;
+		r.duration = options.duration;
+		r.requests = s.requests;
+		r.bytes = s.bytes;
+		r.non_2xx = s.non_2xx;
+		r.connect_errors = s.connect_errors;
+		r.read_errors = s.read_errors;
+		r.write_errors = s.write_errors;
+		r.timeouts = s.timeouts;
+		r.rps = static_cast<double>(s.requests) / options.duration;
+		r.mean_us = h.mean() / 1000;
+		r.p50_us = to_us(h.percentile(50));
+		r.p90_us = to_us(h.percentile(90));
+		r.p99_us = to_us(h.percentile(99));
+		r.p999_us = to_us(h.percentile(99.9));
+		r.p9999_us = to_us(h.percentile(99.99));
+		r.max_us = to_us(h.max());
+		return r;
+	}
+}
+
+void print_load_result(load_options const& options, load_result const& r)
+{
+	auto const mbps = static_cast<double>(r.bytes) / r.duration / (1024 * 1024);
+
+	if (options.json)
+	{
+		std::printf("{\"connections\": %u, \"threads\": %u, \"duration_s\": %g, \"rate\": %g, \"keep_alive\": %s, "
+			"\"requests\": %llu, \"rps\": %.1f, \"bytes\": %llu, \"mb_per_s\": %.3f, "
+			"\"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"p9999\": %.1f, \"max\": %.1f}, "
+			"\"non_2xx\": %llu, \"errors\": {\"connect\": %llu, \"read\": %llu, \"write\": %llu, \"timeout\": %llu}}\n",
+			options.connections, options.threads, r.duration, options.rate, options.keep_alive ? "true" : "false",
+			static_cast<unsigned long long>(r.requests), r.rps, static_cast<unsigned long long>(r.bytes), mbps,
+			r.mean_us, r.p50_us, r.p90_us, r.p99_us, r.p999_us, r.p9999_us, r.max_us,
+			static_cast<unsigned long long>(r.non_2xx),
+			static_cast<unsigned long long>(r.connect_errors),
+			static_cast<unsigned long long>(r.read_errors),
+			static_cast<unsigned long long>(r.write_errors),
+			static_cast<unsigned long long>(r.timeouts));
+		return;
+	}
+
+	std::printf("%gs at %s:%s, %u connections on %u threads, ",
+		r.duration, options.host.c_str(), options.port.c_str(), options.connections, options.threads);
+
+	if (options.rate > 0)
+		std::printf("%g requests/s open loop\n", options.rate);
+	else
+		std::printf("closed loop\n");
+
+	std::printf("  requests    %llu\n", static_cast<unsigned long long>(r.requests));
+	std::printf("  throughput  %.1f requests/s, %.2f MB/s\n", r.rps, mbps);
+	std::printf("  latency     mean %.1fus, p50 %.1fus, p90 %.1fus, p99 %.1fus, p99.9 %.1fus, p99.99 %.1fus, max %.1fus\n",
+		r.mean_us, r.p50_us, r.p90_us, r.p99_us, r.p999_us, r.p9999_us, r.max_us);
+	std::printf("  non-2xx     %llu\n", static_cast<unsigned long long>(r.non_2xx));
+	std::printf("  errors      connect %llu, read %llu, write %llu, timeout %llu\n",
+		static_cast<unsigned long long>(r.connect_errors),
+		static_cast<unsigned long long>(r.read_errors),
+		static_cast<unsigned long long>(r.write_errors),
+		static_cast<unsigned long long>(r.timeouts));
+}
+
+load_result http_load_async(load_options const& options)
+{
+	auto const requests = prepare(options);
+	auto const threads = std::max(1u, options.threads);
+	auto const connections = std::max(1u, options.connections);
+
+	// Resolved once for all the connections
+	net::io_context resolver_ioc;
+	tcp::resolver resolver(resolver_ioc);
+	auto const endpoints = resolver.resolve(options.host, options.port);
+
+	auto const start = clock_type::now();
+	auto const seconds = [](double s)
+	{
+		return std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(s));
+	};
+
+	std::vector<std::unique_ptr<load_thread>> loaders;
+	for (unsigned i = 0; i < threads; ++i)
+	{
+		loaders.push_back(std::make_unique<load_thread>(requests, endpoints, options.keep_alive));
+		loaders.back()->measure_start = start + seconds(options.warmup);
+		loaders.back()->measure_end = loaders.back()->measure_start + seconds(options.duration);
+	}
+
+	// Open loop: each connection sends every connections / rate seconds,
+	// the connections staggered so the requests are evenly spaced
+	auto const interval = options.rate > 0 ? seconds(connections / options.rate) : clock_type::duration::zero();
+	auto const stagger = options.rate > 0 ? seconds(1 / options.rate) : clock_type::duration::zero();
+
+	for (unsigned i = 0; i < connections; ++i)
+		std::make_shared<session>(*loaders[i % threads], interval, start + stagger * i, i + 1)->run();
+
+	std::vector<std::thread> v;
+	v.reserve(threads);
+	for (auto& l : loaders)
+		v.emplace_back(
+			[&l, &options, first = l == loaders.front()]
+			{
+				// The first thread tells the caller when the measured time starts and ends
+				net::steady_timer begin(l->ioc, l->measure_start);
+				if (first && options.on_measure_start)
+					begin.async_wait([&options](beast::error_code) { options.on_measure_start(); });
+
+				// Requests in flight at the end are dropped
+				net::steady_timer end(l->ioc, l->measure_end);
+				end.async_wait(
+					[&l, &options, first](beast::error_code)
+					{
+						if (first && options.on_measure_end)
+							options.on_measure_end();
+
+						l->ioc.stop();
+					});
+
+				l->ioc.run();
+			});
+
+	for (auto& t : v)
+		t.join();
+
+	load_stats total;
+	for (auto const& l : loaders)
+		total.merge(l->stats);
+
+	return summarize(options, total);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// One kind of request in the mix, sent in proportion to its weight
+struct load_request {
+	std::string method = "GET";
+	std::string target = "/";
+	unsigned weight = 1;
+};
+
+struct load_options {
+	std::string host = "localhost";
+	std::string port = "5000";
+	unsigned connections = 16;
+	unsigned threads = 1;
+	double duration = 10;      // seconds measured
+	double warmup = 1;         // seconds run before measuring
+	double rate = 0;           // requests a second over all connections, 0 is as fast as the server answers
+	bool keep_alive = true;    // false connects again for every request
+	std::size_t body_size = 0; // bytes sent with POST and PUT
+	std::vector<load_request> requests;
+	bool json = false;         // print one JSON object instead of the table
+
+	// Called from a load thread when the measured time starts and ends
+	std::function<void()> on_measure_start;
+	std::function<void()> on_measure_end;
+};
+
+// What was measured, latencies in microseconds
+struct load_result {
+	double duration = 0;
+	std::uint64_t requests = 0;
+	std::uint64_t bytes = 0;
+	std::uint64_t non_2xx = 0;
+	std::uint64_t connect_errors = 0;
+	std::uint64_t read_errors = 0;
+	std::uint64_t write_errors = 0;
+	std::uint64_t timeouts = 0;
+	double rps = 0;
+	double mean_us = 0;
+	double p50_us = 0;
+	double p90_us = 0;
+	double p99_us = 0;
+	double p999_us = 0;
+	double p9999_us = 0;
+	double max_us = 0;
+};
+
+load_result http_load_async(load_options const& options);
+
+// As a table, or one JSON object with options.json
+void print_load_result(load_options const& options, load_result const& result);
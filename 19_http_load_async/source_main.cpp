@@ -0,0 +1,102 @@
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "http_load_async.hpp"
+
+void usage() {
+	std::cerr <<
+		"Usage: http-load-async [options]\n"
+		"    -h host          default localhost\n"
+		"    -p port          default 5000\n"
+		"    -c connections   default 16\n"
+		"    -t threads       default 1\n"
+		"    -d seconds       measured, default 10\n"
+		"    -w seconds       run before measuring, default 1\n"
+		"    -R rate          requests/s over all connections, open loop. Default 0, closed loop\n"
+		"    -r request       \"[weight] [method] target\", may be repeated. Default \"GET /\"\n"
+		"    -b bytes         body size of POST and PUT requests, default 0\n"
+		"    --close          a new connection for every request\n"
+		"    --json           print one JSON object\n"
+		"Example:\n"
+		"    http-load-async -c 64 -t 4 -r \"9 GET /text\" -r \"1 GET /file\"\n"
+		"    http-load-async -c 64 -R 20000 -d 30 -r /json\n";
+}
+
+// "[weight] [method] target"
+load_request parse_request(std::string const& text) {
+	std::istringstream in(text);
+	std::string word;
+	load_request r;
+
+	in >> word;
+	if (!word.empty() && word[0] >= '0' && word[0] <= '9') {
+		r.weight = static_cast<unsigned>(std::strtoul(word.c_str(), nullptr, 10));
+		in >> word;
+	}
+
+	if (!word.empty() && word[0] != '/') {
+		r.method = word;
+		in >> word;
+	}
+
+	r.target = word;
+	return r;
+}
+
+int main(int argc, char* argv[]) {
+
+	try {
+		load_options options;
+
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+
+			if (arg == "--close") {
+				options.keep_alive = false;
+				continue;
+			}
+
+			if (arg == "--json") {
+				options.json = true;
+				continue;
+			}
+
+			if (i + 1 == argc || arg.size() != 2 || arg[0] != '-') {
+				usage();
+				return EXIT_FAILURE;
+			}
+
+			char const* value = argv[++i];
+			switch (arg[1]) {
+			case 'h': options.host = value; break;
+			case 'p': options.port = value; break;
+			case 'c': options.connections = static_cast<unsigned>(std::strtoul(value, nullptr, 10)); break;
+			case 't': options.threads = static_cast<unsigned>(std::strtoul(value, nullptr, 10)); break;
+			case 'd': options.duration = std::strtod(value, nullptr); break;
+			case 'w': options.warmup = std::strtod(value, nullptr); break;
+			case 'R': options.rate = std::strtod(value, nullptr); break;
+			case 'r': options.requests.push_back(parse_request(value)); break;
+			case 'b': options.body_size = std::strtoul(value, nullptr, 10); break;
+			default:
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (options.duration <= 0) {
+			usage();
+			return EXIT_FAILURE;
+		}
+
+		print_load_result(options, http_load_async(options));
+	}
+	catch (std::exception const& e)
+	{
+		std::cerr << "Error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,321 @@
+//------------------------------------------------------------------------------
+//
+// Example: comparative benchmark of the HTTP servers
+//
+// Each run starts a fresh server from its own doc root, drives it with the
+// load generator of 19_http_load_async and stops it, so the peak RSS and
+// the CPU time belong to that run alone. The results are printed as CSV.
+// Linux only, the servers are started with fork and measured from /proc.
+//
+//------------------------------------------------------------------------------
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <csignal>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+#include "../19_http_load_async/http_load_async.hpp"
+#include "http_benchmark.hpp"
+
+namespace net = boost::asio;            // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+
+#ifdef __linux__
+
+namespace {
+
+	struct server_variant {
+		std::string name;
+		std::string binary;
+		std::string port;
+		std::vector<std::string> args;
+		std::string tiny_target;
+		bool serves_files;
+	};
+
+	struct workload {
+		std::string name;
+		std::string target; // empty for the variant's tiny target
+		std::size_t size;   // of the file served, 0 for none
+	};
+
+	// The examples serve files from their working directory on 5001,
+	// Server answers its routes on 5000. Server is run in both thread modes
+	// at 1, 4, 16 and 64 threads, the comparison left open when they were added.
+	std::vector<server_variant> variants()
+	{
+		std::vector<server_variant> v{
+			{ "08_http_server_sync", "08_http_server_sync", "5001", {}, "/tiny.txt", true },
+			{ "09_http_server_async", "09_http_server_async", "5001", {}, "/tiny.txt", true },
+			{ "10_http_server_coro", "10_http_server_coro", "5001", {}, "/tiny.txt", true },
+			{ "11_http_server_stackless", "11_http_server_stackless", "5001", {}, "/tiny.txt", true },
+			{ "12_http_server_fast", "12_http_server_fast", "5001", {}, "/tiny.txt", true },
+			{ "13_http_server_small", "13_http_server_small", "5001", {}, "/count", false },
+		};
+
+		for (auto const mode : { "shared", "per_thread" })
+			for (auto const threads : { "1", "4", "16", "64" })
+				v.push_back({ std::string("Server_") + mode + "_" + threads, "Server", "5000", { threads, mode }, "/text", false });
+
+		return v;
+	}
+
+	std::vector<workload> const workloads{
+		{ "tiny", "", 0 },
+		{ "4k", "/4k.bin", 4 * 1024 },
+		{ "1m", "/1m.bin", 1024 * 1024 },
+	};
+
+	bool selected(std::vector<std::string> const& filters, std::string const& name)
+	{
+		if (filters.empty())
+			return true;
+
+		return std::any_of(filters.begin(), filters.end(),
+			[&name](std::string const& f) { return name.find(f) != std::string::npos; });
+	}
+
+	// The files of the workloads, in a directory of its own
+	std::string make_doc_root()
+	{
+		char dir[] = "/tmp/http_benchmark_XXXXXX";
+		if (!::mkdtemp(dir))
+			throw std::runtime_error("mkdtemp failed");
+
+		std::ofstream(std::string(dir) + "/tiny.txt") << "Hello, world!";
+		std::ofstream(std::string(dir) + "/index.html") << "<html><body>benchmark</body></html>";
+
+		for (auto const& w : workloads)
+			if (w.size > 0)
+				std::ofstream(dir + w.target, std::ios::binary) << std::string(w.size, 'x');
+
+		return dir;
+	}
+
+	void remove_doc_root(std::string const& dir)
+	{
+		for (auto const name : { "/tiny.txt", "/index.html", "/4k.bin", "/1m.bin" })
+			std::remove((dir + name).c_str());
+
+		::rmdir(dir.c_str());
+	}
+
+	// Started in the doc root with its output discarded
+	pid_t start_server(server_variant const& v, std::string const& bin_dir, std::string const& doc_root)
+	{
+		auto const path = bin_dir + "/" + v.binary;
+
+		auto const pid = ::fork();
+		if (pid != 0)
+			return pid;
+
+		if (::chdir(doc_root.c_str()) != 0)
+			::_exit(127);
+
+		auto const null = ::open("/dev/null", O_RDWR);
+		::dup2(null, STDIN_FILENO);
+		::dup2(null, STDOUT_FILENO);
+		::dup2(null, STDERR_FILENO);
+
+		std::vector<char*> argv{ const_cast<char*>(path.c_str()) };
+		for (auto const& a : v.args)
+			argv.push_back(const_cast<char*>(a.c_str()));
+
+		argv.push_back(nullptr);
+		::execv(path.c_str(), argv.data());
+		::_exit(127);
+	}
+
+	// false if the server exited or did not listen within 5 seconds
+	bool wait_listening(pid_t pid, std::string const& port)
+	{
+		net::io_context ioc;
+		tcp::endpoint const endpoint{ net::ip::make_address("127.0.0.1"), static_cast<unsigned short>(std::stoi(port)) };
+
+		for (auto i = 0; i < 100; ++i)
+		{
+			int status;
+			if (::waitpid(pid, &status, WNOHANG) == pid)
+				return false;
+
+			tcp::socket socket(ioc);
+			boost::system::error_code ec;
+			socket.connect(endpoint, ec);
+			if (!ec)
+				return true;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+
+		return false;
+	}
+
+	void stop_server(pid_t pid)
+	{
+		::kill(pid, SIGTERM);
+
+		for (auto i = 0; i < 60; ++i)
+		{
+			int status;
+			if (::waitpid(pid, &status, WNOHANG) == pid)
+				return;
+
+			std::this_thread::sleep_for(std::chrono::milliseconds(50));
+		}
+
+		::kill(pid, SIGKILL);
+		::waitpid(pid, nullptr, 0);
+	}
+
+	// User and system time of all the threads of pid
+	double cpu_seconds(pid_t pid)
+	{
+		std::ifstream in("/proc/" + std::to_string(pid) + "/stat");
+		std::string stat((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+		// The fields after the command name, which may contain spaces
+		auto const paren = stat.rfind(')');
+		if (paren == std::string::npos)
+			return 0;
+
+		std::istringstream fields(stat.substr(paren + 2));
+		std::string field;
+		unsigned long long utime = 0, stime = 0;
+		for (auto i = 3; fields >> field; ++i)
+		{
+			if (i == 14)
+				utime = std::strtoull(field.c_str(), nullptr, 10);
+			else if (i == 15)
+			{
+				stime = std::strtoull(field.c_str(), nullptr, 10);
+				break;
+			}
+		}
+
+		return static_cast<double>(utime + stime) / static_cast<double>(::sysconf(_SC_CLK_TCK));
+	}
+
+	// Peak resident set size in kB
+	unsigned long peak_rss_kb(pid_t pid)
+	{
+		std::ifstream in("/proc/" + std::to_string(pid) + "/status");
+		std::string line;
+		while (std::getline(in, line))
+			if (line.compare(0, 6, "VmHWM:") == 0)
+				return std::strtoul(line.c_str() + 6, nullptr, 10);
+
+		return 0;
+	}
+
+	// Thousands of connections need as many descriptors, here and in the servers
+	void raise_file_limit()
+	{
+		rlimit limit;
+		if (::getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+		{
+			limit.rlim_cur = limit.rlim_max;
+			::setrlimit(RLIMIT_NOFILE, &limit);
+		}
+	}
+}
+
+int http_benchmark(benchmark_options const& options)
+{
+	raise_file_limit();
+
+	auto const doc_root = make_doc_root();
+	auto const threads = options.threads ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+
+	std::printf("server,workload,connections,keep_alive,requests,rps,p50_us,p99_us,p999_us,max_us,rss_kb,cpu_us_per_request,non_2xx,errors\n");
+	std::fflush(stdout);
+
+	for (auto const& v : variants())
+	{
+		if (!selected(options.servers, v.name))
+			continue;
+
+		for (auto const& w : workloads)
+		{
+			if (!selected(options.workloads, w.name) || (w.size > 0 && !v.serves_files))
+				continue;
+
+			for (auto const connections : options.connections)
+			{
+				for (auto const keep_alive : { true, false })
+				{
+					std::cerr << v.name << " " << w.name << " " << connections << (keep_alive ? " keep-alive" : " close") << "\n";
+
+					auto const pid = start_server(v, options.bin_dir, doc_root);
+					if (pid < 0 || !wait_listening(pid, v.port))
+					{
+						std::cerr << "    " << v.binary << " did not start, skipped\n";
+						if (pid > 0)
+							stop_server(pid);
+
+						continue;
+					}
+
+					load_options load;
+					load.host = "127.0.0.1";
+					load.port = v.port;
+					load.connections = connections;
+					load.threads = std::min(threads, connections);
+					load.duration = options.duration;
+					load.warmup = options.warmup;
+					load.keep_alive = keep_alive;
+					load.requests.push_back({ "GET", w.target.empty() ? v.tiny_target : w.target, 1 });
+
+					// Only the measured time is charged to the requests
+					double cpu_start = 0, cpu_end = 0;
+					load.on_measure_start = [&] { cpu_start = cpu_seconds(pid); };
+					load.on_measure_end = [&] { cpu_end = cpu_seconds(pid); };
+
+					auto const r = http_load_async(load);
+					auto const rss = peak_rss_kb(pid);
+					stop_server(pid);
+
+					auto const cpu_per_request = r.requests ? (cpu_end - cpu_start) * 1e6 / static_cast<double>(r.requests) : 0;
+					auto const errors = r.connect_errors + r.read_errors + r.write_errors + r.timeouts;
+
+					std::printf("%s,%s,%u,%d,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%lu,%.2f,%llu,%llu\n",
+						v.name.c_str(), w.name.c_str(), connections, keep_alive ? 1 : 0,
+						static_cast<unsigned long long>(r.requests), r.rps,
+						r.p50_us, r.p99_us, r.p999_us, r.max_us,
+						rss, cpu_per_request,
+						static_cast<unsigned long long>(r.non_2xx),
+						static_cast<unsigned long long>(errors));
+					std::fflush(stdout);
+				}
+			}
+		}
+	}
+
+	remove_doc_root(doc_root);
+	return EXIT_SUCCESS;
+}
+
+#else
+
+int http_benchmark(benchmark_options const&)
+{
+	std::cerr << "The benchmark starts the servers with fork and measures them from /proc, it needs Linux\n";
+	return EXIT_FAILURE;
+}
+
+#endif
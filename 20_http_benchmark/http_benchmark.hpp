@@ -0,0 +1,17 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+struct benchmark_options {
+	std::string bin_dir = ".";     // the servers, named like their directories: 08_http_server_sync, ..., Server
+	double duration = 5;           // seconds measured per run
+	double warmup = 1;             // seconds run before measuring
+	unsigned threads = 0;          // load threads, 0 is one per cpu
+	std::vector<unsigned> connections{ 10, 1000, 10000 };
+	std::vector<std::string> servers;   // names containing one of these, all if empty
+	std::vector<std::string> workloads; // tiny, 4k, 1m, all if empty
+};
+
+// Runs every workload against every server and prints one CSV row per run
+int http_benchmark(benchmark_options const& options);
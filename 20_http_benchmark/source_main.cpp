@@ -0,0 +1,78 @@
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "http_benchmark.hpp"
+
+void usage() {
+	std::cerr <<
+		"Usage: http-benchmark [options] > results.csv\n"
+		"    -b dir           directory of the server binaries, default .\n"
+		"    -d seconds       measured per run, default 5\n"
+		"    -w seconds       run before measuring, default 1\n"
+		"    -t threads       load threads, default one per cpu\n"
+		"    -c list          connections, default 10,1000,10000\n"
+		"    -s list          servers whose names contain one of these, default all\n"
+		"    -W list          workloads among tiny,4k,1m, default all\n"
+		"Example:\n"
+		"    http-benchmark -b ./bin -c 10,1000 -s 09,11,Server_per_thread\n";
+}
+
+std::vector<std::string> split(std::string const& text) {
+	std::vector<std::string> items;
+	std::istringstream in(text);
+	std::string item;
+	while (std::getline(in, item, ','))
+		if (!item.empty())
+			items.push_back(item);
+
+	return items;
+}
+
+int main(int argc, char* argv[]) {
+
+	try {
+		benchmark_options options;
+
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			if (i + 1 == argc || arg.size() != 2 || arg[0] != '-') {
+				usage();
+				return EXIT_FAILURE;
+			}
+
+			std::string const value = argv[++i];
+			switch (arg[1]) {
+			case 'b': options.bin_dir = value; break;
+			case 'd': options.duration = std::strtod(value.c_str(), nullptr); break;
+			case 'w': options.warmup = std::strtod(value.c_str(), nullptr); break;
+			case 't': options.threads = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10)); break;
+			case 's': options.servers = split(value); break;
+			case 'W': options.workloads = split(value); break;
+			case 'c':
+				options.connections.clear();
+				for (auto const& c : split(value))
+					options.connections.push_back(static_cast<unsigned>(std::strtoul(c.c_str(), nullptr, 10)));
+				break;
+			default:
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (options.duration <= 0 || options.connections.empty()) {
+			usage();
+			return EXIT_FAILURE;
+		}
+
+		return http_benchmark(options);
+	}
+	catch (std::exception const& e)
+	{
+		std::cerr << "Error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+}
@@ -0,0 +1,113 @@
+//------------------------------------------------------------------------------
+//
+// Example: microbenchmark of fields_alloc
+//
+// Builds and destroys header sets of 10, 50 and 200 fields with
+// basic_fields<std::allocator> and with the fields_alloc of
+// 12_http_server_fast, one allocator kept per thread as http_worker does.
+// Sets larger than the first block show the cost of the chained blocks.
+//
+//------------------------------------------------------------------------------
+
+#include <boost/beast/http.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "../12_http_server_fast/fields_alloc.hpp"
+#include "fields_alloc_benchmark.hpp"
+
+namespace beast = boost::beast;         // from <boost/beast.hpp>
+namespace http = beast::http;           // from <boost/beast/http.hpp>
+
+namespace {
+
+	struct header_set {
+		std::vector<std::string> names;
+		std::vector<std::string> values;
+	};
+
+	// Names and values about as long as those of browser requests
+	header_set make_headers(std::size_t count)
+	{
+		header_set h;
+		for (std::size_t i = 0; i < count; ++i)
+		{
+			h.names.push_back("X-Benchmark-Field-" + std::to_string(i));
+			h.values.push_back("value-" + std::to_string(i * 7919) + "-abcdefghijklmnopqrstuvwxyz");
+		}
+
+		return h;
+	}
+
+	// Keeps the compiler from dropping the fields it built
+	std::size_t volatile sink;
+
+	template<class Allocator>
+	void build(header_set const& h, std::size_t iterations, Allocator const& alloc)
+	{
+		for (std::size_t i = 0; i < iterations; ++i)
+		{
+			http::basic_fields<Allocator> fields(alloc);
+			for (std::size_t j = 0; j < h.names.size(); ++j)
+				fields.insert(h.names[j], h.values[j]);
+
+			sink = fields.count(h.names.back());
+		}
+	}
+
+	// Seconds for every thread to build its messages, each with its own allocator
+	template<class MakeAllocator>
+	double run(fields_benchmark_options const& options, header_set const& h, MakeAllocator make)
+	{
+		auto const start = std::chrono::steady_clock::now();
+
+		std::vector<std::thread> threads;
+		threads.reserve(options.threads);
+		for (unsigned t = 0; t < options.threads; ++t)
+			threads.emplace_back([&] { build(h, options.iterations, make()); });
+
+		for (auto& t : threads)
+			t.join();
+
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	void print_row(char const* allocator, std::size_t headers, fields_benchmark_options const& options, double seconds, double baseline)
+	{
+		auto const messages = static_cast<double>(options.iterations) * options.threads;
+		std::printf("%-24s %8zu %14.1f %14.0f %9.2fx\n",
+			allocator, headers, seconds * 1e9 / messages, messages / seconds, baseline / seconds);
+	}
+}
+
+int fields_alloc_benchmark(fields_benchmark_options const& options)
+{
+	std::printf("%-24s %8s %14s %14s %10s\n", "allocator", "headers", "ns/message", "messages/s", "speedup");
+
+	for (auto const count : options.header_counts)
+	{
+		if (count == 0)
+			continue;
+
+		auto const h = make_headers(count);
+
+		// Once untimed, so the heap and the free lists of the threads are warm
+		run(options, h, [] { return std::allocator<char>(); });
+
+		auto const std_seconds = run(options, h, [] { return std::allocator<char>(); });
+		auto const pool_seconds = run(options, h, [&] { return fields_alloc<char>(options.block_size); });
+		auto const atomic_seconds = run(options, h, [&] { return fields_alloc<char, true>(options.block_size); });
+
+		print_row("std::allocator", count, options, std_seconds, std_seconds);
+		print_row("fields_alloc", count, options, pool_seconds, std_seconds);
+		print_row("fields_alloc<atomic>", count, options, atomic_seconds, std_seconds);
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+struct fields_benchmark_options {
+	std::vector<std::size_t> header_counts{ 10, 50, 200 };
+	std::size_t iterations = 100000; // messages built per allocator and header count
+	std::size_t block_size = 8192;   // first block of fields_alloc, as in http_worker
+	unsigned threads = 1;            // threads building messages at once
+};
+
+// Times building and destroying basic_fields with std::allocator and with
+// fields_alloc, prints one table row per allocator and header count
+int fields_alloc_benchmark(fields_benchmark_options const& options);
@@ -0,0 +1,64 @@
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "fields_alloc_benchmark.hpp"
+
+void usage() {
+	std::cerr <<
+		"Usage: fields-alloc-benchmark [options]\n"
+		"    -n list          header counts, default 10,50,200\n"
+		"    -i iterations    messages per run, default 100000\n"
+		"    -s bytes         first block of fields_alloc, default 8192\n"
+		"    -t threads       threads building messages at once, default 1\n"
+		"Example:\n"
+		"    fields-alloc-benchmark -n 10,200 -s 1024 -t 4\n";
+}
+
+int main(int argc, char* argv[]) {
+
+	try {
+		fields_benchmark_options options;
+
+		for (int i = 1; i < argc; ++i) {
+			std::string const arg = argv[i];
+			if (i + 1 == argc || arg.size() != 2 || arg[0] != '-') {
+				usage();
+				return EXIT_FAILURE;
+			}
+
+			std::string const value = argv[++i];
+			switch (arg[1]) {
+			case 'i': options.iterations = std::strtoul(value.c_str(), nullptr, 10); break;
+			case 's': options.block_size = std::strtoul(value.c_str(), nullptr, 10); break;
+			case 't': options.threads = static_cast<unsigned>(std::strtoul(value.c_str(), nullptr, 10)); break;
+			case 'n': {
+				options.header_counts.clear();
+				std::istringstream in(value);
+				std::string count;
+				while (std::getline(in, count, ','))
+					if (!count.empty())
+						options.header_counts.push_back(std::strtoul(count.c_str(), nullptr, 10));
+				break;
+			}
+			default:
+				usage();
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (options.iterations == 0 || options.threads == 0 || options.header_counts.empty()) {
+			usage();
+			return EXIT_FAILURE;
+		}
+
+		return fields_alloc_benchmark(options);
+	}
+	catch (std::exception const& e)
+	{
+		std::cerr << "Error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+}
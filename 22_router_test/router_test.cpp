@@ -0,0 +1,124 @@
+//------------------------------------------------------------------------------
+//
+// Example: checks of the server_async router
+//
+// Builds one route table and matches targets against it: literals before
+// parameters before wildcards, query strings, and parameter names kept
+// per route when two routes capture the same position. A route with more
+// parameters than a match holds must be refused.
+//
+//------------------------------------------------------------------------------
+
+#include <cstddef>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "../Server/router.hpp"
+#include "router_test.hpp"
+
+namespace {
+
+	struct param {
+		std::string_view name;
+		std::string_view value;
+	};
+
+	struct test_case {
+		std::string_view target;
+		int route;                  // handler expected, 0 for no match
+		std::vector<param> params;  // captures expected by name
+		std::string_view wildcard;
+		std::string_view query;
+	};
+
+	int check(server_async::router<int> const& routes, test_case const& t)
+	{
+		server_async::route_match m;
+		auto const handler = routes.find(t.target, m);
+		auto const route = handler ? *handler : 0;
+
+		int failures = 0;
+		auto const fail = [&](std::string const& what)
+		{
+			std::cout << "FAIL " << t.target << ": " << what << "\n";
+			++failures;
+		};
+
+		if (route != t.route)
+			fail("route " + std::to_string(route) + ", expected " + std::to_string(t.route));
+
+		if (route == 0)
+			return failures;
+
+		if (m.num_params != t.params.size())
+			fail(std::to_string(m.num_params) + " params, expected " + std::to_string(t.params.size()));
+
+		for (auto const& p : t.params)
+		{
+			if (m.get(p.name) != p.value)
+				fail("param " + std::string(p.name) + " is \"" + std::string(m.get(p.name)) + "\", expected \"" + std::string(p.value) + "\"");
+		}
+
+		if (m.wildcard != t.wildcard)
+			fail("wildcard \"" + std::string(m.wildcard) + "\", expected \"" + std::string(t.wildcard) + "\"");
+
+		if (m.query != t.query)
+			fail("query \"" + std::string(m.query) + "\", expected \"" + std::string(t.query) + "\"");
+
+		return failures;
+	}
+}
+
+int router_test()
+{
+	server_async::router<int> routes;
+	routes.add("/", 1);
+	routes.add("/users", 2);
+	routes.add("/users/{id}", 3);
+	routes.add("/users/me", 4);
+	routes.add("/static/*", 5);
+
+	// The same position named differently by two routes
+	routes.add("/a/{id}", 6);
+	routes.add("/a/{uid}/posts", 7);
+	routes.add("/a/{uid}/posts/{post}", 8);
+	routes.add("/files/{owner}/*", 9);
+	routes.add("/p/{a}/{b}/{c}/{d}/{e}/{f}/{g}/{h}", 10);
+
+	std::vector<test_case> const cases = {
+		{ "/", 1, {}, {}, {} },
+		{ "/users", 2, {}, {}, {} },
+		{ "/users?sort=name", 2, {}, {}, "sort=name" },
+		{ "/users/42", 3, { { "id", "42" } }, {}, {} },
+		{ "/users/me", 4, {}, {}, {} },
+		{ "/users/42/x", 0, {}, {}, {} },
+		{ "/static/css/site.css", 5, {}, "css/site.css", {} },
+		{ "/a/5", 6, { { "id", "5" } }, {}, {} },
+		{ "/a/5/posts", 7, { { "uid", "5" } }, {}, {} },
+		{ "/a/5/posts/9?full", 8, { { "uid", "5" }, { "post", "9" } }, {}, "full" },
+		{ "/files/ann/a/b.txt", 9, { { "owner", "ann" } }, "a/b.txt", {} },
+		{ "/p/1/2/3/4/5/6/7/8", 10, { { "a", "1" }, { "b", "2" }, { "c", "3" }, { "d", "4" }, { "e", "5" }, { "f", "6" }, { "g", "7" }, { "h", "8" } }, {}, {} },
+		{ "/missing", 0, {}, {}, {} },
+	};
+
+	int failures = 0;
+	for (auto const& t : cases)
+		failures += check(routes, t);
+
+	// More parameters than a match holds is refused when added
+	try
+	{
+		routes.add("/q/{a}/{b}/{c}/{d}/{e}/{f}/{g}/{h}/{i}", 11);
+		std::cout << "FAIL route with 9 parameters was added\n";
+		++failures;
+	}
+	catch (std::invalid_argument const&)
+	{
+	}
+
+	std::cout << cases.size() << " cases, " << failures << " failures\n";
+	return failures;
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Matches targets against a fixed route table and prints each case
+// that fails, returns the number of failures
+int router_test();
@@ -0,0 +1,287 @@
+//------------------------------------------------------------------------------
+//
+// Example: allocation count of the server_async session
+//
+// Replaces the global operator new with one that counts, runs a server on
+// a local port and sends it keep-alive requests from a blocking socket with
+// fixed buffers. Once the connection is warmed up, a template, a JSON and a
+// cached file response must be written without any allocation, in both
+// thread modes. A multipart range response of the cached file, which may
+// allocate, must keep the responses pipelined after it in step.
+//
+//------------------------------------------------------------------------------
+
+#include <boost/asio/connect.hpp>
+#include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/read.hpp>
+#include <boost/asio/write.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <string>
+#include <string_view>
+#include <thread>
+
+#include "../Server/server.hpp"
+#include "alloc_test.hpp"
+
+namespace net = boost::asio;            // from <boost/asio.hpp>
+using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
+
+namespace svr = server_async;
+
+namespace {
+
+	// Every operator new of every thread, the server's included
+	std::atomic<std::size_t> allocations{ 0 };
+
+	void* allocate(std::size_t size)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+		if (auto const p = std::malloc(size == 0 ? 1 : size))
+			return p;
+
+		throw std::bad_alloc();
+	}
+
+	void* allocate(std::size_t size, std::align_val_t alignment)
+	{
+		allocations.fetch_add(1, std::memory_order_relaxed);
+
+		// aligned_alloc wants a multiple of the alignment
+		auto const align = static_cast<std::size_t>(alignment);
+		if (auto const p = std::aligned_alloc(align, (size + align - 1) / align * align))
+			return p;
+
+		throw std::bad_alloc();
+	}
+}
+
+void* operator new(std::size_t size) { return allocate(size); }
+void* operator new[](std::size_t size) { return allocate(size); }
+void* operator new(std::size_t size, std::align_val_t alignment) { return allocate(size, alignment); }
+void* operator new[](std::size_t size, std::align_val_t alignment) { return allocate(size, alignment); }
+
+void* operator new(std::size_t size, std::nothrow_t const&) noexcept
+{
+	allocations.fetch_add(1, std::memory_order_relaxed);
+	return std::malloc(size == 0 ? 1 : size);
+}
+
+void* operator new[](std::size_t size, std::nothrow_t const& tag) noexcept
+{
+	return operator new(size, tag);
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete[](void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void* p, std::size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::nothrow_t const&) noexcept { std::free(p); }
+void operator delete[](void* p, std::nothrow_t const&) noexcept { std::free(p); }
+
+namespace {
+
+	unsigned short const port = 5003;
+
+	// Requests sent before counting, long enough for every buffer to reach its size
+	constexpr int warmup = 1000;
+	constexpr int measured = 10000;
+
+	char const file_name[] = "alloc_test.txt";
+
+	// The handlers' bodies are made once, a std::string built
+	// from a literal in the handler would be counted as well
+	std::string const text_body = "Text sent from a response template";
+	std::string const json_body = "{\"key\": \"value\", \"count\": 42}";
+	std::string const file_path = file_name;
+
+	// Reads one response into buffer and returns its size,
+	// 0 if the connection failed or the status is not 200
+	std::size_t read_response(tcp::socket& socket, char* buffer, std::size_t capacity)
+	{
+		boost::system::error_code ec;
+		std::size_t size = 0;
+
+		// The header, up to the blank line
+		auto header_size = std::string_view::npos;
+		while (header_size == std::string_view::npos)
+		{
+			if (size == capacity)
+				return 0;
+
+			size += socket.read_some(net::buffer(buffer + size, capacity - size), ec);
+			if (ec)
+				return 0;
+
+			header_size = std::string_view(buffer, size).find("\r\n\r\n");
+		}
+
+		std::string_view const header(buffer, header_size + 4);
+		if (header.substr(0, 13) != "HTTP/1.1 200 ")
+			return 0;
+
+		// The body, Content-Length bytes after the header
+		auto const field = header.find("Content-Length: ");
+		if (field == std::string_view::npos)
+			return 0;
+
+		auto const total = header.size() + std::strtoul(buffer + field + 16, nullptr, 10);
+		if (total > capacity)
+			return 0;
+
+		if (size < total)
+			net::read(socket, net::buffer(buffer + size, total - size), ec);
+
+		return ec ? 0 : total;
+	}
+
+	// Sends count requests for target on the connection, false if one fails
+	bool run_requests(tcp::socket& socket, std::string_view request, int count)
+	{
+		char response[4096];
+		for (int i = 0; i < count; ++i)
+		{
+			boost::system::error_code ec;
+			net::write(socket, net::buffer(request.data(), request.size()), ec);
+			if (ec || read_response(socket, response, sizeof(response)) == 0)
+				return false;
+		}
+
+		return true;
+	}
+
+	// A multipart range response followed by a pipelined request,
+	// the second response must start where the first one's length ends
+	bool check_ranges(tcp::socket& socket)
+	{
+		std::string_view const requests =
+			"GET /file HTTP/1.1\r\nHost: localhost\r\nRange: bytes=0-1,5-6\r\n\r\n"
+			"GET /text HTTP/1.1\r\nHost: localhost\r\n\r\n";
+
+		boost::system::error_code ec;
+		net::write(socket, net::buffer(requests.data(), requests.size()), ec);
+		if (ec)
+			return false;
+
+		// Read one at a time so the first read cannot run into the second response
+		char response[4096];
+		std::size_t size = 0;
+		while (size < sizeof(response))
+		{
+			size += socket.read_some(net::buffer(response + size, 1), ec);
+			if (ec)
+				return false;
+
+			if (std::string_view(response, size).find("\r\n\r\n") != std::string_view::npos)
+				break;
+		}
+
+		std::string_view const header(response, size);
+		auto const field = header.find("Content-Length: ");
+		if (header.substr(0, 13) != "HTTP/1.1 206 " || field == std::string_view::npos)
+			return false;
+
+		auto const length = std::strtoul(response + field + 16, nullptr, 10);
+		if (length > sizeof(response))
+			return false;
+
+		net::read(socket, net::buffer(response, length), ec);
+		std::string_view const body(response, ec ? 0 : length);
+		if (body.find("Content-Range: bytes 5-6/") == std::string_view::npos || body.substr(body.size() - 4) != "--\r\n")
+			return false;
+
+		return read_response(socket, response, sizeof(response)) != 0;
+	}
+
+	// Allocations per response of the requests for each target
+	// on one connection, prints each and returns the failures
+	int check_mode(svr::thread_mode mode, char const* mode_name)
+	{
+		svr::Server server("127.0.0.1", port, 1, mode);
+		std::thread runner([&server] { server.start(); });
+
+		// Wait for the listener
+		net::io_context ioc;
+		tcp::socket socket(ioc);
+		boost::system::error_code ec;
+		for (int i = 0; i < 100; ++i)
+		{
+			socket.connect({ net::ip::make_address("127.0.0.1"), port }, ec);
+			if (!ec)
+				break;
+
+			socket.close();
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+
+		int failures = 0;
+		char const* const requests[] = {
+			"GET /text HTTP/1.1\r\nHost: localhost\r\n\r\n",
+			"GET /json HTTP/1.1\r\nHost: localhost\r\n\r\n",
+			"GET /file HTTP/1.1\r\nHost: localhost\r\n\r\n",
+		};
+
+		for (auto const request : requests)
+		{
+			std::string_view const target(request + 4, std::strchr(request + 4, ' ') - (request + 4));
+
+			if (ec || !run_requests(socket, request, warmup))
+			{
+				std::printf("FAIL %s %.*s: no response\n", mode_name, static_cast<int>(target.size()), target.data());
+				++failures;
+				continue;
+			}
+
+			auto const before = allocations.load();
+			auto const answered = run_requests(socket, request, measured);
+			auto const count = allocations.load() - before;
+
+			auto const per_response = static_cast<double>(count) / measured;
+			auto const ok = answered && count == 0;
+			std::printf("%s %s %.*s: %zu allocations in %d responses, %.3f each\n",
+				ok ? "ok  " : "FAIL", mode_name, static_cast<int>(target.size()), target.data(),
+				count, measured, per_response);
+
+			if (!ok)
+				++failures;
+		}
+
+		auto const ranges = !ec && check_ranges(socket);
+		std::printf("%s %s multipart range response\n", ranges ? "ok  " : "FAIL", mode_name);
+		if (!ranges)
+			++failures;
+
+		socket.close();
+		server.stop(std::chrono::seconds(1));
+		runner.join();
+		return failures;
+	}
+}
+
+int alloc_test()
+{
+	// A small file for the cache to serve
+	{
+		std::ofstream file(file_name, std::ios::binary);
+		file << "<!DOCTYPE html><html><body>cached</body></html>\n";
+	}
+
+	svr::add_get("/text", [](svr::request const& req) { svr::send_text(req, text_body); });
+	svr::add_get("/json", [](svr::request const& req) { svr::send_json(req, json_body); });
+	svr::add_get("/file", [](svr::request const& req) { svr::send_file(req, file_path); });
+
+	auto failures = check_mode(svr::thread_mode::per_thread, "per_thread");
+	failures += check_mode(svr::thread_mode::shared, "shared");
+
+	std::remove(file_name);
+	return failures;
+}
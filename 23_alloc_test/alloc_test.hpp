@@ -0,0 +1,5 @@
+#pragma once
+
+// Counts the allocations of keep-alive responses from a local server
+// and prints each case that allocates, returns the number of failures
+int alloc_test();
@@ -0,0 +1,17 @@
+#include <cstdlib>
+#include <exception>
+#include <iostream>
+
+#include "alloc_test.hpp"
+
+int main() {
+
+	try {
+		return alloc_test() == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+	}
+	catch (std::exception const& e)
+	{
+		std::cerr << "Error: " << e.what() << "\n";
+		return EXIT_FAILURE;
+	}
+}
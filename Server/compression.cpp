@@ -0,0 +1,128 @@
+#include <cstdlib>
+#include <limits>
+
+#include <zlib.h>
+
+#include "compression.hpp"
+
+namespace server_async {
+
+	namespace {
+
+		// A zlib stream that lives as long as its thread and is reset between bodies
+		struct deflater {
+			z_stream zs{};
+			bool ready = false;
+
+			~deflater() {
+				if (ready)
+					deflateEnd(&zs);
+			}
+		};
+
+		// "q=0", "q=0.0" and so on
+		bool is_zero(beast::string_view q)
+		{
+			return std::strtod(std::string(q).c_str(), nullptr) <= 0;
+		}
+	}
+
+	beast::string_view coding_name(content_coding coding)
+	{
+		switch (coding)
+		{
+		case content_coding::gzip: return "gzip";
+		case content_coding::deflate: return "deflate";
+		default: return {};
+		}
+	}
+
+	content_coding preferred_coding(beast::string_view field)
+	{
+		if (field.empty())
+			return content_coding::identity;
+
+		// -1 when the coding is not listed
+		int gzip = -1, deflate = -1, any = -1;
+
+		for (auto const& coding : http::ext_list{ field })
+		{
+			auto accepted = 1;
+			for (auto const& param : coding.second)
+				if (beast::iequals(param.first, "q") && is_zero(param.second))
+					accepted = 0;
+
+			if (beast::iequals(coding.first, "gzip") || beast::iequals(coding.first, "x-gzip"))
+				gzip = accepted;
+			else if (beast::iequals(coding.first, "deflate"))
+				deflate = accepted;
+			else if (coding.first == "*")
+				any = accepted;
+		}
+
+		if (gzip < 0)
+			gzip = any;
+
+		if (deflate < 0)
+			deflate = any;
+
+		if (gzip > 0)
+			return content_coding::gzip;
+
+		if (deflate > 0)
+			return content_coding::deflate;
+
+		return content_coding::identity;
+	}
+
+	bool compressible(beast::string_view content_type)
+	{
+		auto const contains = [content_type](beast::string_view s)
+		{
+			return content_type.find(s) != beast::string_view::npos;
+		};
+
+		return content_type.starts_with("text/")
+			|| contains("json")
+			|| contains("javascript")
+			|| contains("xml");
+	}
+
+	bool compress(std::string_view in, content_coding coding, std::string& out)
+	{
+		if (coding == content_coding::identity || in.size() > std::numeric_limits<uInt>::max())
+			return false;
+
+		// one stream per coding, their headers differ
+		thread_local deflater streams[2];
+		auto& d = streams[coding == content_coding::gzip ? 0 : 1];
+
+		if (!d.ready)
+		{
+			// 16 added to the window bits selects the gzip wrapper, "deflate" in HTTP is the zlib one
+			auto const window_bits = coding == content_coding::gzip ? 15 + 16 : 15;
+			if (deflateInit2(&d.zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+				return false;
+
+			d.ready = true;
+		}
+		else if (deflateReset(&d.zs) != Z_OK)
+			return false;
+
+		out.resize(deflateBound(&d.zs, static_cast<uLong>(in.size())));
+
+		d.zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(in.data()));
+		d.zs.avail_in = static_cast<uInt>(in.size());
+		d.zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+		d.zs.avail_out = static_cast<uInt>(out.size());
+
+		if (deflate(&d.zs, Z_FINISH) != Z_STREAM_END)
+		{
+			out.clear();
+			return false;
+		}
+
+		out.resize(d.zs.total_out);
+		return out.size() < in.size();
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+#include "server_util.hpp"
+
+// Response compression with zlib, link with -lz
+namespace server_async {
+
+	enum class content_coding { identity, gzip, deflate };
+
+	// "gzip", "deflate" or empty for identity
+	beast::string_view coding_name(content_coding coding);
+
+	// The coding to answer a request with, gzip before deflate,
+	// honoring "q=0" and "*" in its Accept-Encoding
+	content_coding preferred_coding(beast::string_view accept_encoding);
+
+	template<class Fields>
+	content_coding preferred_coding(http::request_header<Fields> const& req)
+	{
+		return preferred_coding(req[http::field::accept_encoding]);
+	}
+
+	// Types that are worth compressing, text and the like
+	bool compressible(beast::string_view content_type);
+
+	// Compresses in into out with a deflate stream kept by the calling thread,
+	// so only the first call on a thread allocates the zlib state.
+	// returns false if zlib failed or the result is not smaller than in
+	bool compress(std::string_view in, content_coding coding, std::string& out);
+}
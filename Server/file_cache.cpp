@@ -0,0 +1,375 @@
+#include <algorithm>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
+
+#include "file_cache.hpp"
+#include "http_range.hpp"
+
+namespace sutil = server_util;
+
+namespace server_async {
+
+	static std::string make_header(cached_file const& file, bool keep_alive)
+	{
+		std::string header;
+		header.reserve(256);
+		header.append(" 200 OK\r\n");
+		header.append("Server: " ADAM_VERSION_STRING "\r\n");
+		header.append("Content-Type: ").append(file.content_type).append("\r\n");
+		header.append("Content-Length: ").append(std::to_string(file.body.size())).append("\r\n");
+		if (!file.content_encoding.empty())
+			header.append("Content-Encoding: ").append(file.content_encoding).append("\r\n");
+
+		if (file.vary)
+			header.append("Vary: Accept-Encoding\r\n");
+		header.append("Accept-Ranges: bytes\r\n");
+		header.append("ETag: ").append(file.etag).append("\r\n");
+		header.append("Last-Modified: ").append(file.last_modified).append("\r\n");
+		header.append(keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+		return header;
+	}
+
+	std::size_t file_cache::shard_limit(std::size_t max_bytes, std::size_t max_file_bytes)
+	{
+		return std::min(max_file_bytes, max_bytes / num_shards);
+	}
+
+	file_cache::file_cache(std::size_t max_bytes, std::size_t max_file_bytes)
+		: max_bytes_(max_bytes), max_file_bytes_(shard_limit(max_bytes, max_file_bytes))
+	{
+#ifdef __linux__
+		notify_fd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+#endif
+	}
+
+	file_cache::~file_cache()
+	{
+		stop_ = true;
+		if (watcher_.joinable())
+			watcher_.join();
+
+#ifdef __linux__
+		if (notify_fd_ >= 0)
+			::close(notify_fd_);
+#endif
+	}
+
+	file_cache::shard& file_cache::shard_for(std::string const& key)
+	{
+		return shards_[std::hash<std::string>{}(key) % num_shards];
+	}
+
+	std::shared_ptr<cached_file const> file_cache::load(
+		std::string const& path,
+		beast::string_view content_type,
+		content_coding coding,
+		bool precompressed,
+		std::uint64_t& size,
+		std::time_t& mtime) const
+	{
+		if (!sutil::file_status(path, size, mtime) || size > max_file_bytes_)
+			return nullptr;
+
+		beast::error_code ec;
+		beast::file f;
+		f.open(path.c_str(), beast::file_mode::read, ec);
+		if (ec)
+			return nullptr;
+
+		auto file = std::make_shared<cached_file>();
+		file->body.resize(static_cast<std::size_t>(size));
+
+		std::size_t offset = 0;
+		while (offset < file->body.size())
+		{
+			auto const n = f.read(&file->body[offset], file->body.size() - offset, ec);
+			if (ec || n == 0)
+				return nullptr;
+
+			offset += n;
+		}
+
+		// Compressed once here, every hit after that is free
+		if (precompressed)
+			file->content_encoding = std::string(coding_name(coding));
+		else if (coding != content_coding::identity && compressible(content_type))
+		{
+			std::string compressed;
+			if (compress(file->body, coding, compressed))
+			{
+				file->body = std::move(compressed);
+				file->content_encoding = std::string(coding_name(coding));
+			}
+		}
+
+		file->content_type = std::string(content_type);
+		file->vary = compressible(content_type);
+		file->mtime = mtime;
+		file->last_modified = sutil::http_date(mtime);
+		file->etag = make_etag(size, mtime, file->content_encoding);
+
+		file->header_keep_alive = make_header(*file, true);
+		file->header_close = make_header(*file, false);
+
+		return file;
+	}
+
+	std::shared_ptr<cached_file const> file_cache::get(
+		std::string const& key,
+		std::string const& path,
+		beast::string_view content_type,
+		content_coding coding)
+	{
+		if (max_bytes_ == 0)
+			return nullptr;
+
+		auto& s = shard_for(key);
+		std::uint64_t generation = 0;
+
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+
+			auto const it = s.map.find(key);
+			if (it != s.map.end())
+			{
+				auto entry = it->second;
+
+				// Without inotify, check the file on every hit
+				std::uint64_t size = 0;
+				std::time_t mtime = 0;
+				if (notify_fd_ >= 0 || (sutil::file_status(entry->source, size, mtime) && mtime == entry->mtime && size == entry->size))
+				{
+					s.lru.splice(s.lru.begin(), s.lru, entry);
+					++s.hits;
+					return entry->file;
+				}
+
+				++s.invalidations;
+				++s.generation;
+				erase(s, entry);
+			}
+
+			++s.misses;
+			generation = s.generation;
+		}
+
+		// A precompressed sibling is read instead of the file, and watched instead of it
+		entry e{ key, nullptr, 0, path, 0 };
+		std::uint64_t size = 0;
+		std::time_t mtime = 0;
+		auto const precompressed = coding == content_coding::gzip && sutil::file_status(path + ".gz", size, mtime);
+		if (precompressed)
+			e.source = path + ".gz";
+
+		// A file too large is sent without the cache, nothing to watch or read
+		if (!precompressed && !sutil::file_status(path, size, mtime))
+			return nullptr;
+
+		if (size > max_file_bytes_)
+			return nullptr;
+
+		// Watch before reading so that a change during the read is seen
+		if (notify_fd_ >= 0 && !watch(key, e.source))
+			return nullptr;
+
+		// Resolved once per entry, hits reuse file->content_type
+		auto const type = content_type.empty() ? sutil::mime_type(path) : content_type;
+		auto const file = load(e.source, type, coding, precompressed, e.size, e.mtime);
+		if (!file)
+		{
+			unwatch(key);
+			return nullptr;
+		}
+
+		e.file = file;
+		if (!insert(s, std::move(e), generation))
+			unwatch(key);
+
+		return file;
+	}
+
+	bool file_cache::insert(shard& s, entry e, std::uint64_t generation)
+	{
+		auto const max_shard_bytes = max_bytes_ / num_shards;
+		auto const size = e.file->body.size();
+
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		if (s.generation != generation || size > max_shard_bytes)
+			return false;
+
+		// Another thread loaded the same file
+		if (s.map.count(e.key))
+			return true;
+
+		while (s.bytes + size > max_shard_bytes && !s.lru.empty())
+		{
+			++s.evictions;
+			erase(s, std::prev(s.lru.end()));
+		}
+
+		s.lru.push_front(std::move(e));
+		s.map[s.lru.front().key] = s.lru.begin();
+		s.bytes += size;
+		return true;
+	}
+
+	void file_cache::erase(shard& s, std::list<entry>::iterator it)
+	{
+		unwatch(it->key);
+		s.bytes -= it->file->body.size();
+		s.map.erase(it->key);
+		s.lru.erase(it);
+	}
+
+	void file_cache::invalidate(std::string const& key)
+	{
+		auto& s = shard_for(key);
+		std::lock_guard<std::mutex> lock(s.mutex);
+
+		++s.generation;
+
+		auto const it = s.map.find(key);
+		if (it == s.map.end())
+			return;
+
+		++s.invalidations;
+		erase(s, it->second);
+	}
+
+	void file_cache::set_limits(std::size_t max_bytes, std::size_t max_file_bytes)
+	{
+		for (auto& s : shards_)
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			while (!s.lru.empty())
+				erase(s, s.lru.begin());
+		}
+
+		max_bytes_ = max_bytes;
+		max_file_bytes_ = shard_limit(max_bytes, max_file_bytes);
+	}
+
+	file_cache_counters file_cache::counters()
+	{
+		file_cache_counters stats{};
+		for (auto& s : shards_)
+		{
+			std::lock_guard<std::mutex> lock(s.mutex);
+			stats.hits += s.hits;
+			stats.misses += s.misses;
+			stats.evictions += s.evictions;
+			stats.invalidations += s.invalidations;
+			stats.entries += s.map.size();
+			stats.bytes += s.bytes;
+		}
+
+		return stats;
+	}
+
+	//======= INOTIFY ===========================
+
+	bool file_cache::watch(std::string const& key, std::string const& path)
+	{
+#ifdef __linux__
+		auto const wd = ::inotify_add_watch(notify_fd_, path.c_str(),
+			IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+		if (wd < 0)
+			return false;
+
+		std::lock_guard<std::mutex> lock(watch_mutex_);
+
+		// The thread is started with the first watch
+		if (!watcher_.joinable())
+			watcher_ = std::thread([this] { watch_loop(); });
+
+		if (watch_by_key_.emplace(key, wd).second)
+			keys_by_watch_[wd].push_back(key);
+
+		return true;
+#else
+		boost::ignore_unused(key, path);
+		return false;
+#endif
+	}
+
+	void file_cache::unwatch(std::string const& key)
+	{
+#ifdef __linux__
+		if (notify_fd_ < 0)
+			return;
+
+		std::lock_guard<std::mutex> lock(watch_mutex_);
+
+		auto const it = watch_by_key_.find(key);
+		if (it == watch_by_key_.end())
+			return;
+
+		auto const wd = it->second;
+		watch_by_key_.erase(it);
+
+		// Paths with different spellings share the watch of their inode
+		auto& keys = keys_by_watch_[wd];
+		keys.erase(std::remove(keys.begin(), keys.end(), key), keys.end());
+		if (keys.empty())
+		{
+			keys_by_watch_.erase(wd);
+			::inotify_rm_watch(notify_fd_, wd);
+		}
+#else
+		boost::ignore_unused(key);
+#endif
+	}
+
+	void file_cache::watch_loop()
+	{
+#ifdef __linux__
+		alignas(inotify_event) char buffer[4096];
+
+		while (!stop_)
+		{
+			pollfd pfd{ notify_fd_, POLLIN, 0 };
+			if (::poll(&pfd, 1, 100) <= 0)
+				continue;
+
+			auto const n = ::read(notify_fd_, buffer, sizeof(buffer));
+			if (n <= 0)
+				continue;
+
+			std::vector<std::string> changed;
+
+			{
+				std::lock_guard<std::mutex> lock(watch_mutex_);
+
+				for (auto p = buffer; p < buffer + n; )
+				{
+					auto const event = reinterpret_cast<inotify_event const*>(p);
+					p += sizeof(inotify_event) + event->len;
+
+					auto const it = keys_by_watch_.find(event->wd);
+					if (it == keys_by_watch_.end())
+						continue;
+
+					changed.insert(changed.end(), it->second.begin(), it->second.end());
+
+					// The kernel removed the watch
+					if (event->mask & IN_IGNORED)
+					{
+						for (auto const& key : it->second)
+							watch_by_key_.erase(key);
+
+						keys_by_watch_.erase(it);
+					}
+				}
+			}
+
+			for (auto const& key : changed)
+				invalidate(key);
+		}
+#endif
+	}
+}
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "server.hpp"
+#include "server_util.hpp"
+#include "compression.hpp"
+
+namespace server_async {
+
+	// A file held in memory with its response header already serialized
+	struct cached_file {
+		std::string body;
+		std::string etag;
+		std::time_t mtime;
+		std::string last_modified;
+		std::string content_type;
+		std::string content_encoding; // empty unless the body is compressed
+		bool vary = false;            // the type is compressed for clients that accept it
+
+		// " 200 OK" header blocks for each connection semantic, without the
+		// HTTP version before them and the Date and blank line after them
+		std::string header_keep_alive;
+		std::string header_close;
+	};
+
+	// Size bounded LRU cache of static files, split into shards to limit lock contention.
+	// Entries are dropped when the file changes on disk (inotify on Linux,
+	// a modification time check on each hit elsewhere).
+	class file_cache {
+	private:
+
+		static constexpr std::size_t num_shards = 16;
+
+		struct entry {
+			std::string key;
+			std::shared_ptr<cached_file const> file;
+			std::time_t mtime;
+
+			// the file read, checked on hits when there is no inotify
+			std::string source;
+			std::uint64_t size;
+		};
+
+		struct shard {
+			std::mutex mutex;
+			std::list<entry> lru; // most recently used first
+			std::unordered_map<std::string, std::list<entry>::iterator> map;
+			std::size_t bytes = 0;
+
+			// changes whenever an entry is invalidated, so a load that
+			// raced with a change on disk is not inserted
+			std::uint64_t generation = 0;
+
+			std::uint64_t hits = 0;
+			std::uint64_t misses = 0;
+			std::uint64_t evictions = 0;
+			std::uint64_t invalidations = 0;
+		};
+
+		std::array<shard, num_shards> shards_;
+		std::size_t max_bytes_;
+		std::size_t max_file_bytes_;
+
+		// A file larger than a shard could never be inserted, so it
+		// is refused before it is watched and read instead of after
+		static std::size_t shard_limit(std::size_t max_bytes, std::size_t max_file_bytes);
+
+		// inotify state
+		int notify_fd_ = -1;
+		std::mutex watch_mutex_;
+		std::unordered_map<int, std::vector<std::string>> keys_by_watch_;
+		std::unordered_map<std::string, int> watch_by_key_;
+		std::atomic<bool> stop_{ false };
+		std::thread watcher_;
+
+		shard& shard_for(std::string const& key);
+
+		std::shared_ptr<cached_file const> load(
+			std::string const& path,
+			beast::string_view content_type,
+			content_coding coding,
+			bool precompressed,
+			std::uint64_t& size,
+			std::time_t& mtime) const;
+
+		// returns false if the file was not kept
+		bool insert(shard& s, entry e, std::uint64_t generation);
+		void erase(shard& s, std::list<entry>::iterator it);
+
+		bool watch(std::string const& key, std::string const& path);
+		void unwatch(std::string const& key);
+		void watch_loop();
+
+	public:
+		// max_bytes: total size of cached file contents
+		// max_file_bytes: larger files are never cached
+		file_cache(std::size_t max_bytes, std::size_t max_file_bytes);
+		~file_cache();
+
+		file_cache(file_cache const&) = delete;
+		file_cache& operator=(file_cache const&) = delete;
+
+		// key identifies the entry, path is the file on disk.
+		// With a coding the entry holds the file compressed: with gzip, path + ".gz"
+		// is used when it exists, otherwise the file is compressed once on load
+		// and kept as is if that does not make it smaller.
+		// An empty content_type is looked up from path when the file is loaded.
+		// returns nullptr if the file cannot be cached
+		std::shared_ptr<cached_file const> get(
+			std::string const& key,
+			std::string const& path,
+			beast::string_view content_type,
+			content_coding coding = content_coding::identity);
+
+		void invalidate(std::string const& key);
+
+		// not thread safe, call before the server starts
+		void set_limits(std::size_t max_bytes, std::size_t max_file_bytes);
+
+		file_cache_counters counters();
+	};
+}
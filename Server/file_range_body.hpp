@@ -0,0 +1,136 @@
+#pragma once
+
+#include <boost/optional.hpp>
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "http_range.hpp"
+
+namespace server_async {
+
+	// A body made of slices of a file: a single range, or the parts
+	// of a multipart/byteranges body followed by its closing delimiter.
+	// Only the slices are read, starting at their offsets.
+	struct file_range_body {
+
+		struct value_type {
+			beast::file file;
+			std::vector<range_part> parts;
+			std::string closing; // empty for a single range
+		};
+
+		static std::uint64_t size(value_type const& body)
+		{
+			auto total = static_cast<std::uint64_t>(body.closing.size());
+			for (auto const& part : body.parts)
+				total += part.header.size() + part.size;
+
+			return total;
+		}
+
+		class writer {
+		private:
+			value_type& body_;
+			std::size_t part_ = 0;
+			bool header_sent_ = false;
+			bool closing_sent_ = false;
+			std::uint64_t offset_ = 0; // into the current part
+			char buffer_[16 * 1024];
+
+		public:
+			using const_buffers_type = net::const_buffer;
+
+			template<bool isRequest, class Fields>
+			writer(http::header<isRequest, Fields>&, value_type& body)
+				: body_(body)
+			{
+			}
+
+			void init(beast::error_code& ec)
+			{
+				ec = {};
+			}
+
+			boost::optional<std::pair<const_buffers_type, bool>> get(beast::error_code& ec)
+			{
+				ec = {};
+
+				for (; part_ < body_.parts.size(); ++part_, header_sent_ = false, offset_ = 0)
+				{
+					auto const& part = body_.parts[part_];
+
+					if (!header_sent_)
+					{
+						header_sent_ = true;
+						if (!part.header.empty())
+							return { { net::buffer(part.header), true } };
+					}
+
+					if (offset_ == part.size)
+						continue;
+
+					// The slices are read in order, so only the start of each is a seek
+					if (offset_ == 0)
+					{
+						body_.file.seek(part.first, ec);
+						if (ec)
+							return boost::none;
+					}
+
+					auto const count = static_cast<std::size_t>(std::min<std::uint64_t>(part.size - offset_, sizeof(buffer_)));
+					auto const n = body_.file.read(buffer_, count, ec);
+					if (ec)
+						return boost::none;
+
+					// The file was truncated
+					if (n == 0)
+					{
+						ec = http::error::short_read;
+						return boost::none;
+					}
+
+					offset_ += n;
+					return { { net::const_buffer(buffer_, n), true } };
+				}
+
+				if (!closing_sent_ && !body_.closing.empty())
+				{
+					closing_sent_ = true;
+					return { { net::buffer(body_.closing), false } };
+				}
+
+				return boost::none;
+			}
+		};
+	};
+
+	// Lays the ranges of a file of size bytes out in the body of res, whose
+	// file is open, and sets the Content-Type, Content-Range and Content-Length
+	template<class Fields>
+	void set_ranges(
+		http::response<file_range_body, Fields>& res,
+		std::vector<byte_range> const& ranges,
+		std::uint64_t size,
+		beast::string_view content_type)
+	{
+		auto& body = res.body();
+		body.parts.clear();
+		body.closing.clear();
+
+		if (ranges.size() == 1)
+		{
+			body.parts.push_back({ {}, ranges.front().first, ranges.front().size() });
+			res.set(http::field::content_type, content_type);
+			res.set(http::field::content_range, content_range(ranges.front(), size));
+		}
+		else
+		{
+			multipart_parts(ranges, size, content_type, body.parts, body.closing);
+			res.set(http::field::content_type, "multipart/byteranges; boundary=" + multipart_boundary());
+		}
+
+		res.content_length(file_range_body::size(body));
+	}
+}
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Memory of the pending reads and writes of a connection, reused by every
+// operation so a steady connection does not allocate them. As in Asio's
+// allocation example, the completion handlers carry it as their allocator.
+// Header only so the example servers can use it as well.
+namespace server_async {
+
+	// A few blocks for the operations in flight at once, an operation
+	// that is too large or finds them all taken uses the global heap.
+	// A block may be given back on another thread than the one that
+	// took it, when an operation completes outside the connection's strand.
+	class handler_memory {
+	private:
+		static constexpr std::size_t block_size = 2048;
+		static constexpr std::size_t num_blocks = 4;
+
+		struct alignas(std::max_align_t) block {
+			unsigned char data[block_size];
+		};
+
+		std::array<block, num_blocks> blocks_;
+		std::array<std::atomic<bool>, num_blocks> taken_{};
+
+	public:
+		handler_memory() = default;
+
+		handler_memory(handler_memory const&) = delete;
+		handler_memory& operator=(handler_memory const&) = delete;
+
+		void* allocate(std::size_t size) {
+			if (size <= block_size)
+			{
+				for (std::size_t i = 0; i < num_blocks; ++i)
+				{
+					if (!taken_[i].exchange(true, std::memory_order_acquire))
+						return blocks_[i].data;
+				}
+			}
+
+			return ::operator new(size);
+		}
+
+		void deallocate(void* p) {
+			for (std::size_t i = 0; i < num_blocks; ++i)
+			{
+				if (p == blocks_[i].data)
+					return taken_[i].store(false, std::memory_order_release);
+			}
+
+			::operator delete(p);
+		}
+	};
+
+	// The allocator of the handlers bound to a handler_memory
+	template<class T>
+	class handler_allocator {
+	private:
+		template<class>
+		friend class handler_allocator;
+
+		handler_memory* memory_;
+
+	public:
+		using value_type = T;
+
+		explicit handler_allocator(handler_memory& memory) noexcept
+			: memory_(&memory) {}
+
+		template<class U>
+		handler_allocator(handler_allocator<U> const& other) noexcept
+			: memory_(other.memory_) {}
+
+		T* allocate(std::size_t n) {
+			return static_cast<T*>(memory_->allocate(sizeof(T) * n));
+		}
+
+		void deallocate(T* p, std::size_t) noexcept {
+			memory_->deallocate(p);
+		}
+
+		template<class U>
+		bool operator==(handler_allocator<U> const& other) const noexcept {
+			return memory_ == other.memory_;
+		}
+
+		template<class U>
+		bool operator!=(handler_allocator<U> const& other) const noexcept {
+			return memory_ != other.memory_;
+		}
+	};
+
+	// A completion handler whose operation is allocated from memory,
+	// which must outlive it
+	template<class Handler>
+	class memory_handler {
+	private:
+		handler_memory& memory_;
+		Handler handler_;
+
+	public:
+		using allocator_type = handler_allocator<Handler>;
+
+		memory_handler(handler_memory& memory, Handler handler)
+			: memory_(memory), handler_(std::move(handler)) {}
+
+		allocator_type get_allocator() const noexcept {
+			return allocator_type(memory_);
+		}
+
+		template<class... Args>
+		void operator()(Args&&... args) {
+			handler_(std::forward<Args>(args)...);
+		}
+	};
+
+	template<class Handler>
+	memory_handler<std::decay_t<Handler>> bind_memory(handler_memory& memory, Handler&& handler) {
+		return memory_handler<std::decay_t<Handler>>(memory, std::forward<Handler>(handler));
+	}
+}
@@ -0,0 +1,356 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+#include <sys/stat.h>
+
+#include "server_util.hpp"
+
+// Conditional requests and byte ranges, RFC 7232 and RFC 7233.
+// Header only so the example servers can use it as well.
+namespace server_async {
+
+	// Inclusive, like the Range header
+	struct byte_range {
+		std::uint64_t first;
+		std::uint64_t last;
+
+		std::uint64_t size() const { return last - first + 1; }
+	};
+
+	enum class range_status {
+		full,         // no Range, or one that is ignored: 200 with the whole file
+		partial,      // 206 with the ranges
+		unsatisfiable // 416 with "Content-Range: bytes */size"
+	};
+
+	// A Range with more ranges than this gets the whole file
+	static constexpr std::size_t max_ranges = 16;
+
+	// A part of a multipart/byteranges body, its header followed by a slice of the file.
+	// A single range is one part with an empty header.
+	struct range_part {
+		std::string header;
+		std::uint64_t first;
+		std::uint64_t size;
+	};
+
+	namespace range_detail {
+
+		inline beast::string_view trim(beast::string_view s)
+		{
+			while (!s.empty() && (s.front() == ' ' || s.front() == '\t'))
+				s.remove_prefix(1);
+
+			while (!s.empty() && (s.back() == ' ' || s.back() == '\t'))
+				s.remove_suffix(1);
+
+			return s;
+		}
+
+		// Consumes the leading digits of s
+		inline bool parse_number(beast::string_view& s, std::uint64_t& n)
+		{
+			std::size_t i = 0;
+			n = 0;
+			for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i)
+			{
+				auto const digit = static_cast<std::uint64_t>(s[i] - '0');
+				if (n > (std::numeric_limits<std::uint64_t>::max() - digit) / 10)
+					return false;
+
+				n = n * 10 + digit;
+			}
+
+			s.remove_prefix(i);
+			return i > 0;
+		}
+
+		inline bool parse_digits(beast::string_view s, int& n)
+		{
+			n = 0;
+			for (auto const c : s)
+			{
+				if (c < '0' || c > '9')
+					return false;
+
+				n = n * 10 + (c - '0');
+			}
+
+			return true;
+		}
+
+		// Days since 1970-01-01 of a date in the proleptic Gregorian calendar
+		inline std::int64_t days_from_civil(std::int64_t y, unsigned m, unsigned d)
+		{
+			y -= m <= 2;
+			auto const era = (y >= 0 ? y : y - 399) / 400;
+			auto const yoe = static_cast<unsigned>(y - era * 400);
+			auto const doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+			auto const doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+			return era * 146097 + static_cast<std::int64_t>(doe) - 719468;
+		}
+
+		// Weak comparison, "W/" is ignored on both sides
+		inline bool same_etag(beast::string_view a, beast::string_view b)
+		{
+			if (a.starts_with("W/"))
+				a.remove_prefix(2);
+
+			if (b.starts_with("W/"))
+				b.remove_prefix(2);
+
+			return a == b;
+		}
+	}
+
+	// Validator from size and modification time, like most servers.
+	// Each content encoding is a representation of its own.
+	inline std::string make_etag(std::uint64_t size, std::time_t mtime, beast::string_view content_encoding = {})
+	{
+		char text[64];
+		auto const n = std::snprintf(text, sizeof(text), "\"%llx-%llx%s%.*s\"",
+			static_cast<unsigned long long>(size),
+			static_cast<unsigned long long>(mtime),
+			content_encoding.empty() ? "" : "-",
+			static_cast<int>(content_encoding.size()), content_encoding.empty() ? "" : content_encoding.data());
+
+		return std::string(text, std::min<std::size_t>(static_cast<std::size_t>(n), sizeof(text) - 1));
+	}
+
+	// The validators of a file, for servers without the file cache
+	struct file_validators {
+		std::time_t mtime = 0;
+		std::string etag;
+		std::string last_modified;
+	};
+
+	inline file_validators validators_of(std::string const& path, std::uint64_t size)
+	{
+		file_validators v;
+
+		struct stat st;
+		if (::stat(path.c_str(), &st) == 0)
+			v.mtime = st.st_mtime;
+
+		std::tm tm{};
+#ifdef BOOST_MSVC
+		gmtime_s(&tm, &v.mtime);
+#else
+		gmtime_r(&v.mtime, &tm);
+#endif
+		char date[32];
+		auto const n = std::strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+		v.etag = make_etag(size, v.mtime);
+		v.last_modified.assign(date, n);
+		return v;
+	}
+
+	// "Sun, 06 Nov 1994 08:49:37 GMT", -1 for anything else.
+	// The obsolete formats are not worth the code: a condition that
+	// cannot be read is ignored and the client gets the whole file.
+	inline std::time_t parse_http_date(beast::string_view s)
+	{
+		using range_detail::parse_digits;
+
+		if (s.size() != 29 || s[3] != ',' || s[4] != ' ' || s.substr(25) != " GMT")
+			return -1;
+
+		static constexpr char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+		auto const month = beast::string_view(months).find(s.substr(8, 3));
+		if (month == beast::string_view::npos || month % 3 != 0)
+			return -1;
+
+		int day, year, hour, minute, second;
+		if (!parse_digits(s.substr(5, 2), day) || !parse_digits(s.substr(12, 4), year) ||
+			!parse_digits(s.substr(17, 2), hour) || !parse_digits(s.substr(20, 2), minute) ||
+			!parse_digits(s.substr(23, 2), second) ||
+			s[7] != ' ' || s[11] != ' ' || s[16] != ' ' || s[19] != ':' || s[22] != ':')
+			return -1;
+
+		auto const days = range_detail::days_from_civil(year, static_cast<unsigned>(month / 3 + 1), static_cast<unsigned>(day));
+		return static_cast<std::time_t>(days * 86400 + hour * 3600 + minute * 60 + second);
+	}
+
+	// True when a GET or HEAD can be answered with 304 Not Modified.
+	// If-None-Match wins over If-Modified-Since when both are sent.
+	template<class Fields>
+	bool not_modified(http::request_header<Fields> const& req, beast::string_view etag, std::time_t mtime)
+	{
+		auto list = req[http::field::if_none_match];
+		if (!list.empty())
+		{
+			while (!list.empty())
+			{
+				auto const comma = list.find(',');
+				auto const tag = range_detail::trim(list.substr(0, comma));
+				if (tag == "*" || range_detail::same_etag(tag, etag))
+					return true;
+
+				list = comma == beast::string_view::npos ? beast::string_view{} : list.substr(comma + 1);
+			}
+
+			return false;
+		}
+
+		auto const since = parse_http_date(req[http::field::if_modified_since]);
+		return since >= 0 && mtime <= since;
+	}
+
+	// False when If-Range names another version of the file, the Range is ignored then
+	template<class Fields>
+	bool if_range_matches(http::request_header<Fields> const& req, beast::string_view etag, std::time_t mtime)
+	{
+		auto const value = range_detail::trim(req[http::field::if_range]);
+		if (value.empty())
+			return true;
+
+		// Strong comparison, a weak tag never matches
+		if (value.front() == '"')
+			return value == etag;
+
+		if (value.starts_with("W/"))
+			return false;
+
+		return parse_http_date(value) == mtime;
+	}
+
+	// Parses "bytes=0-99, 200-, -50" against a file of size bytes.
+	// The ranges are sorted and overlapping or adjacent ones are merged.
+	inline range_status parse_range(beast::string_view field, std::uint64_t size, std::vector<byte_range>& ranges)
+	{
+		using range_detail::parse_number;
+
+		ranges.clear();
+		if (field.size() < 6 || !beast::iequals(field.substr(0, 6), "bytes="))
+			return range_status::full;
+
+		field.remove_prefix(6);
+
+		std::size_t specs = 0;
+		while (!field.empty())
+		{
+			auto const comma = field.find(',');
+			auto spec = range_detail::trim(field.substr(0, comma));
+			field = comma == beast::string_view::npos ? beast::string_view{} : field.substr(comma + 1);
+
+			if (spec.empty())
+				continue;
+
+			if (++specs > max_ranges)
+				return range_status::full;
+
+			// "-n" is the last n bytes
+			if (spec.front() == '-')
+			{
+				spec.remove_prefix(1);
+
+				std::uint64_t n = 0;
+				if (!parse_number(spec, n) || !spec.empty())
+					return range_status::full;
+
+				if (n > 0 && size > 0)
+					ranges.push_back({ size - std::min(n, size), size - 1 });
+
+				continue;
+			}
+
+			std::uint64_t first = 0;
+			if (!parse_number(spec, first) || spec.empty() || spec.front() != '-')
+				return range_status::full;
+
+			spec.remove_prefix(1);
+
+			// "n-" is everything from n
+			auto last = std::numeric_limits<std::uint64_t>::max();
+			if (!spec.empty() && (!parse_number(spec, last) || !spec.empty() || last < first))
+				return range_status::full;
+
+			if (first < size)
+				ranges.push_back({ first, std::min(last, size - 1) });
+		}
+
+		if (specs == 0)
+			return range_status::full;
+
+		if (ranges.empty())
+			return range_status::unsatisfiable;
+
+		std::sort(ranges.begin(), ranges.end(),
+			[](byte_range const& a, byte_range const& b) { return a.first < b.first; });
+
+		std::size_t n = 0;
+		for (std::size_t i = 1; i < ranges.size(); ++i)
+		{
+			if (ranges[i].first <= ranges[n].last + 1)
+				ranges[n].last = std::max(ranges[n].last, ranges[i].last);
+			else
+				ranges[++n] = ranges[i];
+		}
+
+		ranges.resize(n + 1);
+		return range_status::partial;
+	}
+
+	// "bytes 0-99/1000"
+	inline std::string content_range(byte_range r, std::uint64_t size)
+	{
+		char text[80];
+		auto const n = std::snprintf(text, sizeof(text), "bytes %llu-%llu/%llu",
+			static_cast<unsigned long long>(r.first),
+			static_cast<unsigned long long>(r.last),
+			static_cast<unsigned long long>(size));
+
+		return std::string(text, n);
+	}
+
+	// Chosen once per process so a file is unlikely to contain it
+	inline std::string const& multipart_boundary()
+	{
+		static std::string const boundary = []
+		{
+			std::random_device random;
+			char text[40];
+			auto const n = std::snprintf(text, sizeof(text), "adam_byteranges_%08x%08x", random(), random());
+			return std::string(text, n);
+		}();
+
+		return boundary;
+	}
+
+	// Lays out a multipart/byteranges body of the ranges.
+	// returns the size of the body, parts and closing delimiter included
+	inline std::uint64_t multipart_parts(
+		std::vector<byte_range> const& ranges,
+		std::uint64_t size,
+		beast::string_view content_type,
+		std::vector<range_part>& parts,
+		std::string& closing)
+	{
+		auto const& boundary = multipart_boundary();
+
+		std::uint64_t total = 0;
+		parts.clear();
+		parts.reserve(ranges.size());
+		for (auto const r : ranges)
+		{
+			range_part part{ {}, r.first, r.size() };
+			part.header.append("\r\n--").append(boundary).append("\r\n");
+			part.header.append("Content-Type: ").append(content_type.data(), content_type.size()).append("\r\n");
+			part.header.append("Content-Range: ").append(content_range(r, size)).append("\r\n\r\n");
+
+			total += part.header.size() + part.size;
+			parts.push_back(std::move(part));
+		}
+
+		closing.assign("\r\n--").append(boundary).append("--\r\n");
+		return total + closing.size();
+	}
+}
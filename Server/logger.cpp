@@ -0,0 +1,385 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "logger.hpp"
+
+namespace server_log {
+
+	namespace {
+
+		using clock = std::chrono::system_clock;
+
+		// How often the background thread writes
+		constexpr auto flush_interval = std::chrono::milliseconds(10);
+
+		struct record {
+			clock::time_point time;
+			level lvl;
+			bool access;
+
+			// access records only
+			unsigned status;
+			std::uint64_t bytes;
+			std::uint64_t latency_us;
+
+			// "what" and "message", or method and target
+			std::uint16_t first_size;
+			std::uint16_t second_size;
+			char text[200];
+		};
+
+		// Single producer, the owning thread, and single consumer, the writer.
+		// head and tail are on separate cache lines so the two do not contend.
+		struct ring {
+			static constexpr std::size_t capacity = 512;
+
+			std::array<record, capacity> records;
+
+			alignas(64) std::atomic<std::size_t> head{ 0 };
+			alignas(64) std::atomic<std::size_t> tail{ 0 };
+
+			// written by the producer only
+			std::atomic<std::uint64_t> dropped{ 0 };
+
+			// false once the thread that wrote to it exited
+			std::atomic<bool> owned{ true };
+
+			ring* next = nullptr;
+
+			// returns nullptr if the ring is full
+			record* reserve() {
+				auto const h = head.load(std::memory_order_relaxed);
+				if (h - tail.load(std::memory_order_acquire) == capacity)
+				{
+					dropped.store(dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+					return nullptr;
+				}
+
+				return &records[h % capacity];
+			}
+
+			void commit() {
+				head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			}
+		};
+
+		// Rings are never freed, a thread that exits leaves its records to be
+		// written and its ring to the next thread, once they are written
+		std::atomic<ring*> all_rings{ nullptr };
+
+		std::atomic<level> min_level{ level::info };
+		std::atomic<bool> access_on{ false };
+		std::atomic<bool> running{ false };
+
+		std::mutex writer_mutex;
+		std::condition_variable writer_wake;
+		bool writer_stop = false;
+		std::thread writer;
+		std::FILE* out = nullptr;
+
+		// A ring for a new thread, a free one whose records were all written if any
+		ring* acquire()
+		{
+			for (auto r = all_rings.load(std::memory_order_acquire); r; r = r->next)
+			{
+				auto owned = false;
+				if (r->owned.load(std::memory_order_relaxed) || !r->owned.compare_exchange_strong(owned, true, std::memory_order_acquire))
+					continue;
+
+				// The writer may still be reading it
+				if (r->tail.load(std::memory_order_acquire) == r->head.load(std::memory_order_relaxed))
+					return r;
+
+				r->owned.store(false, std::memory_order_release);
+			}
+
+			auto const p = new ring();
+			p->next = all_rings.load(std::memory_order_relaxed);
+			while (!all_rings.compare_exchange_weak(p->next, p, std::memory_order_release, std::memory_order_relaxed)) {}
+			return p;
+		}
+
+		// Gives the thread's ring back when the thread exits, threads
+		// started per connection would otherwise leave one each
+		struct ring_owner {
+			ring* const r = acquire();
+
+			~ring_owner() { r->owned.store(false, std::memory_order_release); }
+		};
+
+		ring& local()
+		{
+			thread_local ring_owner const owner;
+			return *owner.r;
+		}
+
+		void copy_text(record& r, std::string_view first, std::string_view second)
+		{
+			auto const n1 = std::min(first.size(), sizeof(r.text));
+			auto const n2 = std::min(second.size(), sizeof(r.text) - n1);
+			std::memcpy(r.text, first.data(), n1);
+			std::memcpy(r.text + n1, second.data(), n2);
+			r.first_size = static_cast<std::uint16_t>(n1);
+			r.second_size = static_cast<std::uint16_t>(n2);
+		}
+
+		char const* level_name(level lvl)
+		{
+			switch (lvl)
+			{
+			case level::debug: return "debug";
+			case level::info: return "info";
+			case level::warning: return "warning";
+			case level::error: return "error";
+			default: return "";
+			}
+		}
+
+		// 2020-01-31T12:00:00.123Z, the seconds are formatted once per second
+		void append_time(std::string& out, clock::time_point time)
+		{
+			static std::time_t last = 0;
+			static char date[32];
+			static std::size_t size = 0;
+
+			auto const t = clock::to_time_t(time);
+			if (t != last || size == 0)
+			{
+				std::tm tm{};
+#ifdef _MSC_VER
+				gmtime_s(&tm, &t);
+#else
+				gmtime_r(&t, &tm);
+#endif
+				size = std::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &tm);
+				last = t;
+			}
+
+			auto const ms = std::chrono::duration_cast<std::chrono::milliseconds>(time.time_since_epoch()).count() % 1000;
+
+			char text[8];
+			std::snprintf(text, sizeof(text), ".%03dZ", static_cast<int>(ms));
+			out.append(date, size).append(text);
+		}
+
+		void format(std::string& out, record const& r)
+		{
+			std::string_view const first{ r.text, r.first_size };
+			std::string_view const second{ r.text + r.first_size, r.second_size };
+
+			append_time(out, r.time);
+
+			if (!r.access)
+			{
+				out.append(" ").append(level_name(r.lvl)).append(" ").append(first);
+				if (!second.empty())
+					out.append(": ").append(second);
+
+				out.append("\n");
+				return;
+			}
+
+			out.append(" access method=").append(first).append(" target=\"");
+			for (auto const c : second)
+			{
+				if (c == '"' || c == '\\')
+					out.push_back('\\');
+
+				out.push_back(c);
+			}
+
+			out.append("\" status=").append(std::to_string(r.status));
+			out.append(" bytes=").append(std::to_string(r.bytes));
+			out.append(" latency_us=").append(std::to_string(r.latency_us)).append("\n");
+		}
+
+		// Formats every committed record and writes them with one call
+		void drain(std::string& batch, std::uint64_t& reported_drops)
+		{
+			batch.clear();
+
+			std::uint64_t drops = 0;
+			for (auto r = all_rings.load(std::memory_order_acquire); r; r = r->next)
+			{
+				auto t = r->tail.load(std::memory_order_relaxed);
+				auto const h = r->head.load(std::memory_order_acquire);
+				for (; t != h; ++t)
+					format(batch, r->records[t % ring::capacity]);
+
+				r->tail.store(t, std::memory_order_release);
+				drops += r->dropped.load(std::memory_order_relaxed);
+			}
+
+			if (drops != reported_drops)
+			{
+				append_time(batch, clock::now());
+				batch.append(" warning logger: ").append(std::to_string(drops - reported_drops)).append(" records dropped\n");
+				reported_drops = drops;
+			}
+
+			if (batch.empty())
+				return;
+
+			std::fwrite(batch.data(), 1, batch.size(), out);
+			std::fflush(out);
+		}
+
+		void write_loop()
+		{
+			std::string batch;
+			batch.reserve(64 * 1024);
+			std::uint64_t reported_drops = 0;
+
+			std::unique_lock<std::mutex> lock(writer_mutex);
+			while (!writer_stop)
+			{
+				writer_wake.wait_for(lock, flush_interval);
+
+				lock.unlock();
+				drain(batch, reported_drops);
+				lock.lock();
+			}
+
+			drain(batch, reported_drops);
+		}
+
+		// Stops the writer when the program exits without calling stop()
+		struct stop_at_exit {
+			~stop_at_exit() { stop(); }
+		} const stopper;
+	}
+
+	bool start(char const* path)
+	{
+		std::lock_guard<std::mutex> lock(writer_mutex);
+		if (writer.joinable())
+			return true;
+
+		out = stderr;
+		if (path)
+		{
+			out = std::fopen(path, "a");
+			if (!out)
+			{
+				out = stderr;
+				return false;
+			}
+		}
+
+		writer_stop = false;
+		writer = std::thread(write_loop);
+		running = true;
+		return true;
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(writer_mutex);
+			if (!writer.joinable())
+				return;
+
+			running = false;
+			writer_stop = true;
+		}
+
+		writer_wake.notify_one();
+		writer.join();
+
+		if (out != stderr)
+			std::fclose(out);
+
+		out = nullptr;
+	}
+
+	void set_level(level min)
+	{
+		min_level = min;
+	}
+
+	bool enabled(level lvl)
+	{
+		return lvl >= min_level.load(std::memory_order_relaxed) && lvl != level::off;
+	}
+
+	void set_access_log(bool on)
+	{
+		access_on = on;
+	}
+
+	bool access_enabled()
+	{
+		return access_on.load(std::memory_order_relaxed);
+	}
+
+	void write(level lvl, std::string_view what, std::string_view message)
+	{
+		if (!enabled(lvl))
+			return;
+
+		if (!running.load(std::memory_order_acquire))
+		{
+			std::string line(what);
+			if (!message.empty())
+				line.append(": ").append(message);
+
+			std::cerr << (line + "\n");
+			return;
+		}
+
+		auto& ring = local();
+		auto const r = ring.reserve();
+		if (!r)
+			return;
+
+		r->time = clock::now();
+		r->lvl = lvl;
+		r->access = false;
+		copy_text(*r, what, message);
+		ring.commit();
+	}
+
+	void access(
+		std::string_view method,
+		std::string_view target,
+		unsigned status,
+		std::uint64_t bytes,
+		std::uint64_t latency_us)
+	{
+		if (!access_enabled() || !running.load(std::memory_order_acquire))
+			return;
+
+		auto& ring = local();
+		auto const r = ring.reserve();
+		if (!r)
+			return;
+
+		r->time = clock::now();
+		r->lvl = level::info;
+		r->access = true;
+		r->status = status;
+		r->bytes = bytes;
+		r->latency_us = latency_us;
+		copy_text(*r, method, target);
+		ring.commit();
+	}
+
+	std::uint64_t dropped()
+	{
+		std::uint64_t total = 0;
+		for (auto r = all_rings.load(std::memory_order_acquire); r; r = r->next)
+			total += r->dropped.load(std::memory_order_relaxed);
+
+		return total;
+	}
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+// Logging that does not block the calling thread.
+// Each thread appends fixed size records to its own ring buffer,
+// a background thread formats them and writes them in batches.
+// When a ring is full the record is dropped and counted instead.
+// Records of one thread keep their order, records of different threads may not.
+//
+// Until start() is called records are written to stderr
+// synchronously, the way server_util::fail always did.
+namespace server_log {
+
+	enum class level { debug, info, warning, error, off };
+
+	// path: file to append to, stderr if nullptr
+	// returns false if the file could not be opened
+	bool start(char const* path = nullptr);
+
+	// Writes what is left and stops the background thread.
+	// Call after the threads that log have stopped.
+	void stop();
+
+	// Records below min are discarded before they are formatted
+	void set_level(level min);
+
+	bool enabled(level lvl);
+
+	// one access record per response, off by default
+	void set_access_log(bool on);
+
+	bool access_enabled();
+
+	// "what: message", either part is truncated to fit a record
+	void write(level lvl, std::string_view what, std::string_view message = {});
+
+	// method=GET target="/json" status=200 bytes=52 latency_us=31
+	void access(
+		std::string_view method,
+		std::string_view target,
+		unsigned status,
+		std::uint64_t bytes,
+		std::uint64_t latency_us);
+
+	// Records lost because a ring was full
+	std::uint64_t dropped();
+}
@@ -0,0 +1,327 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "metrics.hpp"
+
+namespace server_async {
+
+	namespace metrics {
+
+		namespace {
+
+			// One per thread, on its own cache lines so threads never share one
+			struct alignas(64) thread_metrics {
+				counter requests;
+				counter bytes_in;
+				counter bytes_out;
+				counter connections_opened;
+				counter connections_closed;
+
+				std::array<counter, 5> status; // 1xx to 5xx
+
+				// the last one counts names that did not fit in error_names
+				std::array<counter, max_errors + 1> errors;
+
+				std::array<histogram, max_routes> latency;
+
+				thread_metrics* next = nullptr;
+			};
+
+			struct route_name {
+				std::string method;
+				std::string target;
+			};
+
+			// Slots are never freed, so counts of threads that exited are kept
+			std::atomic<thread_metrics*> all_threads{ nullptr };
+
+			struct route_table {
+				std::array<route_name, max_routes> names;
+				std::size_t size = 1;
+			};
+
+			// Routes are added while other globals are initialized
+			route_table& routes()
+			{
+				static route_table table;
+				return table;
+			}
+
+			std::array<std::atomic<char const*>, max_errors> error_names{};
+
+			thread_metrics& local()
+			{
+				thread_local thread_metrics* const m = []
+				{
+					auto const p = new thread_metrics();
+					p->next = all_threads.load(std::memory_order_relaxed);
+					while (!all_threads.compare_exchange_weak(p->next, p, std::memory_order_release, std::memory_order_relaxed)) {}
+					return p;
+				}();
+
+				return *m;
+			}
+
+			std::size_t highest_bit(std::uint64_t n)
+			{
+#if defined(__GNUC__) || defined(__clang__)
+				return 63 - static_cast<std::size_t>(__builtin_clzll(n));
+#else
+				std::size_t bit = 0;
+				while (n >>= 1)
+					++bit;
+
+				return bit;
+#endif
+			}
+
+			// Claims a slot for a new name, at most max_errors compares
+			std::size_t error_index(char const* what)
+			{
+				for (std::size_t i = 0; i < max_errors; ++i)
+				{
+					auto name = error_names[i].load(std::memory_order_acquire);
+					if (!name && error_names[i].compare_exchange_strong(name, what, std::memory_order_acq_rel))
+						return i;
+
+					if (name == what || std::strcmp(name, what) == 0)
+						return i;
+				}
+
+				return max_errors;
+			}
+
+			template<class F>
+			void for_each_thread(F&& f)
+			{
+				for (auto m = all_threads.load(std::memory_order_acquire); m; m = m->next)
+					f(*m);
+			}
+
+			std::uint64_t sum(counter thread_metrics::* c)
+			{
+				std::uint64_t total = 0;
+				for_each_thread([&](thread_metrics const& m) { total += (m.*c).get(); });
+				return total;
+			}
+
+			void append_metric(std::string& out, char const* name, char const* type, char const* help)
+			{
+				out.append("# HELP ").append(name).append(" ").append(help).append("\n");
+				out.append("# TYPE ").append(name).append(" ").append(type).append("\n");
+			}
+
+			void append_value(std::string& out, char const* name, std::string const& labels, std::string const& value)
+			{
+				out.append(name);
+				if (!labels.empty())
+					out.append("{").append(labels).append("}");
+
+				out.append(" ").append(value).append("\n");
+			}
+
+			void append_value(std::string& out, char const* name, std::string const& labels, std::uint64_t value)
+			{
+				append_value(out, name, labels, std::to_string(value));
+			}
+
+			// Escapes a label value
+			std::string label(std::string const& value)
+			{
+				std::string s;
+				for (auto const c : value)
+				{
+					if (c == '\\' || c == '"')
+						s.push_back('\\');
+
+					if (c == '\n')
+						s.append("\\n");
+					else
+						s.push_back(c);
+				}
+
+				return s;
+			}
+		}
+
+		std::size_t histogram::bucket(std::uint64_t us)
+		{
+			if (us < sub_buckets)
+				return static_cast<std::size_t>(us);
+
+			if (us >> max_bits)
+				us = (std::uint64_t(1) << max_bits) - 1;
+
+			auto const bit = highest_bit(us);
+			auto const sub = static_cast<std::size_t>(us >> (bit - sub_bits)) & (sub_buckets - 1);
+			return (bit - sub_bits + 1) * sub_buckets + sub;
+		}
+
+		std::uint64_t histogram::upper_bound(std::size_t i)
+		{
+			if (i < sub_buckets)
+				return i;
+
+			auto const shift = i / sub_buckets - 1;
+			auto const lower = static_cast<std::uint64_t>(sub_buckets + i % sub_buckets) << shift;
+			return lower + (std::uint64_t(1) << shift) - 1;
+		}
+
+		std::size_t add_route(std::string method, std::string target)
+		{
+			auto& table = routes();
+			if (table.size == other_route)
+				return other_route;
+
+			table.names[table.size] = { std::move(method), std::move(target) };
+			return table.size++;
+		}
+
+		void record_request(std::size_t route, unsigned status, clock::time_point start)
+		{
+			auto& m = local();
+			m.requests.add(1);
+
+			auto const status_class = status / 100;
+			if (status_class >= 1 && status_class <= 5)
+				m.status[status_class - 1].add(1);
+
+			auto const us = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+			m.latency[route < max_routes ? route : other_route].record(us > 0 ? static_cast<std::uint64_t>(us) : 0);
+		}
+
+		void add_bytes_in(std::uint64_t n)
+		{
+			local().bytes_in.add(n);
+		}
+
+		void add_bytes_out(std::uint64_t n)
+		{
+			local().bytes_out.add(n);
+		}
+
+		void connection_opened()
+		{
+			local().connections_opened.add(1);
+		}
+
+		void connection_closed()
+		{
+			local().connections_closed.add(1);
+		}
+
+		void record_error(char const* what)
+		{
+			local().errors[error_index(what)].add(1);
+		}
+
+		std::string prometheus_text()
+		{
+			std::string out;
+			out.reserve(4096);
+
+			append_metric(out, "adam_requests_total", "counter", "Responses written.");
+			append_value(out, "adam_requests_total", "", sum(&thread_metrics::requests));
+
+			append_metric(out, "adam_responses_total", "counter", "Responses written by status class.");
+			for (std::size_t i = 0; i < 5; ++i)
+			{
+				std::uint64_t total = 0;
+				for_each_thread([&](thread_metrics const& m) { total += m.status[i].get(); });
+				append_value(out, "adam_responses_total", "code=\"" + std::to_string(i + 1) + "xx\"", total);
+			}
+
+			append_metric(out, "adam_received_bytes_total", "counter", "Request bytes read.");
+			append_value(out, "adam_received_bytes_total", "", sum(&thread_metrics::bytes_in));
+
+			append_metric(out, "adam_sent_bytes_total", "counter", "Response bytes written.");
+			append_value(out, "adam_sent_bytes_total", "", sum(&thread_metrics::bytes_out));
+
+			auto const opened = sum(&thread_metrics::connections_opened);
+			auto const closed = sum(&thread_metrics::connections_closed);
+
+			append_metric(out, "adam_connections_total", "counter", "Connections accepted.");
+			append_value(out, "adam_connections_total", "", opened);
+
+			// Counts are read one after the other, so keep the gauge from going negative
+			append_metric(out, "adam_connections_active", "gauge", "Connections open.");
+			append_value(out, "adam_connections_active", "", opened > closed ? opened - closed : 0);
+
+			append_metric(out, "adam_errors_total", "counter", "Errors by operation.");
+			for (std::size_t i = 0; i <= max_errors; ++i)
+			{
+				auto const name = i < max_errors ? error_names[i].load(std::memory_order_acquire) : "other";
+				if (!name)
+					continue;
+
+				std::uint64_t total = 0;
+				for_each_thread([&](thread_metrics const& m) { total += m.errors[i].get(); });
+				if (total)
+					append_value(out, "adam_errors_total", "what=\"" + label(name) + "\"", total);
+			}
+
+			// Prometheus buckets, in seconds
+			static constexpr double bounds[] = {
+				0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+				0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+			append_metric(out, "adam_request_duration_seconds", "histogram", "Time from reading the request header to writing the response.");
+
+			std::vector<std::uint64_t> buckets(histogram::num_buckets);
+			auto const& table = routes();
+			for (std::size_t r = 0; r < max_routes; ++r)
+			{
+				if (r >= table.size && r != other_route)
+					continue;
+
+				std::fill(buckets.begin(), buckets.end(), 0);
+				std::uint64_t sum_us = 0;
+				for_each_thread([&](thread_metrics const& m)
+				{
+					for (std::size_t i = 0; i < histogram::num_buckets; ++i)
+						buckets[i] += m.latency[r].buckets[i].get();
+
+					sum_us += m.latency[r].sum_us.get();
+				});
+
+				std::uint64_t count = 0;
+				for (auto const n : buckets)
+					count += n;
+
+				if (count == 0)
+					continue;
+
+				auto const& name = table.names[r];
+				auto const labels = r == no_route
+					? std::string("method=\"\",route=\"unmatched\"")
+					: r == other_route
+					? std::string("method=\"\",route=\"other\"")
+					: "method=\"" + label(name.method) + "\",route=\"" + label(name.target) + "\"";
+
+				// A log-linear bucket is counted under the first bound that holds all of it
+				std::size_t i = 0;
+				std::uint64_t below = 0;
+				for (auto const le : bounds)
+				{
+					auto const le_us = static_cast<std::uint64_t>(le * 1e6);
+					for (; i < histogram::num_buckets && histogram::upper_bound(i) < le_us; ++i)
+						below += buckets[i];
+
+					char text[32];
+					std::snprintf(text, sizeof(text), "%g", le);
+					append_value(out, "adam_request_duration_seconds_bucket", labels + ",le=\"" + text + "\"", below);
+				}
+
+				append_value(out, "adam_request_duration_seconds_bucket", labels + ",le=\"+Inf\"", count);
+				char seconds[32];
+				std::snprintf(seconds, sizeof(seconds), "%.6f", double(sum_us) / 1e6);
+				append_value(out, "adam_request_duration_seconds_sum", labels, seconds);
+				append_value(out, "adam_request_duration_seconds_count", labels, count);
+			}
+
+			return out;
+		}
+	}
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace server_async {
+
+	namespace metrics {
+
+		using clock = std::chrono::steady_clock;
+
+		// Routes beyond this share the last histogram, other_route
+		static constexpr std::size_t max_routes = 64;
+
+		// Distinct error names counted, see record_error
+		static constexpr std::size_t max_errors = 32;
+
+		// Route id of requests that matched no route
+		static constexpr std::size_t no_route = 0;
+
+		// Route id of the routes added once the table was full, exported as "other"
+		static constexpr std::size_t other_route = max_routes - 1;
+
+		// Written only by the thread that owns it, so an update is
+		// a plain load and store instead of a locked read-modify-write.
+		class counter {
+		private:
+			std::atomic<std::uint64_t> value_{ 0 };
+
+		public:
+			void add(std::uint64_t n) {
+				value_.store(value_.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+			}
+
+			std::uint64_t get() const { return value_.load(std::memory_order_relaxed); }
+		};
+
+		// Log-linear buckets in microseconds, like HdrHistogram with two
+		// significant bits: each power of two is split into four buckets,
+		// so a recorded value is within 25% of the truth.
+		struct histogram {
+			static constexpr std::size_t sub_bits = 2;
+			static constexpr std::size_t sub_buckets = 1 << sub_bits;
+
+			// up to 2^32 microseconds, a little over an hour
+			static constexpr std::size_t max_bits = 32;
+			static constexpr std::size_t num_buckets = (max_bits - sub_bits + 1) * sub_buckets;
+
+			std::array<counter, num_buckets> buckets;
+			counter sum_us;
+
+			static std::size_t bucket(std::uint64_t us);
+
+			// largest value counted in bucket i
+			static std::uint64_t upper_bound(std::size_t i);
+
+			void record(std::uint64_t us) {
+				buckets[bucket(us)].add(1);
+				sum_us.add(us);
+			}
+		};
+
+		// not thread safe, call before the server starts
+		// returns the id passed to record_request
+		std::size_t add_route(std::string method, std::string target);
+
+		// A response was written.
+		// start is when the request header was read.
+		void record_request(std::size_t route, unsigned status, clock::time_point start);
+
+		void add_bytes_in(std::uint64_t n);
+		void add_bytes_out(std::uint64_t n);
+
+		void connection_opened();
+		void connection_closed();
+
+		// what is kept by pointer and must outlive the program, like a string literal
+		void record_error(char const* what);
+
+		// All threads summed, in the Prometheus text exposition format
+		std::string prometheus_text();
+	}
+}
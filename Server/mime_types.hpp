@@ -0,0 +1,266 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "server_util.hpp"
+
+// Content types by file extension, looked up with a perfect hash.
+// Header only so the example servers can use it as well.
+namespace server_async {
+
+	class mime_table {
+	private:
+		// Longer extensions are never found
+		static constexpr std::size_t max_extension = 16;
+
+		// Seeds tried for a bucket before the table grows
+		static constexpr std::uint64_t max_seed = 1 << 16;
+
+		struct slot {
+			std::string extension; // lowercase without the dot, empty if the slot is free
+			std::string type;
+		};
+
+		// Lowercase extension to type, what the hash is built from
+		std::unordered_map<std::string, std::string> types_;
+
+		// Every extension has its own slot: the hash of a key picks
+		// a bucket, and the bucket's seed mixed in picks the slot
+		std::vector<std::uint64_t> seeds_;
+		std::vector<slot> slots_;
+
+		std::string default_type_ = "application/text";
+
+		static constexpr char lower(char c) {
+			return c >= 'A' && c <= 'Z' ? static_cast<char>(c - 'A' + 'a') : c;
+		}
+
+		// The most requested extensions are compared as one word before
+		// hashing, their types copied from the table by build()
+		static constexpr std::array<char const*, 8> common_extensions = {
+			"html", "css", "js", "png", "jpg", "json", "svg", "ico" };
+
+		std::array<std::uint64_t, common_extensions.size()> common_words_{};
+		std::array<std::string, common_extensions.size()> common_types_;
+
+		// Up to four characters and their count in one word. Setting 0x20
+		// lowercases the letters and turns no other character into one
+		static constexpr std::uint64_t pack(char const* p, std::size_t size) {
+			std::uint64_t w = 0;
+			for (std::size_t i = 0; i < size; ++i)
+				w |= std::uint64_t(static_cast<unsigned char>(p[i])) << (8 * i);
+
+			w |= 0x20202020ull & ((std::uint64_t(1) << (8 * size)) - 1);
+			return w << 8 | size;
+		}
+
+		static std::uint64_t mix(std::uint64_t h) {
+			h ^= h >> 33;
+			h *= 0xff51afd7ed558ccdull;
+			h ^= h >> 33;
+			return h;
+		}
+
+		// FNV-1a, finalized so the high bits spread short keys too
+		static std::uint64_t hash(beast::string_view key) {
+			std::uint64_t h = 14695981039346656037ull;
+			for (auto const c : key)
+			{
+				h ^= static_cast<unsigned char>(c);
+				h *= 1099511628211ull;
+			}
+
+			return mix(h);
+		}
+
+		std::size_t bucket(std::uint64_t h) const {
+			return (h >> 32) & (seeds_.size() - 1);
+		}
+
+		std::size_t index(std::uint64_t h, std::uint64_t seed) const {
+			return mix(h + seed * 0x9e3779b97f4a7c15ull) & (slots_.size() - 1);
+		}
+
+
+		// Extensions with a dot are skipped, find() looks after the last one
+		void add(std::string extension, beast::string_view type) {
+			if (extension.empty() || extension.size() > max_extension || extension.find('.') != std::string::npos)
+				return;
+
+			std::transform(extension.begin(), extension.end(), extension.begin(), lower);
+			types_[std::move(extension)] = std::string(type);
+		}
+
+		// Hash and displace: the largest buckets are placed first,
+		// each trying seeds until its keys land in free, distinct slots.
+		// false if some bucket cannot be placed in a table of this size
+		bool place(std::size_t size) {
+			seeds_.assign(std::max<std::size_t>(1, size / 8), 0);
+			slots_.assign(size, slot{});
+
+			using type = std::pair<std::string const, std::string>;
+			std::vector<std::vector<type const*>> buckets(seeds_.size());
+			for (auto const& t : types_)
+				buckets[bucket(hash(t.first))].push_back(&t);
+
+			std::vector<std::size_t> order(buckets.size());
+			for (std::size_t i = 0; i < order.size(); ++i)
+				order[i] = i;
+
+			std::sort(order.begin(), order.end(), [&](std::size_t a, std::size_t b)
+			{
+				return buckets[a].size() > buckets[b].size();
+			});
+
+			std::vector<std::size_t> taken;
+			for (auto const b : order)
+			{
+				auto const& keys = buckets[b];
+				if (keys.empty())
+					break;
+
+				for (std::uint64_t seed = 1;; ++seed)
+				{
+					if (seed == max_seed)
+						return false;
+
+					taken.clear();
+					for (auto const key : keys)
+					{
+						auto const i = index(hash(key->first), seed);
+						if (!slots_[i].extension.empty() || std::find(taken.begin(), taken.end(), i) != taken.end())
+							break;
+
+						taken.push_back(i);
+					}
+
+					if (taken.size() < keys.size())
+						continue;
+
+					seeds_[b] = seed;
+					for (std::size_t k = 0; k < keys.size(); ++k)
+						slots_[taken[k]] = slot{ keys[k]->first, keys[k]->second };
+
+					break;
+				}
+			}
+
+			return true;
+		}
+
+		void build() {
+			std::size_t size = 1;
+			while (size < 2 * types_.size())
+				size *= 2;
+
+			while (!place(size))
+				size *= 2;
+
+			for (std::size_t i = 0; i < common_extensions.size(); ++i)
+			{
+				std::string const extension = common_extensions[i];
+				auto const it = types_.find(extension);
+				common_words_[i] = pack(extension.data(), extension.size());
+				common_types_[i] = it != types_.end() ? it->second : default_type_;
+			}
+		}
+
+	public:
+		// The types every server knows without a mime.types file
+		mime_table() {
+			add("htm", "text/html");
+			add("html", "text/html");
+			add("php", "text/html");
+			add("css", "text/css");
+			add("txt", "text/plain");
+			add("js", "application/javascript");
+			add("json", "application/json");
+			add("xml", "application/xml");
+			add("swf", "application/x-shockwave-flash");
+			add("flv", "video/x-flv");
+			add("png", "image/png");
+			add("jpe", "image/jpeg");
+			add("jpeg", "image/jpeg");
+			add("jpg", "image/jpeg");
+			add("gif", "image/gif");
+			add("bmp", "image/bmp");
+			add("ico", "image/vnd.microsoft.icon");
+			add("tiff", "image/tiff");
+			add("tif", "image/tiff");
+			add("svg", "image/svg+xml");
+			add("svgz", "image/svg+xml");
+			build();
+		}
+
+		// Adds the types of a mime.types file, "type ext ext ..." per line
+		// and "#" comments, over the ones with the same extensions.
+		// returns false if the file cannot be read
+		bool load(std::string const& path) {
+			std::ifstream in(path);
+			if (!in)
+				return false;
+
+			std::string line;
+			while (std::getline(in, line))
+			{
+				line.erase(std::find(line.begin(), line.end(), '#'), line.end());
+
+				std::istringstream fields(line);
+				std::string type, extension;
+				if (!(fields >> type))
+					continue;
+
+				while (fields >> extension)
+					add(std::move(extension), type);
+			}
+
+			build();
+			return true;
+		}
+
+		// The type of a path by the extension after its last dot,
+		// valid as long as the table is not loaded again
+		beast::string_view find(beast::string_view path) const {
+			auto const pos = path.rfind('.');
+			if (pos == beast::string_view::npos)
+				return default_type_;
+
+			auto const size = path.size() - pos - 1;
+			if (size == 0 || size > max_extension)
+				return default_type_;
+
+			if (size <= 4)
+			{
+				auto const w = pack(path.data() + pos + 1, size);
+				for (std::size_t i = 0; i < common_words_.size(); ++i)
+				{
+					if (common_words_[i] == w)
+						return common_types_[i];
+				}
+			}
+
+			char key[max_extension];
+			std::transform(path.begin() + pos + 1, path.end(), key, lower);
+
+			beast::string_view const extension(key, size);
+			auto const h = hash(extension);
+			auto const& s = slots_[index(h, seeds_[bucket(h)])];
+			if (s.extension != extension)
+				return default_type_;
+
+			return s.type;
+		}
+
+		std::size_t size() const {
+			return types_.size();
+		}
+	};
+}
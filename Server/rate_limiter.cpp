@@ -0,0 +1,176 @@
+#include <algorithm>
+#include <cmath>
+
+#include "rate_limiter.hpp"
+
+namespace server_async {
+
+	namespace {
+
+		// The state of a slot: the refill time in ms in the low 32 bits,
+		// the tokens in 1/65536 above them and the clock's mark on top
+		constexpr std::uint64_t one_token = 1 << 16;
+		constexpr std::uint64_t max_tokens = (std::uint64_t(1) << 31) - 1;
+		constexpr std::uint64_t referenced = std::uint64_t(1) << 63;
+
+		constexpr std::uint64_t make_state(std::uint64_t tokens, std::uint32_t time, std::uint64_t mark)
+		{
+			return mark | tokens << 32 | time;
+		}
+
+		// splitmix64's finalizer
+		std::uint64_t mix(std::uint64_t h)
+		{
+			h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+			h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+			h ^= h >> 31;
+			return h ? h : 1;
+		}
+	}
+
+	void rate_limiter::configure(double rate, double burst, std::size_t max_clients)
+	{
+		if (rate <= 0)
+		{
+			buckets_.reset();
+			mask_ = 0;
+			return;
+		}
+
+		std::size_t count = 1;
+		while (count * ways < max_clients)
+			count <<= 1;
+
+		buckets_ = std::make_unique<bucket[]>(count);
+		mask_ = count - 1;
+
+		rate_ = std::max<std::uint64_t>(1, static_cast<std::uint64_t>(std::llround(rate * one_token / 1000)));
+		burst_ = static_cast<std::uint64_t>(std::clamp(burst, 1.0, 32767.0) * one_token);
+		epoch_ = clock::now();
+	}
+
+	std::uint32_t rate_limiter::now_ms() const
+	{
+		// Wraps after 49 days, differences stay right
+		return static_cast<std::uint32_t>(
+			std::chrono::duration_cast<std::chrono::milliseconds>(clock::now() - epoch_).count());
+	}
+
+	std::uint64_t rate_limiter::tokens(std::uint64_t state, std::uint32_t now) const
+	{
+		auto const tokens = (state >> 32) & max_tokens;
+		auto const elapsed = static_cast<std::uint32_t>(now - static_cast<std::uint32_t>(state));
+
+		// Refill without overflowing on a long idle time
+		if (elapsed >= (burst_ - std::min(tokens, burst_)) / rate_ + 1)
+			return burst_;
+
+		return tokens + elapsed * rate_;
+	}
+
+	bool rate_limiter::take(slot& s, std::uint32_t now)
+	{
+		auto state = s.state.load(std::memory_order_relaxed);
+		for (;;)
+		{
+			auto tokens = this->tokens(state, now);
+
+			auto const allowed = tokens >= one_token;
+			if (allowed)
+				tokens -= one_token;
+
+			if (s.state.compare_exchange_weak(state, make_state(tokens, now, referenced), std::memory_order_relaxed))
+				return allowed;
+		}
+	}
+
+	bool rate_limiter::claim(slot& s, std::uint64_t old, std::uint64_t key, std::uint32_t now, bool& allowed)
+	{
+		auto const state = s.state.load(std::memory_order_relaxed);
+		if (!s.key.compare_exchange_strong(old, key, std::memory_order_relaxed))
+			return false;
+
+		// An empty slot starts full. An evicted one gets a single token, or
+		// the fewer its client had left, so cycling keys through a bucket
+		// drains the bucket's slots instead of resetting them
+		auto tokens = old == 0 ? burst_ : std::min(this->tokens(state, now), one_token);
+
+		allowed = tokens >= one_token;
+		if (allowed)
+			tokens -= one_token;
+
+		// Not marked, so a client seen once is the first to go
+		s.state.store(make_state(tokens, now, 0), std::memory_order_relaxed);
+		return true;
+	}
+
+	bool rate_limiter::allow(std::uint64_t client)
+	{
+		auto& b = buckets_[client & mask_];
+		auto const now = now_ms();
+
+		// Another thread may claim the slot first, then look again
+		for (auto attempt = 0; attempt < max_claims; ++attempt)
+		{
+			// An empty slot, or else the first one not used since the last sweep
+			slot* victim = nullptr;
+			std::uint64_t old = 0;
+			for (auto& s : b.slots)
+			{
+				auto const k = s.key.load(std::memory_order_relaxed);
+				if (k == client)
+					return take(s, now);
+
+				if ((!victim || (old != 0 && k == 0)) && (k == 0 || !(s.state.load(std::memory_order_relaxed) & referenced)))
+				{
+					victim = &s;
+					old = k;
+				}
+			}
+
+			// Every slot was used since: clear the marks and pick one by the key
+			if (!victim)
+			{
+				for (auto& s : b.slots)
+					s.state.fetch_and(~referenced, std::memory_order_relaxed);
+
+				victim = &b.slots[(client >> 32) % ways];
+				old = victim->key.load(std::memory_order_relaxed);
+			}
+
+			bool allowed = false;
+			if (claim(*victim, old, client, now, allowed))
+				return allowed;
+		}
+
+		// Contended by new clients. The busiest clients lose the most
+		// races, so letting them through would leave them unlimited
+		return false;
+	}
+
+	std::uint64_t rate_limiter::key(net::ip::address const& address)
+	{
+		if (address.is_v4())
+			return mix(address.to_v4().to_uint());
+
+		auto const bytes = address.to_v6().to_bytes();
+		std::uint64_t hi = 0, lo = 0;
+		for (std::size_t i = 0; i < 8; ++i)
+		{
+			hi = hi << 8 | bytes[i];
+			lo = lo << 8 | bytes[i + 8];
+		}
+
+		return mix(hi ^ mix(lo));
+	}
+
+	std::uint64_t rate_limiter::key(beast::string_view api_key)
+	{
+		// FNV-1a, kept apart from the addresses by the seed of the mix
+		std::uint64_t h = 0xcbf29ce484222325ull;
+		for (auto const c : api_key)
+			h = (h ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+
+		return mix(h ^ 0x9e3779b97f4a7c15ull);
+	}
+}
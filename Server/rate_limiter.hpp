@@ -0,0 +1,84 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "server_util.hpp"
+
+namespace server_async {
+
+	// Token buckets of the clients, for rate limiting.
+	//
+	// The table has a fixed number of buckets of four slots, each bucket
+	// one cache line, so a request touches one line and takes no lock:
+	// a slot's tokens and refill time are a single word updated with CAS.
+	// A client missing from its bucket takes an empty slot or evicts one,
+	// the clock way: a slot used since the last sweep of its bucket gets a
+	// second chance. Memory stays bounded. A client in an empty slot starts
+	// with a full bucket, one that evicts another with a single token, or
+	// none if the evicted client had run out, so a new client's first
+	// request passes while cycling keys through a bucket gains little over
+	// the rate. Clients whose keys hash alike share one.
+	class rate_limiter {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		static constexpr std::size_t ways = 4;
+
+		// Lost races for a slot before a new client is refused
+		static constexpr int max_claims = 4;
+
+	private:
+		struct slot {
+			std::atomic<std::uint64_t> key{ 0 }; // 0 is empty
+			std::atomic<std::uint64_t> state{ 0 };
+		};
+
+		struct alignas(64) bucket {
+			slot slots[ways];
+		};
+
+		std::unique_ptr<bucket[]> buckets_;
+		std::size_t mask_ = 0;
+
+		// Tokens are counted in 1/65536 and refilled per millisecond
+		std::uint64_t rate_ = 0;  // per ms
+		std::uint64_t burst_ = 0;
+
+		clock::time_point epoch_ = clock::now();
+
+		std::uint32_t now_ms() const;
+
+		// The tokens of a slot in state, refilled up to now
+		std::uint64_t tokens(std::uint64_t state, std::uint32_t now) const;
+
+		// Takes a token from the bucket in s, false if it has none
+		bool take(slot& s, std::uint32_t now);
+
+		// Gives key the slot s, whose key was old, false if another thread changed it.
+		// allowed is whether the request claiming it gets a token
+		bool claim(slot& s, std::uint64_t old, std::uint64_t key, std::uint32_t now, bool& allowed);
+
+	public:
+		rate_limiter() = default;
+
+		rate_limiter(rate_limiter const&) = delete;
+		rate_limiter& operator=(rate_limiter const&) = delete;
+
+		// rate tokens a second up to burst, at most 32767, about max_clients remembered.
+		// Not thread safe, call before the server starts. 0 rate turns it off
+		void configure(double rate, double burst, std::size_t max_clients);
+
+		bool enabled() const { return buckets_ != nullptr; }
+
+		// Takes a token for client, false if it is over its rate
+		bool allow(std::uint64_t client);
+
+		// Keys of clients, never 0
+		static std::uint64_t key(net::ip::address const& address);
+		static std::uint64_t key(beast::string_view api_key);
+	};
+}
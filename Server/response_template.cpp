@@ -0,0 +1,85 @@
+#include <chrono>
+#include <cstring>
+
+#include "response_template.hpp"
+
+namespace sutil = server_util;
+
+namespace server_async {
+
+	response_template::response_template(
+		http::status status,
+		beast::string_view content_type,
+		bool keep_alive,
+		beast::string_view content_encoding,
+		beast::string_view fields)
+		: status_(status)
+	{
+		auto const reason = http::obsolete_reason(status);
+
+		head_.append(" ");
+		head_.append(std::to_string(static_cast<unsigned>(status))).append(" ");
+		head_.append(reason.data(), reason.size()).append("\r\n");
+		head_.append("Server: " ADAM_VERSION_STRING "\r\n");
+		head_.append("Content-Type: ").append(content_type.data(), content_type.size()).append("\r\n");
+		if (!content_encoding.empty())
+		{
+			head_.append("Content-Encoding: ").append(content_encoding.data(), content_encoding.size()).append("\r\n");
+			head_.append("Vary: Accept-Encoding\r\n");
+		}
+		head_.append(fields.data(), fields.size());
+		head_.append(keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+	}
+
+	// The formatted date only changes once a second
+	static std::string_view current_date()
+	{
+		thread_local std::time_t last = 0;
+		thread_local char date[32];
+		thread_local std::size_t size = 0;
+
+		auto const now = std::chrono::system_clock::to_time_t(std::chrono::system_clock::now());
+		if (now != last)
+		{
+			size = sutil::http_date(now, date, sizeof(date));
+			last = now;
+		}
+
+		return { date, size };
+	}
+
+	static char* append(char* p, std::string_view s)
+	{
+		std::memcpy(p, s.data(), s.size());
+		return p + s.size();
+	}
+
+	void response_tail::set(std::size_t content_length)
+	{
+		auto p = append(data_.data(), "Content-Length: ");
+
+		char digits[20];
+		auto d = digits + sizeof(digits);
+		do
+		{
+			*--d = static_cast<char>('0' + content_length % 10);
+			content_length /= 10;
+		} while (content_length);
+
+		p = append(p, { d, static_cast<std::size_t>(digits + sizeof(digits) - d) });
+		p = append(p, "\r\nDate: ");
+		p = append(p, current_date());
+		p = append(p, "\r\n\r\n");
+
+		size_ = static_cast<std::size_t>(p - data_.data());
+	}
+
+	void response_tail::set_date()
+	{
+		auto p = append(data_.data(), "Date: ");
+		p = append(p, current_date());
+		p = append(p, "\r\n\r\n");
+
+		size_ = static_cast<std::size_t>(p - data_.data());
+	}
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <array>
+#include <string>
+#include <string_view>
+
+#include "server_util.hpp"
+
+namespace server_async {
+
+	// Status line and constant fields of a response, serialized once.
+	// The HTTP version of the request is written before it, Content-Length
+	// and Date after it into a response_tail.
+	class response_template {
+	private:
+		std::string head_;
+		http::status status_;
+
+	public:
+		// content_encoding: empty for an uncompressed body
+		// fields: more fields, each ending with "\r\n"
+		response_template(
+			http::status status,
+			beast::string_view content_type,
+			bool keep_alive,
+			beast::string_view content_encoding = {},
+			beast::string_view fields = {});
+
+		net::const_buffer head() const { return net::buffer(head_); }
+
+		http::status status() const { return status_; }
+	};
+
+	// keep-alive and close variants of the same response
+	struct response_templates {
+		response_template keep_alive;
+		response_template close;
+
+		response_templates(http::status status, beast::string_view content_type, beast::string_view content_encoding = {}, beast::string_view fields = {})
+			: keep_alive(status, content_type, true, content_encoding, fields), close(status, content_type, false, content_encoding, fields) {}
+
+		response_template const& get(bool keep) const { return keep ? keep_alive : close; }
+	};
+
+	// "HTTP/1.0" or "HTTP/1.1", written before a head stored from the status code on
+	inline net::const_buffer http_version(unsigned version)
+	{
+		return net::buffer(version == 10 ? "HTTP/1.0" : "HTTP/1.1", 8);
+	}
+
+	// "Content-Length: n\r\nDate: ...\r\n\r\n" for one response
+	class response_tail {
+	private:
+		std::array<char, 96> data_;
+		std::size_t size_ = 0;
+
+	public:
+		void set(std::size_t content_length);
+
+		// "Date: ...\r\n\r\n" alone, for a head that has its Content-Length
+		void set_date();
+
+		net::const_buffer buffer() const { return net::buffer(data_.data(), size_); }
+	};
+
+	// A response sent as template head, tail and body in one gathered write.
+	// The body parts are concatenated into a buffer owned by the connection,
+	// which picks the close variant when it is closing after this response.
+	struct template_response {
+		response_templates const& header;
+		bool keep_alive;
+		std::array<std::string_view, 3> body;
+	};
+}
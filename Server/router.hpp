@@ -0,0 +1,216 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace server_async {
+
+	// Result of matching a request target against the routes.
+	// All views point into the request target or into the router,
+	// so a match is only valid while both are alive.
+	struct route_match {
+
+		static constexpr std::size_t max_params = 8;
+
+		struct param {
+			std::string_view name;
+			std::string_view value;
+		};
+
+		std::string_view path;		// target without the query
+		std::string_view query;		// text after '?', without the '?'
+		std::string_view wildcard;	// remainder matched by a trailing "*"
+
+		std::array<param, max_params> params;
+		std::size_t num_params = 0;
+
+		// value of a "{name}" segment, empty if not captured
+		std::string_view get(std::string_view name) const {
+			for (std::size_t i = 0; i < num_params; ++i) {
+				if (params[i].name == name)
+					return params[i].value;
+			}
+
+			return {};
+		}
+	};
+
+	// Prefix tree of routes keyed by path segment.
+	// Routes are compiled once with add() and matched without allocating.
+	//
+	// Pattern syntax:
+	//   /users        literal segment
+	//   /users/{id}   captures one segment as "id"
+	//   /static/*     matches the rest of the path, including further '/'
+	//
+	// Literal segments take priority over parameters, which take priority over wildcards.
+	template<class Handler>
+	class router {
+	private:
+
+		struct node {
+			std::string segment;
+			std::vector<std::unique_ptr<node>> literals; // sorted by segment
+
+			std::unique_ptr<node> param;
+
+			// Names of the "{name}" segments on the way to each handler.
+			// Kept per route, routes may name the same position differently
+			bool has_handler = false;
+			Handler handler;
+			std::vector<std::string> param_names;
+
+			bool has_wildcard = false;
+			Handler wildcard_handler;
+			std::vector<std::string> wildcard_param_names;
+		};
+
+		node root_;
+
+		static bool is_param(std::string_view seg) {
+			return seg.size() > 2 && seg.front() == '{' && seg.back() == '}';
+		}
+
+		static std::string_view next_segment(std::string_view path, std::size_t& pos) {
+			auto const end = path.find('/', pos);
+			auto const seg = path.substr(pos, end == std::string_view::npos ? std::string_view::npos : end - pos);
+			pos = end == std::string_view::npos ? path.size() + 1 : end + 1;
+			return seg;
+		}
+
+		static node* find_literal(std::vector<std::unique_ptr<node>> const& nodes, std::string_view seg) {
+			auto const it = std::lower_bound(nodes.begin(), nodes.end(), seg,
+				[](auto const& n, std::string_view s) { return n->segment < s; });
+
+			if (it == nodes.end() || (*it)->segment != seg)
+				return nullptr;
+
+			return it->get();
+		}
+
+		static node& add_literal(std::vector<std::unique_ptr<node>>& nodes, std::string_view seg) {
+			auto const it = std::lower_bound(nodes.begin(), nodes.end(), seg,
+				[](auto const& n, std::string_view s) { return n->segment < s; });
+
+			if (it != nodes.end() && (*it)->segment == seg)
+				return **it;
+
+			auto n = std::make_unique<node>();
+			n->segment = std::string(seg);
+			return **nodes.insert(it, std::move(n));
+		}
+
+		// The captured values are in path order, as are the route's names
+		static Handler const* found(Handler const& handler, std::vector<std::string> const& names, route_match& m) {
+			for (std::size_t i = 0; i < m.num_params; ++i)
+				m.params[i].name = names[i];
+
+			return &handler;
+		}
+
+		// depth first so that a failed literal branch can fall back to a parameter or wildcard
+		static Handler const* match(node const& n, std::string_view path, std::size_t pos, route_match& m) {
+			if (pos > path.size()) {
+				if (n.has_handler)
+					return found(n.handler, n.param_names, m);
+
+				if (n.has_wildcard) {
+					m.wildcard = {};
+					return found(n.wildcard_handler, n.wildcard_param_names, m);
+				}
+
+				return nullptr;
+			}
+
+			auto next = pos;
+			auto const seg = next_segment(path, next);
+
+			if (auto const lit = find_literal(n.literals, seg)) {
+				if (auto const h = match(*lit, path, next, m))
+					return h;
+			}
+
+			if (n.param && !seg.empty() && m.num_params < route_match::max_params) {
+				auto const num_params = m.num_params;
+				m.params[m.num_params++] = { {}, seg };
+
+				if (auto const h = match(*n.param, path, next, m))
+					return h;
+
+				m.num_params = num_params;
+			}
+
+			if (n.has_wildcard) {
+				m.wildcard = path.substr(pos);
+				return found(n.wildcard_handler, n.wildcard_param_names, m);
+			}
+
+			return nullptr;
+		}
+
+	public:
+
+		// pattern must begin with '/'
+		// throws std::invalid_argument if it has more than route_match::max_params parameters
+		void add(std::string_view pattern, Handler const& handler) {
+			// "/" is the root itself
+			auto const start = pattern.size() > 1 ? std::size_t(1) : pattern.size() + 1;
+
+			// A route with more could never match
+			std::size_t num_params = 0;
+			for (auto pos = start; pos <= pattern.size(); )
+				num_params += is_param(next_segment(pattern, pos));
+
+			if (num_params > route_match::max_params)
+				throw std::invalid_argument("route " + std::string(pattern) + " has more than " + std::to_string(route_match::max_params) + " parameters");
+
+			auto n = &root_;
+			std::vector<std::string> names;
+
+			auto pos = start;
+			while (pos <= pattern.size()) {
+				auto const seg = next_segment(pattern, pos);
+
+				if (seg == "*" && pos > pattern.size()) {
+					n->has_wildcard = true;
+					n->wildcard_handler = handler;
+					n->wildcard_param_names = std::move(names);
+					return;
+				}
+
+				if (is_param(seg)) {
+					if (!n->param)
+						n->param = std::make_unique<node>();
+
+					names.emplace_back(seg.substr(1, seg.size() - 2));
+					n = n->param.get();
+					continue;
+				}
+
+				n = &add_literal(n->literals, seg);
+			}
+
+			n->has_handler = true;
+			n->handler = handler;
+			n->param_names = std::move(names);
+		}
+
+		// target must begin with '/'
+		// returns nullptr if no route matches
+		Handler const* find(std::string_view target, route_match& m) const {
+			auto const q = target.find('?');
+			m.path = target.substr(0, q);
+			m.query = q == std::string_view::npos ? std::string_view{} : target.substr(q + 1);
+			m.wildcard = {};
+			m.num_params = 0;
+
+			// "/" is the root itself
+			return match(root_, m.path, m.path.size() > 1 ? 1 : m.path.size() + 1, m);
+		}
+	};
+}
@@ -1,23 +1,196 @@
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
 #include <cstdlib>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <optional>
 #include <thread>
+#include <utility>
+#include <variant>
 #include <vector>
-#include <unordered_map>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "server.hpp"
 #include "server_util.hpp"
+#include "router.hpp"
+#include "file_cache.hpp"
+#include "response_template.hpp"
+#include "worker_pool.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
+#include "timer_wheel.hpp"
+#include "compression.hpp"
+#include "http_range.hpp"
+#include "file_range_body.hpp"
+#include "rate_limiter.hpp"
+#include "session_memory.hpp"
+#include "session_pool.hpp"
+#include "handler_memory.hpp"
+
+// Files are sent with sendfile(2) when the platform has it
+#if defined(__linux__) && BOOST_BEAST_USE_POSIX_FILE && !defined(ADAM_NO_SENDFILE)
+#define ADAM_USE_SENDFILE
+#include <sys/sendfile.h>
+#include <cerrno>
+#endif
 
 namespace sutil = server_util;
 
 namespace server_async {
 
-#define ADAM_VERSION_STRING "adam server"
-	
-	using beast_request = http::request<http::string_body>;	
+	// Requests and the responses made from them live in the memory of their session
+	using beast_header = http::request_header<session_fields>;
+
+	// A handler gets the whole request body, or each piece as it arrives
+	struct route {
+		callback on_request = nullptr;
+		body_callback on_body = nullptr;
+		std::size_t metrics_id = metrics::no_route;
+
+		// Requests between the handler call and the response, see set_admission
+		std::shared_ptr<std::atomic<std::size_t>> in_flight = std::make_shared<std::atomic<std::size_t>>(0);
+	};
+
+	// nullptr if no handler is added for the method and target
+	route const* find_route(
+		http::verb method,
+		beast::string_view target,
+		route_match& match);
 
 	template<class Request, class Send>
-	void handle_request(Request&& req, Send&& send);	
+	void handle_request(
+		Request const& req,
+		std::string_view body,
+		Send const& send,
+		route const* r,
+		route_match const& match);
+
+	template<class Request, class Send>
+	void handle_body(
+		Request const& req,
+		std::string_view chunk,
+		bool last,
+		Send const& send,
+		route const& r,
+		route_match const& match);
+
+	// A file response whose header is serialized by beast and whose
+	// body is copied by the kernel from the file to the socket
+	struct file_response {
+		static constexpr std::size_t buffer_size = 64 * 1024;
+
+		http::response<http::empty_body, session_fields> header;
+		http::file_body::value_type body;
+
+		// The bytes sent, [first, end), all of the file unless a range was asked for
+		std::uint64_t first = 0;
+		std::uint64_t end = 0;
+		std::uint64_t offset = 0;
+
+		// only allocated when the file system does not support sendfile
+		std::unique_ptr<char[]> buffer;
+	};
+
+	// A file from the cache, written with its header in a single gathered write
+	struct cached_response {
+		std::shared_ptr<cached_file const> file = nullptr;
+		bool keep_alive = false;
+
+		// Other than 200, the header is made for the request
+		// and followed by body, a part of the cached file
+		unsigned status = 200;
+		std::string head = {};
+		std::string_view body = {};
+
+		// The body of a multipart range response instead, copied from the file
+		std::string parts = {};
+	};
+
+	// The response being written, owned by the session and reused for every request
+	using response_slot = std::variant<
+		std::monostate,
+		http::response<http::empty_body, session_fields>,
+		http::response<http::file_body, session_fields>,
+		http::response<file_range_body, session_fields>,
+		file_response>;
+
+	// 64MB of files up to 1MB each by default
+	file_cache static_files{ 64 * 1024 * 1024, 1024 * 1024 };
+
+	// Smaller text and json bodies are sent as they are
+	std::size_t compress_min_size = 1024;
+
+	// Set with set_admission, 0 is no limit
+	struct admission_limits {
+		std::size_t max_connections = 0;
+		std::size_t max_route_requests = 0;
+	};
+
+	admission_limits admission;
+
+	// Set with set_rate_limit
+	rate_limiter rate_limits;
+
+	// Requests with this field are limited by its value instead of the address
+	std::string rate_key_field;
+
+	//======= RESPONSE HEADERS ===========================
+
+	response_templates const bad_request_header{ http::status::bad_request, "text/html" };
+	response_templates const not_found_header{ http::status::not_found, "text/html" };
+	response_templates const server_error_header{ http::status::internal_server_error, "text/html" };
+	response_templates const payload_too_large_header{ http::status::payload_too_large, "text/html" };
+
+	// Rebuilt by set_admission and set_rate_limit with their Retry-After
+	response_templates unavailable_header{ http::status::service_unavailable, "text/html", {}, "Retry-After: 1\r\n" };
+	response_templates too_many_requests_header{ http::status::too_many_requests, "text/html", {}, "Retry-After: 1\r\n" };
+
+	// One set of templates for each content coding
+	struct coded_templates {
+		response_templates identity;
+		response_templates gzip;
+		response_templates deflate;
+
+		// identity for a body that could have been compressed
+		response_templates identity_vary;
+
+		coded_templates(http::status status, beast::string_view content_type)
+			: identity(status, content_type)
+			, gzip(status, content_type, coding_name(content_coding::gzip))
+			, deflate(status, content_type, coding_name(content_coding::deflate))
+			, identity_vary(status, content_type, {}, "Vary: Accept-Encoding\r\n") {}
+
+		response_templates const& get(content_coding coding) const {
+			switch (coding)
+			{
+			case content_coding::gzip: return gzip;
+			case content_coding::deflate: return deflate;
+			default: return identity;
+			}
+		}
+	};
+
+	coded_templates const text_header{ http::status::ok, sutil::mime_type(".txt") };
+	coded_templates const json_header{ http::status::ok, sutil::mime_type(".json") };
+
+	// Same as message::keep_alive() for a request header on its own
+	bool keep_alive(beast_header const& req)
+	{
+		http::token_list connection{ req[http::field::connection] };
+		if (req.version() < 11)
+			return connection.exists("keep-alive");
+
+		return !connection.exists("close");
+	}
 
 	//======= ERROR RESPONSES ===========================
 
@@ -27,13 +200,9 @@ namespace server_async {
 		Send const& send,
 		beast::string_view why)
 	{
-		http::response<http::string_body> res{ http::status::bad_request, req.version() };
-		res.set(http::field::server, ADAM_VERSION_STRING);
-		res.set(http::field::content_type, "text/html");
-		res.keep_alive(req.keep_alive());
-		res.body() = std::string(why);
-		res.prepare_payload();
-		return send(std::move(res));
+		return send(template_response{
+			bad_request_header, keep_alive(req),
+			{ std::string_view(why.data(), why.size()) } });
 	}
 
 	template<class Request, class Send>
@@ -42,13 +211,9 @@ namespace server_async {
 		Send const& send,
 		beast::string_view resource)
 	{
-		http::response<http::string_body> res{ http::status::not_found, req.version() };
-		res.set(http::field::server, ADAM_VERSION_STRING);
-		res.set(http::field::content_type, "text/html");
-		res.keep_alive(req.keep_alive());
-		res.body() = "The resource '" + std::string(resource) + "' was not found.";
-		res.prepare_payload();
-		return send(std::move(res));
+		return send(template_response{
+			not_found_header, keep_alive(req),
+			{ "The resource '", std::string_view(resource.data(), resource.size()), "' was not found." } });
 	}
 
 	template<class Request, class Send>
@@ -57,13 +222,40 @@ namespace server_async {
 		Send const& send,
 		beast::string_view what)
 	{
-		http::response<http::string_body> res{ http::status::internal_server_error, req.version() };
-		res.set(http::field::server, ADAM_VERSION_STRING);
-		res.set(http::field::content_type, "text/html");
-		res.keep_alive(req.keep_alive());
-		res.body() = "An error occurred: '" + std::string(what) + "'";
-		res.prepare_payload();
-		return send(std::move(res));
+		return send(template_response{
+			server_error_header, keep_alive(req),
+			{ "An error occurred: '", std::string_view(what.data(), what.size()), "'" } });
+	}
+
+	// The rest of the body is left unread, so the connection closes after it
+	template<class Send>
+	void send_payload_too_large(Send const& send)
+	{
+		return send(template_response{
+			payload_too_large_header, false,
+			{ "The request body is too large." } });
+	}
+
+	// A route over its limit is answered from the template alone,
+	// without calling the handler
+	template<class Request, class Send>
+	void send_unavailable(
+		Request const& req,
+		Send const& send)
+	{
+		return send(template_response{
+			unavailable_header, keep_alive(req),
+			{ "The server is busy, try again later." } });
+	}
+
+	template<class Request, class Send>
+	void send_too_many_requests(
+		Request const& req,
+		Send const& send)
+	{
+		return send(template_response{
+			too_many_requests_header, keep_alive(req),
+			{ "Too many requests, try again later." } });
 	}
 
 	//======= SUCCESSFUL RESPONSES ========================
@@ -73,16 +265,123 @@ namespace server_async {
 		Request const& req,
 		Send const& send,
 		std::string const& body,
-		const char* content_extension)
+		coded_templates const& header)
 	{
-		http::response<http::string_body> res{ http::status::not_found, req.version() };
-		res.set(http::field::server, ADAM_VERSION_STRING);
-		res.set(http::field::content_type, sutil::mime_type(content_extension));
-		res.keep_alive(req.keep_alive());
-		res.body() = body;
-		res.prepare_payload();
+		// A body this large is compressed for the clients that accept it, so
+		// every answer carries Vary, also when the client or zlib says no
+		auto const varies = body.size() >= compress_min_size;
+		auto const coding = varies ? preferred_coding(req) : content_coding::identity;
+		if (coding != content_coding::identity)
+		{
+			// The session copies the body before send returns, so one buffer per thread will do
+			thread_local std::string compressed;
+			if (compress(body, coding, compressed))
+				return send(template_response{
+					header.get(coding), keep_alive(req),
+					{ compressed } });
+		}
 
-		return send(std::move(res));
+		auto const& identity = varies ? header.identity_vary : header.identity;
+		return send(template_response{
+			identity, keep_alive(req),
+			{ body } });
+	}
+
+	// Header of a response made from a cached file for a conditional or range request.
+	// Like the cached 200 headers it starts after the HTTP version and ends before Date
+	std::string cached_head(
+		cached_file const& file,
+		http::status status,
+		bool keep_alive,
+		beast::string_view content_type,
+		std::uint64_t content_length,
+		std::string const& content_range)
+	{
+		auto const reason = http::obsolete_reason(status);
+
+		std::string head;
+		head.reserve(384);
+		head.append(" ").append(std::to_string(static_cast<unsigned>(status))).append(" ");
+		head.append(reason.data(), reason.size()).append("\r\n");
+		head.append("Server: " ADAM_VERSION_STRING "\r\n");
+
+		if (status == http::status::partial_content)
+			head.append("Content-Type: ").append(content_type.data(), content_type.size()).append("\r\n");
+
+		// A 304 leaves out the length of the body it does not send
+		if (status != http::status::not_modified)
+			head.append("Content-Length: ").append(std::to_string(content_length)).append("\r\n");
+
+		if (!content_range.empty())
+			head.append("Content-Range: ").append(content_range).append("\r\n");
+
+		if (!file.content_encoding.empty())
+			head.append("Content-Encoding: ").append(file.content_encoding).append("\r\n");
+
+		if (file.vary)
+			head.append("Vary: Accept-Encoding\r\n");
+
+		head.append("Accept-Ranges: bytes\r\n");
+		head.append("ETag: ").append(file.etag).append("\r\n");
+		head.append("Last-Modified: ").append(file.last_modified).append("\r\n");
+		head.append(keep_alive ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+		return head;
+	}
+
+	template<class Request, class Send>
+	void send_cached_file(
+		Request const& req,
+		Send const& send,
+		std::shared_ptr<cached_file const> file)
+	{
+		auto const keep = keep_alive(req);
+		auto const size = static_cast<std::uint64_t>(file->body.size());
+
+		if (not_modified(req, file->etag, file->mtime))
+		{
+			auto head = cached_head(*file, http::status::not_modified, keep, {}, 0, {});
+			return send(cached_response{ std::move(file), keep, 304, std::move(head) });
+		}
+
+		// Range only applies to GET
+		thread_local std::vector<byte_range> ranges;
+		auto const range = req.method() == http::verb::get && if_range_matches(req, file->etag, file->mtime)
+			? parse_range(req[http::field::range], size, ranges)
+			: range_status::full;
+
+		if (range == range_status::full)
+			return send(cached_response{ std::move(file), keep });
+
+		if (range == range_status::unsatisfiable)
+		{
+			auto head = cached_head(*file, http::status::range_not_satisfiable, keep, {}, 0, "bytes */" + std::to_string(size));
+			return send(cached_response{ std::move(file), keep, 416, std::move(head) });
+		}
+
+		// One range is written straight from the cached body
+		if (ranges.size() == 1)
+		{
+			auto const r = ranges.front();
+			auto head = cached_head(*file, http::status::partial_content, keep, file->content_type, r.size(), content_range(r, size));
+			std::string_view const slice(file->body.data() + r.first, static_cast<std::size_t>(r.size()));
+			return send(cached_response{ std::move(file), keep, 206, std::move(head), slice });
+		}
+
+		// Several are copied into a multipart body, written after the header's Date
+		thread_local std::vector<range_part> parts;
+		thread_local std::string closing;
+		auto const length = multipart_parts(ranges, size, file->content_type, parts, closing);
+
+		auto head = cached_head(*file, http::status::partial_content, keep,
+			"multipart/byteranges; boundary=" + multipart_boundary(), length, {});
+
+		std::string body;
+		body.reserve(static_cast<std::size_t>(length));
+		for (auto const& part : parts)
+			body.append(part.header).append(file->body, static_cast<std::size_t>(part.first), static_cast<std::size_t>(part.size));
+
+		body.append(closing);
+		return send(cached_response{ std::move(file), keep, 206, std::move(head), {}, std::move(body) });
 	}
 
 	template<class Request, class Send>
@@ -92,9 +391,47 @@ namespace server_async {
 		std::string const& file_path,
 		const char* content_extension)
 	{
+		// override content type for file extension
+		auto const has_extension = strlen(content_extension) > 0;
+		auto const preferred = preferred_coding(req);
+
+		// The common case of no extension override and no coding avoids building
+		// a key, and the cache entry keeps the content type of the file
+		if (!has_extension && preferred == content_coding::identity)
+		{
+			if (auto const file = static_files.get(file_path, file_path, {}))
+				return send_cached_file(req, send, file);
+		}
+
+		auto const content_type = has_extension ? sutil::mime_type(content_extension) : sutil::mime_type(file_path);
+
+		// Compressed variants are cached under their own keys
+		auto const coding = compressible(content_type) ? preferred : content_coding::identity;
+
+		// The identity entry was already tried above when no coding was preferred
+		std::shared_ptr<cached_file const> file;
+		if (has_extension || coding != content_coding::identity)
+			file = static_files.get(file_path + '\n' + content_extension + '\n' + std::string(coding_name(coding)), file_path, content_type, coding);
+		else if (preferred != content_coding::identity)
+			file = static_files.get(file_path, file_path, content_type);
+
+		if (file)
+			return send_cached_file(req, send, file);
+
 		beast::error_code ec;
 		http::file_body::value_type body;
-		body.open(file_path.c_str(), beast::file_mode::scan, ec);
+
+		// A file too large for the cache is only sent compressed when it has a gzip sibling
+		auto encoding = beast::string_view{};
+		if (coding == content_coding::gzip)
+		{
+			body.open((file_path + ".gz").c_str(), beast::file_mode::scan, ec);
+			if (!ec)
+				encoding = coding_name(coding);
+		}
+
+		if (encoding.empty())
+			body.open(file_path.c_str(), beast::file_mode::scan, ec);
 
 		// Handle the case where the file doesn't exist
 		if (ec == beast::errc::no_such_file_or_directory)
@@ -107,24 +444,108 @@ namespace server_async {
 		// Cache the size since we need it after the move
 		auto const size = body.size();
 
-		// Respond to GET request
-		http::response<http::file_body> res{
-			std::piecewise_construct,
-			std::make_tuple(std::move(body)),
-			std::make_tuple(http::status::ok, req.version())
+		// Validators of the file the body is read from
+		std::uint64_t file_size = 0;
+		std::time_t mtime = 0;
+		sutil::file_status(encoding.empty() ? file_path : file_path + ".gz", file_size, mtime);
+		auto const etag = make_etag(size, mtime, encoding);
+
+		auto const set_fields = [&](auto& res)
+		{
+			res.set(http::field::server, ADAM_VERSION_STRING);
+			res.set(http::field::content_type, content_type);
+			if (!encoding.empty())
+				res.set(http::field::content_encoding, encoding);
+
+			// Compressible types are sent compressed when a gzip sibling exists
+			if (compressible(content_type))
+				res.set(http::field::vary, "Accept-Encoding");
+			res.set(http::field::accept_ranges, "bytes");
+			res.set(http::field::etag, etag);
+			res.set(http::field::last_modified, sutil::http_date(mtime));
+			res.keep_alive(keep_alive(req));
 		};
 
-		res.set(http::field::server, ADAM_VERSION_STRING);
+		if (not_modified(req, etag, mtime))
+		{
+			auto res = make_response<http::empty_body>(http::status::not_modified, req);
+			set_fields(res);
+			res.erase(http::field::content_type);
+			return send(std::move(res));
+		}
 
-		// override content type for file extension
-		if (strlen(content_extension) > 0)
-			res.set(http::field::content_type, sutil::mime_type(content_extension));
-		else
-			res.set(http::field::content_type, sutil::mime_type(file_path));
+		// Range only applies to GET
+		std::vector<byte_range> ranges;
+		auto const range = req.method() == http::verb::get && if_range_matches(req, etag, mtime)
+			? parse_range(req[http::field::range], size, ranges)
+			: range_status::full;
+
+		if (range == range_status::unsatisfiable)
+		{
+			auto res = make_response<http::empty_body>(http::status::range_not_satisfiable, req);
+			res.set(http::field::server, ADAM_VERSION_STRING);
+			res.set(http::field::content_range, "bytes */" + std::to_string(size));
+			res.content_length(0);
+			res.keep_alive(keep_alive(req));
+			return send(std::move(res));
+		}
 
+		// Respond to HEAD request
+		if (req.method() == http::verb::head)
+		{
+			auto res = make_response<http::empty_body>(http::status::ok, req);
+			set_fields(res);
+			res.content_length(size);
+			return send(std::move(res));
+		}
+
+#ifdef ADAM_USE_SENDFILE
+		// Respond with the header only, the session sends the body
+		file_response file_res{ make_response<http::empty_body>(http::status::ok, req), std::move(body), 0, size, 0, nullptr };
+		auto& res = file_res.header;
+
+		// A single range is sent with sendfile too
+		if (range == range_status::partial && ranges.size() == 1)
+		{
+			auto const r = ranges.front();
+			file_res.first = file_res.offset = r.first;
+			file_res.end = r.last + 1;
+
+			res.result(http::status::partial_content);
+			res.set(http::field::content_range, content_range(r, size));
+		}
+		else if (range == range_status::partial)
+#else
+		if (range == range_status::partial)
+#endif
+		{
+			// Only the slices of the file are read
+			auto parts_res = make_response<file_range_body>(http::status::partial_content, req);
+			set_fields(parts_res);
+
+#ifdef ADAM_USE_SENDFILE
+			parts_res.body().file = std::move(file_res.body.file());
+#else
+			parts_res.body().file = std::move(body.file());
+#endif
+			set_ranges(parts_res, ranges, size, content_type);
+			return send(std::move(parts_res));
+		}
+
+#ifndef ADAM_USE_SENDFILE
+		// Respond to GET request
+		auto res = make_response<http::file_body>(http::status::ok, req, std::move(body));
+#endif
+
+		set_fields(res);
+
+#ifdef ADAM_USE_SENDFILE
+		res.content_length(file_res.end - file_res.first);
+		return send(std::move(file_res));
+#else
 		res.content_length(size);
-		res.keep_alive(req.keep_alive());
 		return send(std::move(res));
+#endif
 	}
 
 
@@ -133,8 +554,81 @@ namespace server_async {
 	
 	
 
-	// Handles an HTTP server connection
-	class session : public std::enable_shared_from_this<session>
+	class session;
+	class listener;
+
+	// A connection runs on a strand in both modes, of the single threaded
+	// io_context in per thread mode. Unlike any_io_executor it is not
+	// type-erased, which would allocate to dispatch each completion
+	using session_executor = net::strand<net::io_context::executor_type>;
+	using session_stream = beast::basic_stream<tcp, session_executor>;
+
+	// Open connections of one listener, linked through their sessions so
+	// that tracking one allocates nothing. Each per thread listener has
+	// its own, the lock is for the sessions released on another thread.
+	class connection_list {
+	private:
+		std::mutex mutex_;
+		session* head_ = nullptr;
+
+	public:
+		void add(session& s);
+		void remove(session& s);
+
+		// Called on the listener's executor when the drain deadline passes
+		void close_all();
+	};
+
+	// Read, write and idle deadlines of the connections, one wheel per thread.
+	// Only the shared mode, where a connection runs on any thread, locks them
+	using connection_timers = timer_wheel<optional_mutex>;
+
+	// What stop() needs to reach from another thread
+	struct server_state {
+		// Set once by stop(), the next response of every connection closes it
+		std::atomic<bool> draining{ false };
+
+		// Open connections of all listeners, they are listed by their own
+		std::atomic<std::size_t> connections{ 0 };
+
+		std::mutex mutex;
+		std::condition_variable drained;
+		std::vector<net::io_context*> contexts;
+		std::vector<std::shared_ptr<listener>> listeners;
+
+		// Waits for the connections to finish, then stops the io_contexts
+		std::thread drainer;
+
+		// returns false if the server was stopped before it started
+		bool attach(net::io_context& ioc, std::shared_ptr<listener> const& l);
+
+		// called before the io_contexts are destroyed,
+		// the listeners must not outlive them
+		void detach();
+
+		void opened();
+		void closed();
+
+		// Listeners that stopped accepting at the connection limit,
+		// counted so closed() only locks when there are any
+		std::vector<std::shared_ptr<listener>> paused;
+		std::atomic<std::size_t> num_paused{ 0 };
+
+		// returns true if l must stop accepting, it is resumed
+		// once a connection closes
+		bool pause(std::shared_ptr<listener> const& l);
+
+		void drain(std::chrono::steady_clock::time_point deadline);
+
+		// Detaches on every way out of a start function
+		struct detach_guard {
+			server_state& state;
+			~detach_guard() { state.detach(); }
+		};
+	};
+
+	// Handles an HTTP server connection, then the next one its listener accepts
+	class session : public pooled_session<session>
 	{
 	public:
 		// This is the C++11 equivalent of a generic lambda.
@@ -145,92 +639,925 @@ namespace server_async {
 
 			explicit send_lambda(session& self) : self_(self) {}
 
+			// Messages are written by the session once the responses
+			// queued before them have been sent.
 			template<bool isRequest, class Body, class Fields>
 			void operator()(http::message<isRequest, Body, Fields>&& msg) const
 			{
 				// The lifetime of the message has to extend
 				// for the duration of the async operation so
-				// we use a shared_ptr to manage it.
-				auto sp = std::make_shared<
-					http::message<isRequest, Body, Fields>>(std::move(msg));
+				// it is stored in the session's response slot.
+				self_.record(self_.res_record_, msg.result_int());
+				if (self_.closing())
+					msg.keep_alive(false);
+				self_.res_.template emplace<http::message<isRequest, Body, Fields>>(std::move(msg));
+			}
+
+			void operator()(file_response&& msg) const
+			{
+				self_.record(self_.res_record_, msg.header.result_int());
+				if (self_.closing())
+					msg.header.keep_alive(false);
+				self_.res_.template emplace<file_response>(std::move(msg));
+			}
+
+			void operator()(template_response&& msg) const
+			{
+				auto const keep = msg.keep_alive && !self_.closing();
+				auto const& header = msg.header.get(keep);
+
+				auto& q = self_.queue_[self_.queued_++];
+				self_.record(q.record, static_cast<unsigned>(header.status()));
+
+				// Reuse the entry's buffer so a steady connection does not allocate
+				q.body.clear();
+				for (auto const part : msg.body)
+					q.body.append(part.data(), part.size());
+
+				q.tail.set(q.body.size());
+				q.buffers = { http_version(self_.version()), header.head(), q.tail.buffer(), net::buffer(q.body) };
+
+				// HEAD responses keep the Content-Length of the body they leave out
+				if (self_.is_head())
+					q.buffers[3] = net::const_buffer{};
 
-				// Store a type-erased version of the shared
-				// pointer in the class to keep it alive.
-				self_.res_ = sp;
+				self_.close_ = self_.close_ || !keep;
+			}
+
+			void operator()(cached_response&& msg) const
+			{
+				auto const keep = msg.keep_alive && !self_.closing();
+
+				auto& q = self_.queue_[self_.queued_++];
+				self_.record(q.record, msg.status);
 
-				// Write the response
-				http::async_write(self_.stream_, *sp,
-					beast::bind_front_handler(&session::on_write, self_.shared_from_this(), sp->need_eof()));
+				// The cache entry owns the buffers
+				q.file = std::move(msg.file);
+				q.tail.set_date();
+
+				if (msg.head.empty())
+				{
+					auto const& header = keep ? q.file->header_keep_alive : q.file->header_close;
+					q.buffers = { http_version(self_.version()), net::buffer(header), q.tail.buffer(), net::buffer(q.file->body) };
+				}
+				else
+				{
+					q.body.assign(msg.head);
+
+					// cached_head ends with the Connection field it was made for
+					if (msg.keep_alive && !keep)
+					{
+						q.body.resize(q.body.size() - std::string_view("Connection: keep-alive\r\n").size());
+						q.body.append("Connection: close\r\n");
+					}
+					// A multipart body is kept with the entry until written, the cache entry holds any other
+					if (!msg.parts.empty())
+					{
+						q.parts = std::move(msg.parts);
+						msg.body = q.parts;
+					}
+					q.buffers = { http_version(self_.version()), net::buffer(q.body), q.tail.buffer(), net::buffer(msg.body.data(), msg.body.size()) };
+				}
+
+				if (self_.is_head())
+					q.buffers[3] = net::const_buffer{};
+
+				self_.close_ = self_.close_ || !keep;
 			}
 		};
 
 	private:
 
-		beast::tcp_stream stream_;
+		// Most pipelined requests answered with one write
+		static constexpr std::size_t max_pipeline = 16;
+
+		// Largest request body read into memory
+		static constexpr std::uint64_t max_body = 1024 * 1024;
+
+		// Size of the pieces a streamed request body is read in
+		static constexpr std::size_t chunk_size = 64 * 1024;
+
+		// What is counted and logged once a response is written
+		struct response_record {
+			std::size_t route = metrics::no_route;
+			unsigned status = 0;
+			metrics::clock::time_point start;
+
+			// only kept while the access log is on
+			beast::string_view method;
+			std::string target;
+		};
+
+		// An in-memory response waiting to be written
+		struct queued_response {
+			response_record record;
+			std::string body;
+			std::string parts;
+			response_tail tail;
+			std::shared_ptr<cached_file const> file;
+			std::array<net::const_buffer, 4> buffers;
+		};
+
+		// The pending read or write, declared before the stream they are on
+		handler_memory handlers_;
+
+		session_stream stream_;
 		beast::flat_buffer buffer_;
-		beast_request req_;
-		std::shared_ptr<void> res_;
+
+		// Holds the request and the response, declared before them so it outlives them
+		session_memory memory_;
+		std::optional<http::request_parser<session_string_body, session_allocator>> parser_;
+
+		// Used instead of parser_ when the route streams the request body
+		std::optional<http::request_parser<http::buffer_body, session_allocator>> stream_parser_;
+		std::unique_ptr<char[]> chunk_;
+
+		// The request being answered and its route
+		beast_header const* req_ = nullptr;
+		route const* route_ = nullptr;
+		route_match match_;
+
+		// When the header of the request being answered was read
+		metrics::clock::time_point start_;
+
+		response_slot res_;
+		response_record res_record_;
+		std::array<queued_response, max_pipeline> queue_;
+		std::array<net::const_buffer, 4 * max_pipeline> queue_buffers_;
+		std::size_t queued_ = 0;
+		bool close_ = false;
+		bool writing_ = false;
+
+		// A handler took the response with defer()
+		bool deferred_ = false;
+
+		// The route whose in-flight count holds the request being answered
+		route const* admitted_ = nullptr;
+
+		// Rate limiter key of the remote address
+		std::uint64_t client_ = 0;
+
+		// Between run() and reset()
+		bool open_ = false;
+
+		// A deferred response that arrived while a write was in progress
+		std::function<void()> on_written_;
+
 		send_lambda lambda_;
 
+		std::shared_ptr<server_state> state_;
+
+		// The listener's open connections, linked while open_
+		friend class connection_list;
+		std::shared_ptr<connection_list> connections_;
+		session* prev_open_ = nullptr;
+		session* next_open_ = nullptr;
+
+		// Closes the connection when an operation takes too long
+		std::shared_ptr<connection_timers> timers_;
+		connection_timers::entry timeout_;
+
+		static constexpr auto timeout = std::chrono::seconds(30);
+
+		// Longest wait for a deferred response before the client gets a 503
+		static constexpr auto deferred_timeout = std::chrono::seconds(30);
+
 	public:
-		// Take ownership of the stream
-		session(tcp::socket&& socket)
-			: stream_(std::move(socket)), lambda_(*this) {}
+		// Made by the listener's pool, the connection is accepted into socket()
+		session(
+			session_executor ex,
+			std::shared_ptr<server_state> state,
+			std::shared_ptr<connection_list> connections,
+			std::shared_ptr<connection_timers> timers)
+			: stream_(std::move(ex))
+			, lambda_(*this)
+			, state_(std::move(state))
+			, connections_(std::move(connections))
+			, timers_(std::move(timers))
+			, timeout_(*timers_)
+		{
+			// The entry is a member, so this is never called on a destroyed session.
+			// self is moved so the wheel never holds the last reference.
+			timeout_.on_expire([this]
+			{
+				if (auto self = try_self())
+					net::post(stream_.get_executor(),
+						[self = std::move(self)] { self->on_timeout(); });
+			});
+		}
+
+		session_stream::socket_type& socket()
+		{
+			return stream_.socket();
+		}
 
-		// Start the asynchronous operation
+		// Called from any thread when the server stops
+		void force_close()
+		{
+			net::post(stream_.get_executor(),
+				[self = self()] { self->stream_.close(); });
+		}
+
+		// Start the asynchronous operation on the accepted connection
 		void run()
 		{
+			open_ = true;
+			metrics::connection_opened();
+			state_->opened();
+			connections_->add(*this);
+
+			client_ = 0;
+			if (rate_limits.enabled())
+			{
+				beast::error_code ec;
+				auto const remote = stream_.socket().remote_endpoint(ec);
+				if (!ec)
+					client_ = rate_limiter::key(remote.address());
+			}
+
 			do_read();
 		}
 
+		// Called by the pool with the last reference. Closes the connection
+		// and forgets it, the buffers keep their memory for the next one.
+		bool reset()
+		{
+			timeout_.cancel();
+			release();
+			stream_.close();
+
+			// The messages go before the memory they were made from
+			parser_.reset();
+			stream_parser_.reset();
+			res_ = std::monostate{};
+			memory_.reset();
+
+			buffer_.clear();
+			for (auto& q : queue_)
+			{
+				q.file = nullptr;
+				std::string().swap(q.parts);
+			}
+
+			req_ = nullptr;
+			route_ = nullptr;
+			queued_ = 0;
+			close_ = false;
+			writing_ = false;
+			deferred_ = false;
+			on_written_ = nullptr;
+
+			if (std::exchange(open_, false))
+			{
+				connections_->remove(*this);
+				state_->closed();
+				metrics::connection_closed();
+			}
+
+			return true;
+		}
+
+		void on_timeout()
+		{
+			// Armed again since it expired
+			if (timeout_.armed())
+				return;
+
+			// A handler is computing the response, no I/O is pending. The client
+			// is told the server is busy and the response that comes later is dropped
+			if (deferred_ && !writing_)
+			{
+				deferred_ = false;
+				close_ = true;
+				send_unavailable(*req_, lambda_);
+				return flush();
+			}
+
+			// The pending operation completes with operation_aborted
+			stream_.close();
+		}
+
 		void do_read()
 		{
-			// Make the request empty before reading,
-			// otherwise the operation behavior is undefined.
-			req_ = {};
+			// A parser that already holds part of the next
+			// request keeps it, otherwise start a new one.
+			if (!parser_ || parser_->is_done())
+				new_parser();
 
 			// Set the timeout.
-			stream_.expires_after(std::chrono::seconds(30));
+			timeout_.arm(timeout);
+
+			if (parser_->is_header_done())
+				return read_body();
 
-			// Read a request
-			http::async_read(stream_, buffer_, req_,
-				beast::bind_front_handler(&session::on_read, shared_from_this()));
+			// Read the header first, the route decides how the body is read
+			http::async_read_header(stream_, buffer_, *parser_,
+				bind_memory(handlers_, beast::bind_front_handler(&session::on_read_header, self())));
 		}
 
-		void on_read(beast::error_code ec, std::size_t bytes_transferred)
+		void on_read_header(beast::error_code ec, std::size_t bytes_transferred)
 		{
-			boost::ignore_unused(bytes_transferred);
-
 			// This means they closed the connection
 			if (ec == http::error::end_of_stream)
 				return do_close();
 
 			if (ec)
-				return sutil::fail(ec, "read");
+				return sutil::fail(ec, "read");
+
+			start_ = metrics::clock::now();
+			metrics::add_bytes_in(bytes_transferred);
+
+			if (!find_request_route())
+			{
+				reject_body();
+				return flush();
+			}
+
+			if (parser_->is_done() && !is_streamed())
+				return handle_requests();
+
+			read_body();
+		}
+
+		void new_parser()
+		{
+			// The previous request is answered, its memory is reused
+			// once no response made from it is waiting to be written
+			parser_.reset();
+			stream_parser_.reset();
+			if (std::holds_alternative<std::monostate>(res_))
+				memory_.reset();
+
+			parser_.emplace(std::piecewise_construct,
+				std::make_tuple(memory_.allocator()),
+				std::make_tuple(memory_.allocator()));
+
+			// The limit depends on the route, see find_request_route
+			parser_->body_limit((std::numeric_limits<std::uint64_t>::max)());
+		}
+
+		// Returns false if the body is too large to read into memory
+		bool find_request_route()
+		{
+			auto& req = parser_->get();
+			route_ = find_route(req.method(), req.target(), match_);
+
+			// A streamed body is limited by its handler
+			if (is_streamed())
+				return true;
+
+			parser_->body_limit(max_body);
+
+			auto const length = parser_->content_length();
+			return !length || *length <= max_body;
+		}
+
+		bool is_streamed() const
+		{
+			return route_ && route_->on_body;
+		}
+
+		// Queues a 413 for the request being parsed, its body is too
+		// large to read into memory. The connection closes once it is written
+		void reject_body()
+		{
+			sutil::fail(http::error::body_limit, "read");
+			req_ = &parser_->get();
+			close_ = true;
+			send_payload_too_large(lambda_);
+		}
+
+		// Once stop() is called every response closes its connection, also
+		// one for a request read before or deferred across the call.
+		// A response made after close_ is set says so as well
+		bool closing() const
+		{
+			return close_ || state_->draining.load(std::memory_order_relaxed);
+		}
+
+		bool is_head() const
+		{
+			return req_ && req_->method() == http::verb::head;
+		}
+
+		// Of the request being answered, written into pre-serialized heads
+		unsigned version() const
+		{
+			return req_ ? req_->version() : 11;
+		}
+
+		void read_body()
+		{
+			if (is_streamed())
+				return start_stream();
+
+			http::async_read(stream_, buffer_, *parser_,
+				bind_memory(handlers_, beast::bind_front_handler(&session::on_read, self())));
+		}
+
+		void on_read(beast::error_code ec, std::size_t bytes_transferred)
+		{
+			// A chunked body went past the limit
+			if (ec == http::error::body_limit)
+			{
+				reject_body();
+				return flush();
+			}
+
+			if (ec)
+				return sutil::fail(ec, "read");
+
+			metrics::add_bytes_in(bytes_transferred);
+
+			handle_requests();
+		}
+
+		// Answer the request just read and any complete requests pipelined
+		// behind it, then write the responses together.
+		void handle_requests()
+		{
+			for (;;)
+			{
+				auto const& req = parser_->get();
+				req_ = &req;
+				if (!allowed(req))
+					send_too_many_requests(req, lambda_);
+				else if (admit())
+					handle_request(req, req.body(), lambda_, route_, match_);
+				else
+					send_unavailable(req, lambda_);
+
+				// A message is written on its own after the queue,
+				// and a deferred response must be written before any that follow
+				if (!std::holds_alternative<std::monostate>(res_) || deferred_)
+					break;
+
+				if (close_ || queued_ == max_pipeline || !parse_buffered())
+					break;
+			}
+
+			flush();
+		}
+
+		// Returns true if buffer_ held another complete request
+		// whose body is not streamed
+		bool parse_buffered()
+		{
+			if (buffer_.size() == 0)
+				return false;
+
+			new_parser();
+
+			beast::error_code ec;
+			while (!parser_->is_done())
+			{
+				auto const n = parser_->put(buffer_.data(), ec);
+				buffer_.consume(n);
+				metrics::add_bytes_in(n);
+
+				// The rest arrives with the next read
+				if (ec == http::error::need_more)
+					return false;
+
+				if (ec == http::error::body_limit)
+				{
+					reject_body();
+					return false;
+				}
+
+				if (ec)
+				{
+					sutil::fail(ec, "read");
+					close_ = true;
+					return false;
+				}
+
+				if (n == 0)
+					return false;
+
+				if (parser_->is_header_done() && !parser_->eager())
+				{
+					start_ = metrics::clock::now();
+
+					if (!find_request_route())
+					{
+						reject_body();
+						return false;
+					}
+
+					// The body is read after the queued responses are written
+					if (is_streamed())
+						return false;
+
+					parser_->eager(true);
+				}
+			}
+
+			return true;
+		}
+
+		//======= STREAMED REQUEST BODY ===========================
+
+		void start_stream()
+		{
+			stream_parser_.emplace(std::move(*parser_));
+			parser_.reset();
+
+			// The header moved, so match again
+			auto const& req = stream_parser_->get();
+			req_ = &req;
+			route_ = find_route(req.method(), req.target(), match_);
+
+			// The body is left unread, so the connection cannot be used again
+			if (!allowed(req))
+			{
+				close_ = true;
+				send_too_many_requests(req, lambda_);
+				return flush();
+			}
+
+			if (!admit())
+			{
+				close_ = true;
+				send_unavailable(req, lambda_);
+				return flush();
+			}
+
+			if (!chunk_)
+				chunk_ = std::make_unique<char[]>(chunk_size);
+
+			read_chunk();
+		}
+
+		void read_chunk()
+		{
+			if (stream_parser_->is_done())
+				return on_chunk({});
+
+			auto& body = stream_parser_->get().body();
+			body.data = chunk_.get();
+			body.size = chunk_size;
+
+			timeout_.arm(timeout);
+
+			http::async_read_some(stream_, buffer_, *stream_parser_,
+				bind_memory(handlers_, beast::bind_front_handler(&session::on_read_chunk, self())));
+		}
+
+		void on_read_chunk(beast::error_code ec, std::size_t bytes_transferred)
+		{
+			// chunk_ is full
+			if (ec == http::error::need_buffer)
+				ec = {};
+
+			if (ec)
+				return sutil::fail(ec, "read");
+
+			metrics::add_bytes_in(bytes_transferred);
+
+			on_chunk({ chunk_.get(), chunk_size - stream_parser_->get().body().size });
+		}
+
+		void on_chunk(std::string_view chunk)
+		{
+			auto const last = stream_parser_->is_done();
+			handle_body(*req_, chunk, last, lambda_, *route_, match_);
+
+			if (!last)
+				return read_chunk();
+
+			// The handler answered with the last piece
+			flush();
+		}
+
+		//======= WRITING RESPONSES ===========================
+
+		void flush()
+		{
+			if (queued_ > 0 || !std::holds_alternative<std::monostate>(res_))
+				timeout_.arm(timeout);
+
+			if (queued_ > 0)
+			{
+				auto it = queue_buffers_.begin();
+				for (std::size_t i = 0; i < queued_; ++i)
+					it = std::copy(queue_[i].buffers.begin(), queue_[i].buffers.end(), it);
+
+				// Unused entries are empty and write nothing
+				std::fill(it, queue_buffers_.end(), net::const_buffer{});
+
+				writing_ = true;
+				return net::async_write(stream_, queue_buffers_,
+					bind_memory(handlers_, beast::bind_front_handler(&session::on_flush, self())));
+			}
+
+			if (!std::holds_alternative<std::monostate>(res_))
+			{
+				writing_ = true;
+				return std::visit([this](auto& res) { write_response(res); }, res_);
+			}
+
+			if (close_)
+				return do_close();
+
+			// Wait for the responder
+			if (deferred_)
+				return timeout_.arm(deferred_timeout);
+
+			do_read();
+		}
+
+		void on_flush(beast::error_code ec, std::size_t bytes_transferred)
+		{
+			writing_ = false;
+
+			if (ec)
+				return sutil::fail(ec, "write");
+
+			metrics::add_bytes_out(bytes_transferred);
+
+			// Release the cached files and multipart bodies
+			for (std::size_t i = 0; i < queued_; ++i)
+			{
+				queue_[i].file = nullptr;
+				std::string().swap(queue_[i].parts);
+				written(queue_[i].record, net::buffer_size(queue_[i].buffers));
+			}
+
+			queued_ = 0;
+
+			if (close_)
+			{
+				// This means we should close the connection, usually because
+				// the response indicated the "Connection: close" semantic.
+				return do_close();
+			}
+
+			if (on_written_)
+				return std::exchange(on_written_, nullptr)();
+
+			// Write the message that followed the queue or read again
+			flush();
+		}
+
+		void write_response(std::monostate&) {}
+
+		void write_response(file_response& res)
+		{
+			// Write the header, the body follows in on_write_header
+			http::async_write(stream_, res.header,
+				bind_memory(handlers_, beast::bind_front_handler(&session::on_write_header, self())));
+		}
+
+		template<class Body, class Fields>
+		void write_response(http::response<Body, Fields>& res)
+		{
+			http::async_write(stream_, res,
+				bind_memory(handlers_, beast::bind_front_handler(&session::on_write, self(), res.need_eof())));
+		}
+
+		void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred)
+		{
+			writing_ = false;
+
+			if (ec)
+				return sutil::fail(ec, "write");
+
+			metrics::add_bytes_out(bytes_transferred);
+			written(res_record_, bytes_transferred);
+
+			if (close)
+			{
+				// This means we should close the connection, usually because
+				// the response indicated the "Connection: close" semantic.
+				return do_close();
+			}
+
+			// We're done with the response so release it
+			res_ = std::monostate{};
+
+			if (on_written_)
+				return std::exchange(on_written_, nullptr)();
+
+			// Read another request
+			do_read();
+		}
+
+		// Takes a token from the client's bucket, false if it is over its rate
+		bool allowed(beast_header const& req) const
+		{
+			if (!rate_limits.enabled())
+				return true;
+
+			if (!rate_key_field.empty())
+			{
+				auto const key = req[rate_key_field];
+				if (!key.empty())
+					return rate_limits.allow(rate_limiter::key(key));
+			}
+
+			return rate_limits.allow(client_);
+		}
+
+		// Counts the request against the limit of its route,
+		// false if the route has too many in flight
+		bool admit()
+		{
+			if (admission.max_route_requests == 0 || !route_)
+				return true;
+
+			auto& in_flight = *route_->in_flight;
+			if (in_flight.fetch_add(1, std::memory_order_relaxed) >= admission.max_route_requests)
+			{
+				in_flight.fetch_sub(1, std::memory_order_relaxed);
+				return false;
+			}
+
+			admitted_ = route_;
+			return true;
+		}
+
+		void release()
+		{
+			if (admitted_)
+				std::exchange(admitted_, nullptr)->in_flight->fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		// Also ends the request's admission, its response is made
+		void record(response_record& r, unsigned status)
+		{
+			release();
+
+			r.route = route_ ? route_->metrics_id : metrics::no_route;
+			r.status = status;
+			r.start = start_;
+
+			// The request is gone by the time the response is written
+			if (server_log::access_enabled())
+			{
+				r.method = req_->method_string();
+				r.target.assign(req_->target().data(), req_->target().size());
+			}
+		}
+
+		static void written(response_record const& r, std::size_t bytes)
+		{
+			metrics::record_request(r.route, r.status, r.start);
+
+			if (!server_log::access_enabled())
+				return;
+
+			auto const latency = std::chrono::duration_cast<std::chrono::microseconds>(metrics::clock::now() - r.start);
+			server_log::access(
+				{ r.method.data(), r.method.size() }, r.target, r.status, bytes,
+				static_cast<std::uint64_t>(latency.count()));
+		}
+
+		void defer()
+		{
+			deferred_ = true;
+		}
+
+		// Runs on the connection's executor.
+		// respond is called with the deferred request and the send lambda.
+		template<class Respond>
+		void complete(Respond&& respond)
+		{
+			auto run = [this, respond = std::forward<Respond>(respond)]
+			{
+				// Answered by on_timeout
+				if (!deferred_)
+					return;
+
+				deferred_ = false;
+				respond(*req_, lambda_);
+				flush();
+			};
+
+			if (writing_)
+				on_written_ = std::move(run);
+			else
+				run();
+		}
+
+		session_executor get_executor()
+		{
+			return stream_.get_executor();
+		}
+
+		void on_write_header(beast::error_code ec, std::size_t bytes_transferred)
+		{
+			if (ec)
+				return sutil::fail(ec, "write");
+
+#ifdef ADAM_USE_SENDFILE
+			do_sendfile(bytes_transferred);
+#else
+			do_write_file(bytes_transferred);
+#endif
+		}
+
+#ifdef ADAM_USE_SENDFILE
+		void do_sendfile(std::size_t bytes_transferred)
+		{
+			auto const res = &std::get<file_response>(res_);
+			auto& socket = stream_.socket();
+			auto const size = res->end;
+
+			// sendfile must not block the thread
+			beast::error_code ec;
+			socket.non_blocking(true, ec);
+			if (ec)
+				return sutil::fail(ec, "sendfile");
+
+			while (res->offset < size)
+			{
+				off_t offset = static_cast<off_t>(res->offset);
+				auto const count = static_cast<std::size_t>(std::min<std::uint64_t>(size - res->offset, 1 << 30));
+				auto const n = ::sendfile(socket.native_handle(), res->body.file().native_handle(), &offset, count);
+
+				if (n > 0)
+				{
+					res->offset = static_cast<std::uint64_t>(offset);
+					bytes_transferred += static_cast<std::size_t>(n);
+					continue;
+				}
+
+				if (n < 0 && errno == EINTR)
+					continue;
+
+				// Wait until the socket can take more data
+				if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				{
+					// Each step of a long download gets the full timeout
+					timeout_.arm(timeout);
+					return socket.async_wait(tcp::socket::wait_write,
+						bind_memory(handlers_, beast::bind_front_handler(&session::on_sendfile_wait, self(), bytes_transferred)));
+				}
+
+				// The file system does not support sendfile, copy through userspace instead
+				if (n < 0 && res->offset == res->first && (errno == EINVAL || errno == ENOSYS))
+				{
+					socket.non_blocking(false, ec);
+					return do_write_file(bytes_transferred);
+				}
+
+				// The file was truncated while sending
+				if (n == 0)
+					return sutil::fail(net::error::eof, "sendfile");
+
+				return sutil::fail(beast::error_code(errno, beast::system_category()), "sendfile");
+			}
+
+			socket.non_blocking(false, ec);
+			on_write(res->header.need_eof(), ec, bytes_transferred);
+		}
+
+		void on_sendfile_wait(std::size_t bytes_transferred, beast::error_code ec)
+		{
+			if (ec)
+				return sutil::fail(ec, "sendfile");
+
+			do_sendfile(bytes_transferred);
+		}
+#endif
+
+		void do_write_file(std::size_t bytes_transferred)
+		{
+			auto const res = &std::get<file_response>(res_);
+			auto const size = res->end;
+			if (res->offset == size)
+				return on_write(res->header.need_eof(), {}, bytes_transferred);
+
+			if (!res->buffer)
+				res->buffer = std::make_unique<char[]>(file_response::buffer_size);
+
+			beast::error_code ec;
+			res->body.file().seek(res->offset, ec);
+			if (ec)
+				return sutil::fail(ec, "write_file");
+
+			auto const count = static_cast<std::size_t>(std::min<std::uint64_t>(size - res->offset, file_response::buffer_size));
+			auto const n = res->body.file().read(res->buffer.get(), count, ec);
+			if (ec)
+				return sutil::fail(ec, "write_file");
+
+			if (n == 0)
+				return sutil::fail(net::error::eof, "write_file");
+
+			res->offset += n;
 
-			// Send the response
-			handle_request(std::move(req_), lambda_);
+			timeout_.arm(timeout);
+			net::async_write(stream_, net::buffer(res->buffer.get(), n),
+				bind_memory(handlers_, beast::bind_front_handler(&session::on_write_file, self(), bytes_transferred)));
 		}
 
-		void on_write(bool close, beast::error_code ec, std::size_t bytes_transferred)
+		void on_write_file(std::size_t total, beast::error_code ec, std::size_t bytes_transferred)
 		{
-			boost::ignore_unused(bytes_transferred);
-
 			if (ec)
 				return sutil::fail(ec, "write");
 
-			if (close)
-			{
-				// This means we should close the connection, usually because
-				// the response indicated the "Connection: close" semantic.
-				return do_close();
-			}
-
-			// We're done with the response so delete it
-			res_ = nullptr;
-
-			// Read another request
-			do_read();
+			do_write_file(total + bytes_transferred);
 		}
 
 		void do_close()
@@ -250,13 +1577,36 @@ namespace server_async {
 	{
 		net::io_context& ioc_;
 		tcp::acceptor acceptor_;
+		bool per_thread_;
+		std::shared_ptr<server_state> state_;
+
+		// New sessions take the wheels in turn
+		std::vector<std::shared_ptr<connection_timers>> timers_;
+		std::size_t next_timers_ = 0;
+
+		// Sessions of closed connections, accepted into again
+		std::shared_ptr<session_pool<session>> sessions_ = std::make_shared<session_pool<session>>();
+
+		// Sessions of open connections
+		std::shared_ptr<connection_list> connections_ = std::make_shared<connection_list>();
+
+		// The session the pending accept is for
+		boost::intrusive_ptr<session> next_;
 
 	public:
+		// per_thread: the io_context is only run by one thread,
+		// so connections need no strand and the port is shared with SO_REUSEPORT
 		listener(
 			net::io_context& ioc,
-			tcp::endpoint endpoint)
+			tcp::endpoint endpoint,
+			std::shared_ptr<server_state> state,
+			std::vector<std::shared_ptr<connection_timers>> timers,
+			bool per_thread = false)
 			: ioc_(ioc)
 			, acceptor_(net::make_strand(ioc))
+			, per_thread_(per_thread)
+			, state_(std::move(state))
+			, timers_(std::move(timers))
 		{
 			beast::error_code ec;
 
@@ -276,6 +1626,20 @@ namespace server_async {
 				return;
 			}
 
+#ifdef SO_REUSEPORT
+			// Let the kernel balance connections across the per thread acceptors
+			if (per_thread_)
+			{
+				using reuse_port = net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>;
+				acceptor_.set_option(reuse_port(true), ec);
+				if (ec)
+				{
+					sutil::fail(ec, "set_option");
+					return;
+				}
+			}
+#endif
+
 			// Bind to the server address
 			acceptor_.bind(endpoint, ec);
 			if (ec)
@@ -299,93 +1663,522 @@ namespace server_async {
 			do_accept();
 		}
 
+		// Called from any thread when the server stops
+		void stop()
+		{
+			net::post(acceptor_.get_executor(),
+				[self = shared_from_this()]
+				{
+					beast::error_code ec;
+					self->acceptor_.close(ec);
+				});
+		}
+
+		// Called from any thread when the drain deadline passes
+		void close_connections()
+		{
+			net::post(acceptor_.get_executor(),
+				[self = shared_from_this()] { self->connections_->close_all(); });
+		}
+
+		// Called from any thread when a connection closes after pause
+		void resume()
+		{
+			net::post(acceptor_.get_executor(),
+				[self = shared_from_this()] { self->do_accept(); });
+		}
+
 	private:
 		void do_accept()
 		{
-			// The new connection gets its own strand
-			acceptor_.async_accept(net::make_strand(ioc_),
+			// A session that failed to accept is kept for the next try
+			if (!next_)
+			{
+				next_ = sessions_->acquire([this]
+				{
+					auto const& timers = timers_[next_timers_++ % timers_.size()];
+
+					// Each session gets its own strand, in per thread mode on this thread
+					return new session(net::make_strand(ioc_), state_, connections_, timers);
+				});
+			}
+
+			acceptor_.async_accept(next_->socket(),
 				beast::bind_front_handler(&listener::on_accept, shared_from_this()));
 		}
 
-		void on_accept(beast::error_code ec, tcp::socket socket)
+		void on_accept(beast::error_code ec)
 		{	
+			// stop() closed the acceptor
+			if (!acceptor_.is_open())
+				return;
+
 			if (ec)
 			{
 				sutil::fail(ec, "accept");
 			}
 			else
 			{
-				// Create the session and run it
-				std::make_shared<session>(std::move(socket))->run();
+				// Run the session, the next accept takes another
+				auto const s = std::move(next_);
+				s->run();
 			}
 
+			// At the connection limit new clients wait in the listen backlog
+			// instead of slowing down the ones already served
+			if (state_->pause(shared_from_this()))
+				return;
+
 			// Accept another connection
 			do_accept();
 		}
 	};
 
+	// Bind the calling thread to a single cpu
+	void pin_thread(unsigned index) {
+#ifdef __linux__
+		auto const num_cpus = std::max(1u, std::thread::hardware_concurrency());
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(index % num_cpus, &cpus);
+
+		auto const rc = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+		if (rc != 0)
+			sutil::fail(beast::error_code(rc, beast::system_category()), "pin_thread");
+#else
+		boost::ignore_unused(index);
+#endif
+	}
+
+	//======= SERVER STATE ===========================
+
+	bool server_state::attach(net::io_context& ioc, std::shared_ptr<listener> const& l)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (draining)
+			return false;
+
+		contexts.push_back(&ioc);
+		listeners.push_back(l);
+		return true;
+	}
+
+	void server_state::detach()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			contexts.clear();
+			listeners.clear();
+			paused.clear();
+		}
+
+		if (drainer.joinable())
+			drainer.join();
+	}
+
+	void server_state::opened()
+	{
+		connections.fetch_add(1);
+	}
+
+	void server_state::closed()
+	{
+		if (connections.fetch_sub(1) == 1 && draining)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			drained.notify_all();
+		}
+
+		// Either this sees the listener pause() added, or pause() sees this close
+		if (num_paused.load() == 0)
+			return;
+
+		// One connection closed, so one listener may accept one more
+		std::shared_ptr<listener> resumed;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!paused.empty() && connections.load() < admission.max_connections)
+			{
+				resumed = std::move(paused.back());
+				paused.pop_back();
+				num_paused.store(paused.size());
+			}
+		}
+
+		if (resumed)
+			resumed->resume();
+	}
+
+	bool server_state::pause(std::shared_ptr<listener> const& l)
+	{
+		if (admission.max_connections == 0 || connections.load() < admission.max_connections)
+			return false;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		paused.push_back(l);
+		num_paused.store(paused.size());
+
+		// A connection closed before it could see l paused
+		if (connections.load() < admission.max_connections)
+		{
+			paused.pop_back();
+			num_paused.store(paused.size());
+			return false;
+		}
+
+		return true;
+	}
+
+	void server_state::drain(std::chrono::steady_clock::time_point deadline)
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		auto const done = [this] { return connections.load() == 0; };
+
+		if (!drained.wait_until(lock, deadline, done))
+		{
+			// Each listener closes the connections left on its own executor
+			for (auto const& l : listeners)
+				l->close_connections();
+
+			// Give the closed sessions a moment to run their handlers
+			drained.wait_for(lock, std::chrono::seconds(1), done);
+		}
+
+		for (auto const ioc : contexts)
+			ioc->stop();
+	}
+
+	//======= CONNECTION LIST ===========================
+
+	void connection_list::add(session& s)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		s.prev_open_ = nullptr;
+		s.next_open_ = head_;
+		if (head_)
+			head_->prev_open_ = &s;
+		head_ = &s;
+	}
+
+	void connection_list::remove(session& s)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (s.prev_open_)
+			s.prev_open_->next_open_ = s.next_open_;
+		else
+			head_ = s.next_open_;
+
+		if (s.next_open_)
+			s.next_open_->prev_open_ = s.prev_open_;
+
+		s.prev_open_ = s.next_open_ = nullptr;
+	}
+
+	void connection_list::close_all()
+	{
+		// The last reference may go when open is destroyed, which needs the lock
+		std::vector<boost::intrusive_ptr<session>> open;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			// A session being recycled is waiting for the lock, try_self() skips it
+			for (auto s = head_; s; s = s->next_open_)
+			{
+				if (auto p = s->try_self())
+					open.push_back(std::move(p));
+			}
+		}
+
+		for (auto const& s : open)
+			s->force_close();
+	}
+
+	//----------------------------------
+
+	std::shared_ptr<server_state> Server::make_state() {
+		return std::make_shared<server_state>();
+	}
+
 	void Server::start() {
+		if (mode_ == thread_mode::per_thread)
+			start_per_thread();
+		else
+			start_shared();
+	}
+
+	void Server::stop(std::chrono::milliseconds deadline) {
+		auto const state = state_;
+
+		std::lock_guard<std::mutex> lock(state->mutex);
+		if (state->draining.exchange(true))
+			return;
+
+		for (auto const& l : state->listeners)
+			l->stop();
+
+		state->drainer = std::thread(
+			[state, until = std::chrono::steady_clock::now() + deadline]
+			{
+				state->drain(until);
+			});
+	}
+
+	void Server::start_shared() {
 		auto const address = net::ip::make_address(address_);
 
 		// The io_context is required for all I/O
 		net::io_context ioc{ threads_ };
+		server_state::detach_guard const detach{ *state_ };
+
+		// One timer wheel per thread, the connections are spread over them
+		std::vector<std::shared_ptr<connection_timers>> timers;
+		for (auto i = 0; i < threads_; ++i)
+		{
+			timers.push_back(std::make_shared<connection_timers>(ioc.get_executor(), connection_timers::default_tick, true));
+			timers.back()->start();
+		}
 
 		// Create and launch a listening port
-		std::make_shared<listener>(
+		auto const l = std::make_shared<listener>(
 			ioc,
-			tcp::endpoint{ address, port_ })->run();
+			tcp::endpoint{ address, port_ },
+			state_,
+			std::move(timers));
+
+		if (!state_->attach(ioc, l))
+			return;
+
+		l->run();
+
+		// A deferred response leaves no I/O pending, so only stop() ends run()
+		auto const work = net::make_work_guard(ioc);
 
 		// Run the I/O service on the requested number of threads
 		std::vector<std::thread> v;
 		v.reserve(threads_ - 1);
 		for (auto i = threads_ - 1; i > 0; --i)
 			v.emplace_back(
-				[&ioc]
+				[&ioc, i, this]
 				{
+					if (pin_threads_)
+						pin_thread(i);
+
 					ioc.run();
 				});
 
+		if (pin_threads_)
+			pin_thread(0);
+
 		ioc.run();
+
+		for (auto& t : v)
+			t.join();
+	}
+
+	void Server::start_per_thread() {
+#ifndef SO_REUSEPORT
+		// Without SO_REUSEPORT the acceptors cannot share the port
+		return start_shared();
+#else
+		auto const address = net::ip::make_address(address_);
+		auto const endpoint = tcp::endpoint{ address, port_ };
+
+		// Each thread runs its own io_context with its own listening port
+		// so connections never migrate between threads
+		std::vector<std::unique_ptr<net::io_context>> contexts;
+		std::vector<net::executor_work_guard<net::io_context::executor_type>> work;
+		contexts.reserve(threads_);
+		work.reserve(threads_);
+		server_state::detach_guard const detach{ *state_ };
+		for (auto i = 0; i < threads_; ++i)
+		{
+			contexts.push_back(std::make_unique<net::io_context>(1));
+
+			// The thread's connections are timed by its own wheel, which needs no lock
+			auto const timers = std::make_shared<connection_timers>(contexts.back()->get_executor(), connection_timers::default_tick, false);
+			timers->start();
+
+			auto const l = std::make_shared<listener>(*contexts.back(), endpoint, state_,
+				std::vector<std::shared_ptr<connection_timers>>{ timers }, true);
+			if (!state_->attach(*contexts.back(), l))
+				return;
+
+			l->run();
+
+			// A deferred response leaves no I/O pending, so only stop() ends run()
+			work.push_back(net::make_work_guard(*contexts.back()));
+		}
+
+		std::vector<std::thread> v;
+		v.reserve(threads_ - 1);
+		for (auto i = threads_ - 1; i > 0; --i)
+			v.emplace_back(
+				[&contexts, i, this]
+				{
+					if (pin_threads_)
+						pin_thread(i);
+
+					contexts[i]->run();
+				});
+
+		if (pin_threads_)
+			pin_thread(0);
+
+		contexts[0]->run();
+
+		for (auto& t : v)
+			t.join();
+#endif
 	}
 
 	//==============================================
 
 	// hide request and send types
 	struct request_type {
-		beast_request req;
+		beast_header const& req;
+		std::string_view body;
 		session::send_lambda send;
+		route_match const& match;
 	};
 
 	//==============================================
 
-	std::unordered_map <std::string, callback> api_map_get
-	{
-		{ "/", [](auto const& req) { send_text(req, "Server is running"); }},
+	struct responder_state {
+		boost::intrusive_ptr<session> connection;
+		std::atomic<bool> done{ false };
+
+		explicit responder_state(boost::intrusive_ptr<session> s)
+			: connection(std::move(s)) {}
+
+		// Post the response to the connection, only the first one is used
+		template<class Respond>
+		void complete(Respond&& respond)
+		{
+			if (done.exchange(true))
+				return;
+
+			// The reference goes with the response, so the connection is never
+			// released on a worker thread, away from its timer wheel
+			auto const ex = connection->get_executor();
+			net::post(ex,
+				[c = std::move(connection), respond = std::forward<Respond>(respond)]() mutable
+				{
+					c->complete(std::move(respond));
+				});
+		}
+
+		~responder_state()
+		{
+			complete([](auto const& req, auto const& send)
+			{
+				send_server_error(req, send, "The request was not answered");
+			});
+		}
+	};
+
+	worker_pool workers;
+
+	//==============================================
+
+	struct api_routes {
+		router<route> get;
+		router<route> head;
+		router<route> post;
+		router<route> put;
+		router<route> del;
 	};
 
+	api_routes api = [] {
+		api_routes a;
+		a.get.add("/", { [](auto const& req) { send_text(req, "Server is running"); }, nullptr, metrics::add_route("GET", "/") });
+		return a;
+	}();
+
 	//----------------------------------
 
+	route const* find_route(
+		http::verb method,
+		beast::string_view target,
+		route_match& match)
+	{
+		if (target.empty() || target[0] != '/')
+			return nullptr;
+
+		std::string_view const t{ target.data(), target.size() };
+
+		switch (method)
+		{
+		case http::verb::get:
+			return api.get.find(t, match);
+
+		case http::verb::head:
+			// HEAD falls back to the GET handler
+			if (auto const r = api.head.find(t, match))
+				return r;
+
+			return api.get.find(t, match);
+
+		case http::verb::post:
+			return api.post.find(t, match);
+
+		case http::verb::put:
+			return api.put.find(t, match);
+
+		case http::verb::delete_:
+			return api.del.find(t, match);
+
+		default:
+			return nullptr;
+		}
+	}
+
 	// This function produces an HTTP response for the given
 	// request. The type of the response object depends on the
 	// contents of the request, so the interface requires the
 	// caller to pass a generic lambda for receiving the response.
 	template<class Request, class Send>
-	void handle_request(Request&& req, Send&& send)
+	void handle_request(
+		Request const& req,
+		std::string_view body,
+		Send const& send,
+		route const* r,
+		route_match const& match)
 	{
 		// Make sure we can handle the method
-		if (req.method() != http::verb::get)
+		switch (req.method())
+		{
+		case http::verb::get:
+		case http::verb::head:
+		case http::verb::post:
+		case http::verb::put:
+		case http::verb::delete_:
+			break;
+
+		default:
 			return send_bad_request(req, send, "Unknown HTTP-method");
+		}
 		
 		if (req.target().empty() || req.target()[0] != '/')
 			return send_bad_request(req, send, "Illegal request-target");
 
-		auto key = std::string(req.target());
-
-		if (api_map_get.find(key) == api_map_get.end()) // C++20 contains
+		if (!r || !r->on_request)
 			return send_bad_request(req, send, "Bad request-target");
 
 		// call the requested function
-		return api_map_get[key](request_type{ req, send });
+		return r->on_request(request_type{ req, body, send, match });
+	}
+
+	template<class Request, class Send>
+	void handle_body(
+		Request const& req,
+		std::string_view chunk,
+		bool last,
+		Send const& send,
+		route const& r,
+		route_match const& match)
+	{
+		return r.on_body(request_type{ req, {}, send, match }, chunk, last);
 	}
 
 
@@ -396,14 +2189,14 @@ namespace server_async {
 		request const& req,
 		std::string const& body) {
 
-		send_content(req.req, req.send, body, ".txt");
+		send_content(req.req, req.send, body, text_header);
 	}
 	
 	void send_json(
 		request const& req,
 		std::string const& body) {
 
-		send_content(req.req, req.send, body, ".json");
+		send_content(req.req, req.send, body, json_header);
 	}
 
 	void send_file(
@@ -414,9 +2207,147 @@ namespace server_async {
 		send_file_t(req.req, req.send, file_path, content_extension);
 	}
 
+	responder defer(request const& req) {
+		auto& s = req.send.self_;
+		s.defer();
+
+		return responder(std::make_shared<responder_state>(s.self()));
+	}
+
+	void responder::send_text(std::string body) const {
+		state_->complete([body = std::move(body)](auto const& req, auto const& send)
+		{
+			send_content(req, send, body, text_header);
+		});
+	}
+
+	void responder::send_json(std::string body) const {
+		state_->complete([body = std::move(body)](auto const& req, auto const& send)
+		{
+			send_content(req, send, body, json_header);
+		});
+	}
+
+	void responder::send_file(
+		std::string file_path,
+		const char* content_extension) const {
+
+		state_->complete([file_path = std::move(file_path), content_extension](auto const& req, auto const& send)
+		{
+			send_file_t(req, send, file_path, content_extension);
+		});
+	}
+
+	void start_workers(
+		unsigned num_threads,
+		std::size_t max_queued) {
+
+		workers.start(num_threads, max_queued);
+	}
+
+	bool post_work(std::function<void()> work) {
+		return workers.try_post(std::move(work));
+	}
+
+	std::string_view path_param(
+		request const& req,
+		std::string_view name) {
+
+		return req.match.get(name);
+	}
+
+	std::string_view query_string(request const& req) {
+
+		return req.match.query;
+	}
+
+	std::string_view wildcard(request const& req) {
+
+		return req.match.wildcard;
+	}
+
+	void set_file_cache(
+		std::size_t max_bytes,
+		std::size_t max_file_bytes) {
+
+		static_files.set_limits(max_bytes, max_file_bytes);
+	}
+
+	file_cache_counters get_file_cache_counters() {
+		return static_files.counters();
+	}
+
+	bool load_mime_types(std::string const& path) {
+		return sutil::load_mime_types(path);
+	}
+
+	void set_compression(std::size_t min_size) {
+		compress_min_size = min_size;
+	}
+
+	void set_admission(
+		std::size_t max_connections,
+		std::size_t max_route_requests,
+		std::chrono::seconds retry_after) {
+
+		admission.max_connections = max_connections;
+		admission.max_route_requests = max_route_requests;
+
+		unavailable_header = response_templates{ http::status::service_unavailable, "text/html", {},
+			"Retry-After: " + std::to_string(retry_after.count()) + "\r\n" };
+	}
+
+	void set_rate_limit(
+		double requests_per_second,
+		double burst,
+		std::size_t max_clients,
+		const char* key_field) {
+
+		rate_limits.configure(requests_per_second, burst, max_clients);
+		rate_key_field = key_field ? key_field : "";
+
+		// Time for one token, in whole seconds
+		auto const retry_after = requests_per_second > 0 ? std::max(1.0, std::ceil(1 / requests_per_second)) : 1.0;
+		too_many_requests_header = response_templates{ http::status::too_many_requests, "text/html", {},
+			"Retry-After: " + std::to_string(static_cast<long long>(retry_after)) + "\r\n" };
+	}
+
+	std::string_view request_body(request const& req) {
+
+		return req.body;
+	}
+
 	// add a callback to the api
 	void add_get(const char* target, callback const& func) {
-		api_map_get[std::string(target)] = func;
+		api.get.add(target, { func, nullptr, metrics::add_route("GET", target) });
+	}
+
+	void add_head(const char* target, callback const& func) {
+		api.head.add(target, { func, nullptr, metrics::add_route("HEAD", target) });
+	}
+
+	void add_post(const char* target, callback const& func) {
+		api.post.add(target, { func, nullptr, metrics::add_route("POST", target) });
+	}
+
+	void add_put(const char* target, callback const& func) {
+		api.put.add(target, { func, nullptr, metrics::add_route("PUT", target) });
+	}
+
+	void add_delete(const char* target, callback const& func) {
+		api.del.add(target, { func, nullptr, metrics::add_route("DELETE", target) });
+	}
+
+	void add_post_stream(const char* target, body_callback const& func) {
+		api.post.add(target, { nullptr, func, metrics::add_route("POST", target) });
+	}
+
+	void add_put_stream(const char* target, body_callback const& func) {
+		api.put.add(target, { nullptr, func, metrics::add_route("PUT", target) });
+	}
+
+	void add_metrics(const char* target) {
+		add_get(target, [](request const& req) { send_text(req, metrics::prometheus_text()); });
 	}
 
 }
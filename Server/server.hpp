@@ -1,21 +1,52 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
 
 namespace server_async {	
 
+	enum class thread_mode {
+		shared,		// one io_context run by all threads, a strand per connection
+		per_thread	// an io_context and SO_REUSEPORT acceptor per thread
+	};
+
+	struct server_state;
+
 	class Server {
 	private:
 		const char* address_;
 		unsigned short port_;
 		unsigned short threads_;
+		thread_mode mode_;
+		bool pin_threads_;
+		std::shared_ptr<server_state> state_;
+
+		static std::shared_ptr<server_state> make_state();
+
+		void start_shared();
+		void start_per_thread();
 
 	public:
 		Server(const char* address, unsigned short port, unsigned short num_threads)
-			: address_(address), port_(port), threads_(num_threads) {}
+			: address_(address), port_(port), threads_(num_threads), mode_(thread_mode::shared), pin_threads_(false), state_(make_state()) {}
 
+		// pin_threads binds thread i to cpu i % hardware_concurrency
+		Server(const char* address, unsigned short port, unsigned short num_threads, thread_mode mode, bool pin_threads = false)
+			: address_(address), port_(port), threads_(num_threads), mode_(mode), pin_threads_(pin_threads), state_(make_state()) {}
+
+		// Runs until stop() is called
 		void start();
 
+		// Stops accepting connections and lets requests in flight finish.
+		// The next response on each connection carries "Connection: close",
+		// connections still open after deadline are closed.
+		// Safe to call from any thread, including a handler. start() returns
+		// once the connections are gone.
+		void stop(std::chrono::milliseconds deadline = std::chrono::seconds(30));
 	};
 
 	// "anonymous" types seen by user of server
@@ -34,9 +65,137 @@ namespace server_async {
 		std::string const& file_path,
 		const char* content_extension = "");
 
+	// Files sent with send_file are cached in memory, 0 max_bytes disables the cache.
+	// max_file_bytes is at most a sixteenth of max_bytes, the size of a shard.
+	// call before the server starts
+	void set_file_cache(
+		std::size_t max_bytes,
+		std::size_t max_file_bytes);
+
+	struct file_cache_counters {
+		std::uint64_t hits;
+		std::uint64_t misses;
+		std::uint64_t evictions;
+		std::uint64_t invalidations;
+		std::size_t entries;
+		std::size_t bytes;
+	};
+
+	file_cache_counters get_file_cache_counters();
+
+	// Content types of send_file by extension, from a mime.types file
+	// such as /etc/mime.types, over the built-in ones. False if the file
+	// cannot be read. Call before the server starts
+	bool load_mime_types(std::string const& path);
+
+	// send_text and send_json bodies of at least min_size bytes are compressed
+	// when the client accepts gzip or deflate, 1024 by default.
+	// SIZE_MAX turns it off. Call before the server starts
+	void set_compression(std::size_t min_size);
+
+	// Admission control, 0 is no limit. Call before the server starts.
+	// At max_connections the server stops accepting until a connection
+	// closes, new clients wait in the listen backlog. A route with
+	// max_route_requests requests between their handler call and their
+	// response answers more with 503 and Retry-After, without calling the handler.
+	void set_admission(
+		std::size_t max_connections,
+		std::size_t max_route_requests,
+		std::chrono::seconds retry_after = std::chrono::seconds(1));
+
+	// Limits each client to requests_per_second, with bursts of up to burst
+	// requests, and answers the rest with 429. Clients are told apart by
+	// their address, or by the value of key_field when a request has it,
+	// such as "X-API-Key". About max_clients are remembered, the least
+	// active are forgotten first. 0 requests_per_second turns it off.
+	// Call before the server starts
+	void set_rate_limit(
+		double requests_per_second,
+		double burst,
+		std::size_t max_clients = 65536,
+		const char* key_field = nullptr);
+
+	// value of a "{name}" segment in the matched route
+	std::string_view path_param(
+		request const& req,
+		std::string_view name);
+
+	// text after '?' in the request target
+	std::string_view query_string(request const& req);
+
+	// remainder of the path matched by a trailing "*"
+	std::string_view wildcard(request const& req);
+
+	struct responder_state;
+
+	// Completes a request taken over with defer(), from any thread.
+	// The response is posted back to the connection. Copies share
+	// the request and only the first send is used. If no copy sends,
+	// the client gets a server error when the last copy is destroyed.
+	class responder {
+	private:
+		std::shared_ptr<responder_state> state_;
+
+	public:
+		explicit responder(std::shared_ptr<responder_state> state)
+			: state_(std::move(state)) {}
+
+		void send_text(std::string body) const;
+
+		void send_json(std::string body) const;
+
+		void send_file(
+			std::string file_path,
+			const char* content_extension = "") const;
+	};
+
+	// Take over the response to req so the handler can return
+	// without answering. The connection waits for the responder
+	// up to 30 seconds, then answers 503 and closes.
+	// req and its path parameters are only valid during the handler call.
+	responder defer(request const& req);
+
+	// Worker threads for handler bodies that would stall the I/O threads
+	// call before the server starts
+	void start_workers(
+		unsigned num_threads,
+		std::size_t max_queued);
+
+	// false if the workers are not started or max_queued is reached
+	bool post_work(std::function<void()> work);
+
+	// body of a request whose route is not streamed
+	std::string_view request_body(request const& req);
+
 	using callback = std::function<void(request const&)>;
 
+	// Called with each piece of the request body as it arrives,
+	// the call with last == true must send the response
+	using body_callback = std::function<void(request const& req, std::string_view chunk, bool last)>;
+
+	// target may contain "{name}" segments and a trailing "*"
+	// e.g. "/users/{id}", "/static/*"
 	void add_get(const char* target, callback const& func);
+
+	// HEAD requests use the GET handler unless one is added here,
+	// either way the response body is not sent
+	void add_head(const char* target, callback const& func);
+
+	// request bodies up to 1MB are read before calling func
+	void add_post(const char* target, callback const& func);
+
+	void add_put(const char* target, callback const& func);
+
+	void add_delete(const char* target, callback const& func);
+
+	// the request body is not held in memory, func gets it in pieces
+	void add_post_stream(const char* target, body_callback const& func);
+
+	void add_put_stream(const char* target, body_callback const& func);
+
+	// request counts, bytes, connections, errors and latency per route
+	// in the Prometheus text format
+	void add_metrics(const char* target = "/metrics");
 }
 
 // https://docs.microsoft.com/en-us/cpp/build/walkthrough-creating-and-using-a-static-library-cpp?view=vs-2019
\ No newline at end of file
@@ -1,48 +1,34 @@
-#include <iostream>
+#include <sys/stat.h>
 
 #include "server_util.hpp"
+#include "mime_types.hpp"
+#include "metrics.hpp"
+#include "logger.hpp"
 
 namespace server_util {
 
 	// Report a failure
 	void fail(beast::error_code ec, char const* what)
 	{
-		std::cerr << what << ": " << ec.message() << "\n";
+		server_async::metrics::record_error(what);
+		server_log::write(server_log::level::error, what, ec.message());
+	}
+
+	static server_async::mime_table& mime_types()
+	{
+		static server_async::mime_table types;
+		return types;
 	}
 
 	// Return a reasonable mime type based on the extension of a file.
 	beast::string_view mime_type(beast::string_view path)
 	{
-		using beast::iequals;
-		auto const ext = [&path]
-		{
-			auto const pos = path.rfind(".");
-			if (pos == beast::string_view::npos)
-				return beast::string_view{};
-			return path.substr(pos);
-		}();
-		if (iequals(ext, ".htm"))  return "text/html";
-		if (iequals(ext, ".html")) return "text/html";
-		if (iequals(ext, ".php"))  return "text/html";
-		if (iequals(ext, ".css"))  return "text/css";
-		if (iequals(ext, ".txt"))  return "text/plain";
-		if (iequals(ext, ".js"))   return "application/javascript";
-		if (iequals(ext, ".json")) return "application/json";
-		if (iequals(ext, ".xml"))  return "application/xml";
-		if (iequals(ext, ".swf"))  return "application/x-shockwave-flash";
-		if (iequals(ext, ".flv"))  return "video/x-flv";
-		if (iequals(ext, ".png"))  return "image/png";
-		if (iequals(ext, ".jpe"))  return "image/jpeg";
-		if (iequals(ext, ".jpeg")) return "image/jpeg";
-		if (iequals(ext, ".jpg"))  return "image/jpeg";
-		if (iequals(ext, ".gif"))  return "image/gif";
-		if (iequals(ext, ".bmp"))  return "image/bmp";
-		if (iequals(ext, ".ico"))  return "image/vnd.microsoft.icon";
-		if (iequals(ext, ".tiff")) return "image/tiff";
-		if (iequals(ext, ".tif"))  return "image/tiff";
-		if (iequals(ext, ".svg"))  return "image/svg+xml";
-		if (iequals(ext, ".svgz")) return "image/svg+xml";
-		return "application/text";
+		return mime_types().find(path);
+	}
+
+	bool load_mime_types(std::string const& path)
+	{
+		return mime_types().load(path);
 	}
 
 	// Append an HTTP rel-path to a local filesystem path.
@@ -69,6 +55,33 @@ namespace server_util {
 		return result;
 	}
 
-	
+	// Format a time as an IMF-fixdate, e.g. "Sun, 06 Nov 1994 08:49:37 GMT"
+	std::string http_date(std::time_t time)
+	{
+		char buffer[32];
+		return std::string(buffer, http_date(time, buffer, sizeof(buffer)));
+	}
+
+	std::size_t http_date(std::time_t time, char* buffer, std::size_t size)
+	{
+		std::tm tm{};
+#ifdef BOOST_MSVC
+		gmtime_s(&tm, &time);
+#else
+		gmtime_r(&time, &tm);
+#endif
+		return std::strftime(buffer, size, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+	}
+
+	bool file_status(std::string const& path, std::uint64_t& size, std::time_t& mtime)
+	{
+		struct stat st;
+		if (::stat(path.c_str(), &st) != 0)
+			return false;
+
+		size = static_cast<std::uint64_t>(st.st_size);
+		mtime = st.st_mtime;
+		return true;
+	}
 
 }
\ No newline at end of file
@@ -4,6 +4,8 @@
 #include <boost/beast/version.hpp>
 #include <boost/asio/strand.hpp>
 #include <boost/config.hpp>
+#include <cstdint>
+#include <ctime>
 #include <string>
 
 namespace beast = boost::beast;         // from <boost/beast.hpp>
@@ -11,14 +13,27 @@ namespace http = beast::http;           // from <boost/beast/http.hpp>
 namespace net = boost::asio;            // from <boost/asio.hpp>
 using tcp = boost::asio::ip::tcp;       // from <boost/asio/ip/tcp.hpp>
 
+#define ADAM_VERSION_STRING "adam server"
+
 namespace server_util {
 
 	void fail(beast::error_code ec, char const* what);
 
 	beast::string_view mime_type(beast::string_view path);
 
+	// Adds the types of a mime.types file, not safe while mime_type is called
+	bool load_mime_types(std::string const& path);
+
 	std::string path_cat(beast::string_view base, beast::string_view path);
 
+	std::string http_date(std::time_t time);
+
+	// Writes the date into buffer, which holds 29 characters, and returns its length
+	std::size_t http_date(std::time_t time, char* buffer, std::size_t size);
+
+	// false if the file cannot be found
+	bool file_status(std::string const& path, std::uint64_t& size, std::time_t& mtime);
+
 }
 
 
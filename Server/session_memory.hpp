@@ -0,0 +1,139 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+#include <new>
+#include <tuple>
+#include <utility>
+
+#include "server_util.hpp"
+
+// Memory of the messages of a connection, given back all at once between requests.
+// Header only so the example servers can use it as well.
+namespace server_async {
+
+	// Chunks for the sessions' monotonic resources, cached by the calling
+	// thread in power of two size classes so a busy thread stops calling
+	// the global heap. A chunk given back on another thread than the one
+	// it came from joins that thread's cache.
+	class chunk_pool : public std::pmr::memory_resource {
+	private:
+		static constexpr std::size_t min_shift = 10;   // 1KB
+		static constexpr std::size_t num_classes = 8;  // up to 128KB
+		static constexpr std::size_t max_cached = 32;  // chunks per class and thread
+
+		struct chunk {
+			chunk* next;
+		};
+
+		struct cache {
+			std::array<chunk*, num_classes> heads{};
+			std::array<std::size_t, num_classes> counts{};
+
+			~cache() {
+				for (auto head : heads) {
+					while (head) {
+						auto const next = head->next;
+						::operator delete(head);
+						head = next;
+					}
+				}
+			}
+		};
+
+		static cache& local() {
+			thread_local cache c;
+			return c;
+		}
+
+		// num_classes for chunks too large to cache
+		static std::size_t size_class(std::size_t bytes) {
+			std::size_t c = 0;
+			while (c < num_classes && (std::size_t(1) << (min_shift + c)) < bytes)
+				++c;
+
+			return c;
+		}
+
+		void* do_allocate(std::size_t bytes, std::size_t alignment) override {
+			auto const c = size_class(bytes);
+			if (c == num_classes || alignment > alignof(std::max_align_t))
+				return ::operator new(bytes, std::align_val_t(alignment));
+
+			auto& cached = local();
+			if (auto const head = cached.heads[c]) {
+				cached.heads[c] = head->next;
+				--cached.counts[c];
+				return head;
+			}
+
+			return ::operator new(std::size_t(1) << (min_shift + c));
+		}
+
+		void do_deallocate(void* p, std::size_t bytes, std::size_t alignment) override {
+			auto const c = size_class(bytes);
+			if (c == num_classes || alignment > alignof(std::max_align_t))
+				return ::operator delete(p, std::align_val_t(alignment));
+
+			auto& cached = local();
+			if (cached.counts[c] == max_cached)
+				return ::operator delete(p);
+
+			cached.heads[c] = ::new(p) chunk{ cached.heads[c] };
+			++cached.counts[c];
+		}
+
+		bool do_is_equal(std::pmr::memory_resource const& other) const noexcept override {
+			return this == &other;
+		}
+
+	public:
+		static chunk_pool& instance() {
+			static chunk_pool pool;
+			return pool;
+		}
+	};
+
+	using session_allocator = std::pmr::polymorphic_allocator<char>;
+	using session_fields = http::basic_fields<session_allocator>;
+	using session_string_body = http::basic_string_body<char, std::char_traits<char>, session_allocator>;
+
+	// A response allocated like req, its body constructed from body_args
+	template<class Body, class Request, class... BodyArgs>
+	http::response<Body, typename Request::fields_type> make_response(http::status status, Request const& req, BodyArgs&&... body_args)
+	{
+		return {
+			std::piecewise_construct,
+			std::forward_as_tuple(std::forward<BodyArgs>(body_args)...),
+			std::make_tuple(status, req.version(), req.get_allocator()) };
+	}
+
+	// The request and response memory of a connection. Messages made with
+	// allocator() take from a buffer inside the session, then from chunks
+	// of the pool, and nothing is freed until reset(), so the messages
+	// of a keep-alive connection stop calling the global heap.
+	class session_memory {
+	private:
+		static constexpr std::size_t initial_size = 2048;
+
+		alignas(std::max_align_t) std::array<char, initial_size> initial_;
+		std::pmr::monotonic_buffer_resource resource_;
+
+	public:
+		session_memory()
+			: resource_(initial_.data(), initial_.size(), &chunk_pool::instance()) {}
+
+		session_memory(session_memory const&) = delete;
+		session_memory& operator=(session_memory const&) = delete;
+
+		session_allocator allocator() {
+			return &resource_;
+		}
+
+		// Every message made with allocator() must be destroyed first
+		void reset() {
+			resource_.release();
+		}
+	};
+}
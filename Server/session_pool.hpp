@@ -0,0 +1,131 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+
+// Sessions kept once their connection closes and used again for the next one,
+// so accepting does not allocate a session, its stream and its buffers.
+// Header only so the example servers can use it as well.
+namespace server_async {
+
+	template<class T>
+	class session_pool;
+
+	// Base of a session T held by boost::intrusive_ptr instead of shared_ptr.
+	// The last reference gives the session back to the pool it came from.
+	template<class T>
+	class pooled_session {
+	private:
+		friend class session_pool<T>;
+
+		std::atomic<std::size_t> refs_{ 0 };
+		std::shared_ptr<session_pool<T>> pool_;
+
+		friend void intrusive_ptr_add_ref(pooled_session* s) {
+			s->refs_.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		friend void intrusive_ptr_release(pooled_session* s) {
+			if (s->refs_.fetch_sub(1, std::memory_order_acq_rel) == 1)
+				s->recycle();
+		}
+
+		void recycle() {
+			// The pool may go with this last reference to it
+			auto const pool = std::move(pool_);
+			if (pool)
+				pool->recycle(static_cast<T*>(this));
+			else
+				delete static_cast<T*>(this);
+		}
+
+	protected:
+		pooled_session() = default;
+		~pooled_session() = default;
+
+	public:
+		pooled_session(pooled_session const&) = delete;
+		pooled_session& operator=(pooled_session const&) = delete;
+
+		boost::intrusive_ptr<T> self() {
+			return boost::intrusive_ptr<T>(static_cast<T*>(this));
+		}
+
+		// Like weak_ptr::lock, empty once the last reference is gone
+		boost::intrusive_ptr<T> try_self() {
+			auto n = refs_.load(std::memory_order_relaxed);
+			while (n != 0)
+			{
+				if (refs_.compare_exchange_weak(n, n + 1, std::memory_order_acquire, std::memory_order_relaxed))
+					return boost::intrusive_ptr<T>(static_cast<T*>(this), false);
+			}
+
+			return nullptr;
+		}
+	};
+
+	// Idle sessions of one listener. The listeners of the per thread
+	// mode each have their own, so a session mostly comes back to the
+	// thread it was made on, the lock is for the few that do not.
+	// T derives from pooled_session<T> and has bool reset(), which ends
+	// the connection and keeps the memory, false if T cannot be used again.
+	template<class T>
+	class session_pool : public std::enable_shared_from_this<session_pool<T>> {
+	private:
+		friend class pooled_session<T>;
+
+		std::mutex mutex_;
+		std::vector<T*> idle_;
+		std::size_t max_idle_;
+
+		// Called with the last reference to s
+		void recycle(T* s) {
+			if (s->reset())
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (idle_.size() < max_idle_)
+					return idle_.push_back(s);
+			}
+
+			delete s;
+		}
+
+	public:
+		explicit session_pool(std::size_t max_idle = 1024)
+			: max_idle_(max_idle) {}
+
+		session_pool(session_pool const&) = delete;
+		session_pool& operator=(session_pool const&) = delete;
+
+		~session_pool() {
+			for (auto const s : idle_)
+				delete s;
+		}
+
+		// An idle session, or the one make() returns from new if there is none
+		template<class Make>
+		boost::intrusive_ptr<T> acquire(Make&& make) {
+			T* s = nullptr;
+			{
+				std::lock_guard<std::mutex> lock(mutex_);
+				if (!idle_.empty())
+				{
+					s = idle_.back();
+					idle_.pop_back();
+				}
+			}
+
+			if (!s)
+				s = make();
+
+			s->pool_ = this->shared_from_this();
+			return boost::intrusive_ptr<T>(s);
+		}
+	};
+}
@@ -1,7 +1,15 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <thread>
 
 #include "server.hpp"
+#include "logger.hpp"
 
 namespace svr = server_async;
 
@@ -9,39 +17,121 @@ namespace svr = server_async;
 auto constexpr send_text = 
 [](auto const& req) { 
 	svr::send_text(req, "Here is some text"); 
-	std::cout << "send_text\n"; 
+	server_log::write(server_log::level::info, "send_text"); 
 };
 
 auto constexpr send_json = 
 [](auto const& req) { 
 	svr::send_json(req, "[{key: 'k1', value: 'v1'}, {key: 'k2', value: 'v2'}]"); 
-	std::cout << "send_json\n"; 
+	server_log::write(server_log::level::info, "send_json"); 
 };
 
 auto constexpr send_file = 
 [](auto const& req) { 
 	svr::send_file(req, "./index.html"); 
-	std::cout << "send_file\n"; 
+	server_log::write(server_log::level::info, "send_file"); 
 };
 
+auto constexpr send_user = 
+[](auto const& req) { 
+	svr::send_text(req, "user " + std::string(svr::path_param(req, "id"))); 
+	server_log::write(server_log::level::info, "send_user"); 
+};
+
+// answered later from a worker thread
+auto constexpr send_sum = 
+[](auto const& req) { 
+	auto const n = std::strtoul(std::string(svr::path_param(req, "n")).c_str(), nullptr, 10);
+	auto res = svr::defer(req);
+
+	auto const posted = svr::post_work([res, n]() { 
+		unsigned long long sum = 0;
+		for (unsigned long i = 1; i <= n; ++i)
+			sum += i;
+
+		res.send_json("{\"sum\": " + std::to_string(sum) + "}"); 
+	});
+
+	if (!posted)
+		res.send_text("busy");
+
+	server_log::write(server_log::level::info, "send_sum"); 
+};
+
+auto constexpr send_echo = 
+[](auto const& req) { 
+	svr::send_text(req, std::string(svr::request_body(req))); 
+	server_log::write(server_log::level::info, "send_echo"); 
+};
+
+// counts uploaded bytes without holding them in memory
+std::atomic<unsigned long long> uploaded_bytes = 0;
+
+auto constexpr receive_upload = 
+[](auto const& req, std::string_view chunk, bool last) { 
+	uploaded_bytes += chunk.size();
+
+	if (!last)
+		return;
+
+	svr::send_json(req, "{\"uploaded\": " + std::to_string(uploaded_bytes.load()) + "}");
+	server_log::write(server_log::level::info, "receive_upload"); 
+};
+
+std::atomic<bool> stop_requested = false;
+
+extern "C" void on_signal(int) {
+	stop_requested = true;
+}
+
 void build_api() {
 	svr::add_get("/text", send_text);
 	svr::add_get("/json", send_json);
 	svr::add_get("/file", send_file);
+	svr::add_get("/users/{id}", send_user);
+	svr::add_get("/sum/{n}", send_sum);
+	svr::add_post("/echo", send_echo);
+	svr::add_post_stream("/upload", receive_upload);
+	svr::add_metrics();
 }
 
-int main() {
+// Server [threads] [shared|per_thread] [mime.types]
+int main(int argc, char* argv[]) {
 
 	try {
 
+		// write from a background thread instead of the I/O threads
+		server_log::start();
+
 		build_api();		
+		svr::start_workers(2, 1000);
 
 		auto address = "0.0.0.0";
 		auto port = 5000;
-		auto threads = 5;
-		svr::Server server(address, port, threads);
+		auto threads = argc > 1 ? std::max(1, std::atoi(argv[1])) : 5;
+		auto mode = argc > 2 && std::strcmp(argv[2], "per_thread") == 0 ? svr::thread_mode::per_thread : svr::thread_mode::shared;
+
+		// content types beyond the built-in ones, e.g. /etc/mime.types
+		if (argc > 3 && !svr::load_mime_types(argv[3]))
+			std::cerr << "Cannot read " << argv[3] << ", using the built-in content types\n";
+
+		svr::Server server(address, port, static_cast<unsigned short>(threads), mode);
+
+		// Ctrl+C or SIGTERM finish the requests in flight before exiting
+		std::signal(SIGINT, on_signal);
+		std::signal(SIGTERM, on_signal);
+
+		std::thread stopper([&server]() {
+			while (!stop_requested)
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+			server.stop(std::chrono::seconds(10));
+		});
 
 		server.start();		
+
+		stop_requested = true;
+		stopper.join();
 	}
 	catch (std::exception const& e)
 	{
@@ -0,0 +1,228 @@
+#pragma once
+
+#include <boost/asio/any_io_executor.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+
+namespace server_async {
+
+	// For a wheel only used from the thread that runs its executor
+	struct null_mutex {
+		void lock() {}
+		void unlock() {}
+	};
+
+	// For a wheel shared by threads in some configurations only,
+	// whether it locks is chosen when it is made
+	class optional_mutex {
+	private:
+		std::mutex mutex_;
+		bool const enabled_;
+
+	public:
+		explicit optional_mutex(bool enabled = true) : enabled_(enabled) {}
+
+		void lock() { if (enabled_) mutex_.lock(); }
+		void unlock() { if (enabled_) mutex_.unlock(); }
+	};
+
+	// Hashed hierarchical timer wheel for connection deadlines.
+	//
+	// An entry is linked into the slot of the tick it expires on, so arming
+	// and cancelling are O(1) and nothing is allocated. Deadlines are rounded
+	// up to whole ticks. The first level holds the next level0_slots ticks,
+	// the second level holds level1_slots spans of level0_slots ticks each and
+	// is moved down one span at a time. Longer deadlines wait in the last span.
+	//
+	// One steady_timer drives the whole wheel, instead of one timer per
+	// connection in the io_context's timer heap.
+	template<class Mutex = null_mutex>
+	class timer_wheel {
+	public:
+		using clock = std::chrono::steady_clock;
+
+		static constexpr std::size_t level0_slots = 256;
+		static constexpr std::size_t level1_slots = 64;
+
+	private:
+		struct node {
+			node* prev = nullptr;
+			node* next = nullptr;
+		};
+
+	public:
+		// Owned by the object being timed
+		class entry : private node {
+		private:
+			friend class timer_wheel;
+
+			timer_wheel& wheel_;
+			std::uint64_t expiry_ = 0;
+			std::function<void()> on_expire_;
+
+		public:
+			explicit entry(timer_wheel& wheel) : wheel_(wheel) {}
+
+			entry(entry const&) = delete;
+			entry& operator=(entry const&) = delete;
+
+			~entry() { cancel(); }
+
+			// Runs on the wheel's executor with the wheel locked, so it must
+			// not arm or cancel entries. Post the work to the owner instead.
+			// Set before the entry is first armed.
+			void on_expire(std::function<void()> f) { on_expire_ = std::move(f); }
+
+			// Replaces any deadline set before
+			void arm(clock::duration timeout) { wheel_.arm(*this, timeout); }
+
+			void cancel() { wheel_.cancel(*this); }
+
+			bool armed() const {
+				std::lock_guard<Mutex> lock(wheel_.mutex_);
+				return this->next != nullptr;
+			}
+		};
+
+	private:
+		Mutex mutable mutex_;
+		boost::asio::steady_timer timer_;
+		clock::duration tick_;
+		clock::time_point start_;
+		std::uint64_t now_ = 0; // ticks since start_
+
+		std::array<node, level0_slots> level0_;
+		std::array<node, level1_slots> level1_;
+
+		static void unlink(node& n) {
+			n.prev->next = n.next;
+			n.next->prev = n.prev;
+			n.prev = n.next = nullptr;
+		}
+
+		static void push_back(node& slot, node& n) {
+			n.prev = slot.prev;
+			n.next = &slot;
+			slot.prev->next = &n;
+			slot.prev = &n;
+		}
+
+		void link(entry& e) {
+			auto const delta = e.expiry_ - now_;
+
+			if (delta < level0_slots)
+				return push_back(level0_[e.expiry_ % level0_slots], e);
+
+			if (delta < level0_slots * level1_slots)
+				return push_back(level1_[(e.expiry_ / level0_slots) % level1_slots], e);
+
+			push_back(level1_[(now_ / level0_slots + level1_slots - 1) % level1_slots], e);
+		}
+
+		void arm(entry& e, clock::duration timeout) {
+			auto const ticks = (timeout + tick_ - clock::duration(1)) / tick_;
+
+			std::lock_guard<Mutex> lock(mutex_);
+			if (e.next)
+				unlink(e);
+
+			e.expiry_ = now_ + static_cast<std::uint64_t>(std::max<decltype(ticks)>(ticks, 1));
+			link(e);
+		}
+
+		void cancel(entry& e) {
+			std::lock_guard<Mutex> lock(mutex_);
+			if (e.next)
+				unlink(e);
+		}
+
+		// Moves the entries of the span that starts now into the first level
+		void cascade() {
+			auto& slot = level1_[(now_ / level0_slots) % level1_slots];
+			while (slot.next != &slot)
+			{
+				auto& e = static_cast<entry&>(*slot.next);
+				unlink(e);
+				link(e);
+			}
+		}
+
+		void expire() {
+			auto& slot = level0_[now_ % level0_slots];
+			while (slot.next != &slot)
+			{
+				auto& e = static_cast<entry&>(*slot.next);
+				unlink(e);
+				if (e.on_expire_)
+					e.on_expire_();
+			}
+		}
+
+		void schedule() {
+			timer_.expires_at(start_ + tick_ * static_cast<clock::rep>(now_ + 1));
+			timer_.async_wait([this](boost::system::error_code ec)
+			{
+				if (ec)
+					return;
+
+				on_tick();
+			});
+		}
+
+		void on_tick() {
+			auto const target = static_cast<std::uint64_t>((clock::now() - start_) / tick_);
+
+			std::lock_guard<Mutex> lock(mutex_);
+
+			// A late tick catches up on the ticks it missed
+			while (now_ < target)
+			{
+				++now_;
+				if (now_ % level0_slots == 0)
+					cascade();
+
+				expire();
+			}
+
+			schedule();
+		}
+
+	public:
+		static constexpr auto default_tick = std::chrono::milliseconds(250);
+
+		// The wheel must outlive its entries and stay in one place.
+		// lock_args construct the Mutex
+		template<class... LockArgs>
+		explicit timer_wheel(
+			boost::asio::any_io_executor ex,
+			clock::duration tick = default_tick,
+			LockArgs&&... lock_args)
+			: mutex_(std::forward<LockArgs>(lock_args)...), timer_(std::move(ex)), tick_(tick), start_(clock::now())
+		{
+			for (auto& slot : level0_)
+				slot.prev = slot.next = &slot;
+
+			for (auto& slot : level1_)
+				slot.prev = slot.next = &slot;
+		}
+
+		timer_wheel(timer_wheel const&) = delete;
+		timer_wheel& operator=(timer_wheel const&) = delete;
+
+		// Starts ticking, call once
+		void start() {
+			std::lock_guard<Mutex> lock(mutex_);
+			schedule();
+		}
+
+		void stop() {
+			std::lock_guard<Mutex> lock(mutex_);
+			timer_.cancel();
+		}
+	};
+}
@@ -0,0 +1,73 @@
+#include "worker_pool.hpp"
+
+namespace server_async {
+
+	worker_pool::~worker_pool()
+	{
+		stop();
+	}
+
+	void worker_pool::start(unsigned num_threads, std::size_t max_queued)
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		max_queued_ = max_queued;
+		stop_ = false;
+
+		threads_.reserve(threads_.size() + num_threads);
+		for (unsigned i = 0; i < num_threads; ++i)
+			threads_.emplace_back([this] { run(); });
+	}
+
+	bool worker_pool::try_post(std::function<void()> work)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+
+			if (stop_ || threads_.empty() || queue_.size() >= max_queued_)
+				return false;
+
+			queue_.push_back(std::move(work));
+		}
+
+		ready_.notify_one();
+		return true;
+	}
+
+	void worker_pool::stop()
+	{
+		std::vector<std::thread> threads;
+
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			stop_ = true;
+			threads.swap(threads_);
+		}
+
+		ready_.notify_all();
+
+		for (auto& t : threads)
+			t.join();
+	}
+
+	void worker_pool::run()
+	{
+		for (;;)
+		{
+			std::function<void()> work;
+
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				ready_.wait(lock, [this] { return stop_ || !queue_.empty(); });
+
+				if (queue_.empty())
+					return;
+
+				work = std::move(queue_.front());
+				queue_.pop_front();
+			}
+
+			work();
+		}
+	}
+}
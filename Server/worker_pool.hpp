@@ -0,0 +1,41 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace server_async {
+
+	// Fixed number of threads taking work from a bounded queue.
+	// Used to run handler bodies away from the I/O threads.
+	class worker_pool {
+	private:
+		std::mutex mutex_;
+		std::condition_variable ready_;
+		std::deque<std::function<void()>> queue_;
+		std::size_t max_queued_ = 0;
+		bool stop_ = false;
+		std::vector<std::thread> threads_;
+
+		void run();
+
+	public:
+		worker_pool() = default;
+		~worker_pool();
+
+		worker_pool(worker_pool const&) = delete;
+		worker_pool& operator=(worker_pool const&) = delete;
+
+		void start(unsigned num_threads, std::size_t max_queued);
+
+		// false if the pool is not running or the queue is full
+		bool try_post(std::function<void()> work);
+
+		// finishes the queued work then joins the threads
+		void stop();
+	};
+}